@@ -48,6 +48,12 @@ typedef enum {
 	DIS_OPT_VOLUME_OFFSET,
 	DIS_OPT_READ_ONLY,
 	DIS_OPT_DONT_CHECK_VOLUME_STATE,
+	DIS_OPT_THREADS,
+	DIS_OPT_CACHE_SIZE,
+	DIS_OPT_READAHEAD,
+	DIS_OPT_DIRECT_IO,
+	DIS_OPT_WRITEBACK_SIZE,
+	DIS_OPT_CRYPTO_BACKEND,
 
 	/* Below are options for users of the library (i.e: developers) */
 	DIS_OPT_INITIALIZE_STATE
@@ -24,6 +24,7 @@
 #define DIS_CONFIG_PRIV_H
 
 #include "dislocker/config.h"
+#include "dislocker/encryption/encommon.h"
 
 
 /**
@@ -52,6 +53,11 @@ typedef enum {
 	 * if mounted using fuse
 	 */
 	DIS_FLAG_DONT_CHECK_VOLUME_STATE = (1 << 1),
+	/*
+	 * Access the volume bypassing the kernel's page cache, so that only
+	 * decrypted data is cached
+	 */
+	DIS_FLAG_DIRECT_IO               = (1 << 2),
 } dis_flags_e;
 
 
@@ -96,6 +102,32 @@ typedef struct _dis_cfg {
 	 */
 	dis_flags_e   flags;
 
+	/*
+	 * Number of threads used for enc/decryption, 0 to have it computed out of
+	 * the CPUs available
+	 */
+	unsigned int  nb_threads;
+
+	/*
+	 * Memory used to keep decrypted sectors, in MiB, 0 to disable the cache
+	 */
+	unsigned int  cache_size;
+
+	/*
+	 * Number of requests read ahead of sequential readers, into the cache, 0 to
+	 * disable readahead
+	 */
+	unsigned int  readahead;
+
+	/*
+	 * Memory used to keep written data before writing it to the volume, in MiB,
+	 * 0 to write data straight away
+	 */
+	unsigned int  writeback_size;
+
+	/* Implementation used to enc/decrypt sectors */
+	dis_crypt_backend_t crypto_backend;
+
 	/* Where dis_initialize() should stop */
 	dis_state_e   init_stop_at;
 } dis_config_t;
@@ -85,6 +85,26 @@ int dislock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size);
  */
 int enlock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size);
 
+/**
+ * Write to the volume the data enlock() kept in memory, if it's been asked to
+ * keep written data. This is to be called when the data has to be seen by
+ * the other users of the volume, such as on close(2).
+ *
+ * @param dis_ctx The same parameter passed to dis_initialize.
+ * @return 0 on success, a negative errno otherwise
+ */
+int dis_flush(dis_context_t dis_ctx);
+
+/**
+ * The same as dis_flush(), then wait for everything written to the volume to
+ * reach the disk, as fsync(2) -- or fdatasync(2) if datasync is non-zero.
+ *
+ * @param dis_ctx The same parameter passed to dis_initialize.
+ * @param datasync Whether only the data has to reach the disk
+ * @return 0 on success, a negative errno otherwise
+ */
+int dis_fsync(dis_context_t dis_ctx, int datasync);
+
 /**
  * Destroy dislocker structures. This is important to call this function after
  * dislocker is not needed -- if dis_initialize() has been called -- in order
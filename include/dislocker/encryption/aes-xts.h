@@ -29,6 +29,12 @@
 /*
  * Prototypes
  */
+void dis_xts_tweaks(
+	const unsigned char (*first)[16],
+	size_t nb_sequences,
+	size_t nb_blocks,
+	unsigned char (*tweaks)[16]
+);
 int dis_aes_crypt_xex(
 	AES_CONTEXT *crypt_ctx,
 	AES_CONTEXT *tweak_ctx,
@@ -0,0 +1,169 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef DIS_AESNI_H
+#define DIS_AESNI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * CPU features the AES-NI code can use, found out by dis_aesni_features()
+ */
+typedef enum {
+	/* AES-NI instructions, along with SSE2 */
+	DIS_AESNI_AES         = (1 << 0),
+	/* VAES and VPCLMULQDQ on AVX2's 256 bits registers, 2 blocks at once */
+	DIS_AESNI_VAES_AVX2   = (1 << 1),
+	/* VAES and VPCLMULQDQ on AVX-512's registers, 4 blocks at once */
+	DIS_AESNI_VAES_AVX512 = (1 << 2),
+	/* PCLMULQDQ, along with SSE2, for the XTS tweaks */
+	DIS_AESNI_CLMUL       = (1 << 3),
+	/* AVX2, for the diffuser */
+	DIS_AESNI_AVX2        = (1 << 4)
+} dis_aesni_features_e;
+
+
+/*
+ * Below this size, the VAES kernels leave data to the AES-NI one: the wider
+ * units aren't worth it for small requests, which would just make the CPU
+ * lower its frequency. dis_aesni_xts_sectors() compares it to the size of the
+ * whole batch of sectors.
+ */
+#define DIS_AESNI_WIDE_MIN_SIZE 4096
+
+/* Number of CBC chains dis_aesni_cbc_encrypt_chains() can interleave */
+#define DIS_AESNI_CBC_CHAINS 8
+
+
+/**
+ * AES round keys, as used by the AES-NI instructions. The decryption ones are
+ * the encryption ones in reverse order, run through AESIMC.
+ */
+typedef struct _dis_aesni_key {
+	uint8_t enc[15][16];
+	uint8_t dec[15][16];
+	int     rounds;
+} __attribute__ ((aligned (16))) dis_aesni_key_t;
+
+
+
+/**
+ * An XTS kernel, see dis_aesni_xts()
+ */
+typedef int (*dis_aesni_xts_fn_t)(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+
+
+/*
+ * Functions prototypes
+ */
+unsigned int dis_aesni_features(void);
+
+int dis_aesni_set_key(dis_aesni_key_t* key, const uint8_t* raw_key, unsigned int bits);
+
+int dis_aesni_xts(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+int dis_aesni_xts_vaes256(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+int dis_aesni_xts_vaes512(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+dis_aesni_xts_fn_t dis_aesni_xts_select(unsigned int features);
+
+int dis_aesni_xts_sectors(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	unsigned int features,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_index,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+int dis_aesni_ecb_encrypt(
+	const dis_aesni_key_t* key,
+	size_t nb_blocks,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+int dis_aesni_cbc_decrypt(
+	const dis_aesni_key_t* key,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+int dis_aesni_cbc_encrypt_chains(
+	const dis_aesni_key_t* key,
+	size_t nb_chains,
+	size_t length,
+	const uint8_t (*ivs)[16],
+	const uint8_t* input,
+	uint8_t* output
+);
+
+void dis_aesni_xts_tweaks(
+	const uint8_t (*first)[16],
+	size_t nb_sequences,
+	size_t nb_blocks,
+	uint8_t (*tweaks)[16]
+);
+
+
+#endif /* DIS_AESNI_H */
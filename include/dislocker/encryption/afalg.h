@@ -0,0 +1,75 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef DIS_AFALG_H
+#define DIS_AFALG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Below this size, batches of sectors are left to userspace: the system calls
+ * needed for each sector aren't worth it for small requests
+ */
+#define DIS_AFALG_MIN_SIZE (64 * 1024)
+
+
+/**
+ * Keys given to the kernel's crypto API through AF_ALG sockets, opaque so
+ * that only encryption/afalg.c depends on Linux's headers
+ */
+typedef struct _dis_afalg_keys dis_afalg_keys_t;
+
+
+
+/*
+ * Functions prototypes
+ */
+dis_afalg_keys_t* dis_afalg_new(void);
+
+int dis_afalg_set_key(dis_afalg_keys_t* keys, uint16_t algorithm, const uint8_t* fvekey);
+
+size_t dis_afalg_xts_sectors(
+	dis_afalg_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_index,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+size_t dis_afalg_cbc_sectors(
+	dis_afalg_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_address,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+void dis_afalg_destroy(dis_afalg_keys_t* keys);
+
+
+#endif /* DIS_AFALG_H */
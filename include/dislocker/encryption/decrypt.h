@@ -55,6 +55,15 @@ void decrypt_cbc_without_diffuser(
 	uint8_t* buffer
 );
 
+void decrypt_cbc_sectors_without_diffuser(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+
 void decrypt_cbc_with_diffuser(
 	dis_aes_contexts_t* ctx,
 	uint16_t sector_size,
@@ -63,6 +72,15 @@ void decrypt_cbc_with_diffuser(
 	uint8_t* buffer
 );
 
+void decrypt_cbc_sectors_with_diffuser(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+
 void decrypt_xts(
 	dis_aes_contexts_t* ctx,
 	uint16_t sector_size,
@@ -71,6 +89,56 @@ void decrypt_xts(
 	uint8_t* buffer
 );
 
+void decrypt_xts_sectors(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+
+/*
+ * The functions above depending on the sector size, specialized for 512 and
+ * 4096 bytes sectors, their sector_size parameter being ignored
+ */
+#define DECRYPT_SIZED_PROTOTYPES(size) \
+	void decrypt_cbc_with_diffuser_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		uint8_t* sector, \
+		off_t sector_address, \
+		uint8_t* buffer \
+	); \
+	void decrypt_cbc_sectors_with_diffuser_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		size_t nb_sectors, \
+		uint8_t* sectors, \
+		off_t sector_address, \
+		uint8_t* buffer \
+	); \
+	void decrypt_xts_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		uint8_t* sector, \
+		off_t sector_address, \
+		uint8_t* buffer \
+	); \
+	void decrypt_xts_sectors_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		size_t nb_sectors, \
+		uint8_t* sectors, \
+		off_t sector_address, \
+		uint8_t* buffer \
+	);
+
+DECRYPT_SIZED_PROTOTYPES(512)
+DECRYPT_SIZED_PROTOTYPES(4096)
+
+#undef DECRYPT_SIZED_PROTOTYPES
+
 int decrypt_sector(dis_crypt_t crypt, uint8_t* sector, off_t sector_address, uint8_t* buffer);
 
 
@@ -38,6 +38,30 @@ void diffuserA_encrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer);
 
 void diffuserB_encrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer);
 
+void diffuser_apply_sector_key(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer);
+
+void diffuser_decrypt_sector(uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key);
+
+void diffuser_encrypt_sector(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer);
+
+/* The same, for 512 and 4096 bytes sectors only, sector_size being ignored */
+void diffuser_decrypt_sector_512(uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key);
+
+void diffuser_encrypt_sector_512(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer);
+
+void diffuser_decrypt_sector_4096(uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key);
+
+void diffuser_encrypt_sector_4096(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer);
+
+/* One element at a time, to check the functions above against */
+void diffuserA_decrypt_reference(uint8_t* sector, uint16_t sector_size, uint32_t* buffer);
+
+void diffuserB_decrypt_reference(uint8_t* sector, uint16_t sector_size, uint32_t* buffer);
+
+void diffuserA_encrypt_reference(uint8_t* sector, uint16_t sector_size, uint32_t* buffer);
+
+void diffuserB_encrypt_reference(uint8_t* sector, uint16_t sector_size, uint32_t* buffer);
+
 
 
 
@@ -24,6 +24,7 @@
 #define ENCOMMON_H
 
 #include <stdint.h>
+#include <sys/types.h>
 
 /**
  * Cipher used within BitLocker
@@ -51,6 +52,19 @@ enum cipher_types
 typedef uint16_t cipher_t;
 
 
+/**
+ * Implementations the sectors can be enc/decrypted with
+ */
+typedef enum {
+	/* PolarSSL/mbedTLS, along with AES-NI when the CPU has it */
+	DIS_CRYPT_BACKEND_BUILTIN = 0,
+	/* OpenSSL's EVP interface, if dislocker was built with it */
+	DIS_CRYPT_BACKEND_OPENSSL,
+	/* Linux's crypto API through AF_ALG sockets, for large batches only */
+	DIS_CRYPT_BACKEND_KERNEL
+} dis_crypt_backend_t;
+
+
 /**
  * AES contexts "used" during encryption/decryption
  * @see encryption/decrypt.c
@@ -70,9 +84,17 @@ typedef struct _dis_crypt* dis_crypt_t;
  */
 dis_crypt_t dis_crypt_new(uint16_t sector_size, cipher_t disk_cipher);
 
+int dis_crypt_set_backend(dis_crypt_t crypt, dis_crypt_backend_t backend);
+
 int dis_crypt_set_fvekey(dis_crypt_t crypt, uint16_t algorithm, uint8_t* fvekey);
 
+size_t dis_crypt_batch_size(dis_crypt_t crypt);
+
 void dis_crypt_destroy(dis_crypt_t crypt);
 
+int dis_crypt_decrypt_sectors(dis_crypt_t crypt, size_t nb_sectors, off_t sector_address, uint8_t* input, uint8_t* output);
+
+int dis_crypt_encrypt_sectors(dis_crypt_t crypt, size_t nb_sectors, off_t sector_address, uint8_t* input, uint8_t* output);
+
 
 #endif /* ENCOMMON_H */
@@ -27,6 +27,9 @@
 #include "dislocker/encryption/encommon.h"
 
 #include "dislocker/ssl_bindings.h"
+#include "dislocker/encryption/aesni.h"
+#include "dislocker/encryption/evp.h"
+#include "dislocker/encryption/afalg.h"
 
 
 
@@ -41,10 +44,35 @@ struct _aes_contexts {
 
 	AES_CONTEXT TWEAK_E_ctx;
 	AES_CONTEXT TWEAK_D_ctx; /* useless, never used */
+
+	/* The same keys for AES-NI, only set when it's used */
+	dis_aesni_key_t FVEK_ni;
+	dis_aesni_key_t TWEAK_ni;
+
+	/* CPU features the AES-NI code uses, 0 if it's not used */
+	unsigned int aesni;
+
+	/* The XTS kernel chosen for these features */
+	dis_aesni_xts_fn_t xts_ni;
+
+	/* The same keys for OpenSSL, NULL when it's not used */
+	dis_evp_keys_t* evp;
+
+	/* The same keys for the kernel, NULL when it's not used */
+	dis_afalg_keys_t* afalg;
 };
 
 
 
+/*
+ * Bodies of the enc/decryption functions, inlined in their instances for any
+ * sector size and for the usual ones, so that the latter have constants in
+ * place of the sector size
+ */
+#define DIS_CRYPT_TEMPLATE static inline __attribute__ ((always_inline))
+
+
+
 typedef enum {
 	DIS_ENC_FLAG_USE_DIFFUSER = (1 << 0)
 } dis_enc_flags_e;
@@ -70,8 +98,47 @@ struct _dis_crypt {
 		off_t sector_address,
 		uint8_t* buffer
 	);
+
+	/* Enc/decrypt contiguous sectors at once, NULL to use the above on each */
+	void (*decrypt_sectors_fn)(
+		dis_aes_contexts_t* ctx,
+		uint16_t sector_size,
+		size_t nb_sectors,
+		uint8_t* sectors,
+		off_t sector_address,
+		uint8_t* buffer
+	);
+	void (*encrypt_sectors_fn)(
+		dis_aes_contexts_t* ctx,
+		uint16_t sector_size,
+		size_t nb_sectors,
+		uint8_t* sectors,
+		off_t sector_address,
+		uint8_t* buffer
+	);
 };
 
 
 
+/*
+ * Prototypes
+ */
+void dis_crypt_sector_keys(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	off_t sector_address,
+	uint8_t (*sector_keys)[32]
+);
+
+void dis_crypt_cbc_ivs(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	off_t sector_address,
+	uint8_t (*ivs)[16]
+);
+
+
+
 #endif /* ENCOMMON_PRIV_H */
@@ -48,6 +48,24 @@ void encrypt_cbc_with_diffuser(
 	uint8_t* buffer
 );
 
+void encrypt_cbc_sectors_without_diffuser(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+
+void encrypt_cbc_sectors_with_diffuser(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+
 void encrypt_xts(
 	dis_aes_contexts_t* ctx,
 	uint16_t sector_size,
@@ -56,6 +74,56 @@ void encrypt_xts(
 	uint8_t* buffer
 );
 
+void encrypt_xts_sectors(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+
+/*
+ * The functions above depending on the sector size, specialized for 512 and
+ * 4096 bytes sectors, their sector_size parameter being ignored
+ */
+#define ENCRYPT_SIZED_PROTOTYPES(size) \
+	void encrypt_cbc_with_diffuser_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		uint8_t* sector, \
+		off_t sector_address, \
+		uint8_t* buffer \
+	); \
+	void encrypt_cbc_sectors_with_diffuser_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		size_t nb_sectors, \
+		uint8_t* sectors, \
+		off_t sector_address, \
+		uint8_t* buffer \
+	); \
+	void encrypt_xts_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		uint8_t* sector, \
+		off_t sector_address, \
+		uint8_t* buffer \
+	); \
+	void encrypt_xts_sectors_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		size_t nb_sectors, \
+		uint8_t* sectors, \
+		off_t sector_address, \
+		uint8_t* buffer \
+	);
+
+ENCRYPT_SIZED_PROTOTYPES(512)
+ENCRYPT_SIZED_PROTOTYPES(4096)
+
+#undef ENCRYPT_SIZED_PROTOTYPES
+
 int encrypt_sector(dis_crypt_t crypt, uint8_t* sector, off_t sector_address, uint8_t* buffer);
 
 
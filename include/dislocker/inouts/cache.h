@@ -0,0 +1,77 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef DIS_CACHE_H
+#define DIS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dislocker/xstd/xstdio.h"
+#include "dislocker/inouts/inouts.h"
+
+
+/* Default memory budget of the decrypted sectors cache, in MiB */
+#define DIS_CACHE_DEFAULT_SIZE 32
+
+
+/**
+ * Cache of decrypted sectors, put in front of read_decrypt_sectors()
+ */
+typedef struct _dis_cache* dis_cache_t;
+
+
+/**
+ * Cache's counters, in blocks of sectors
+ */
+typedef struct _dis_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations;
+	/* Number of blocks the cache can hold and size of a block, in bytes */
+	size_t   nb_blocks;
+	size_t   block_size;
+} dis_cache_stats_t;
+
+
+
+/*
+ * Functions prototypes
+ */
+dis_cache_t dis_cache_new(size_t budget, uint16_t sector_size);
+
+int dis_cache_read_sectors(
+	dis_iodata_t* io_data,
+	size_t nb_read_sector,
+	uint16_t sector_size,
+	off_t sector_start,
+	uint8_t* output
+);
+
+void dis_cache_invalidate(dis_cache_t cache, off_t offset, size_t size);
+
+void dis_cache_stats(dis_cache_t cache, dis_cache_stats_t* stats);
+
+void dis_cache_destroy(dis_cache_t cache);
+
+
+#endif /* DIS_CACHE_H */
@@ -0,0 +1,134 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef DIS_EXTENTS_H
+#define DIS_EXTENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dislocker/dislocker.h"
+#include "dislocker/metadata/metadata.h"
+
+
+/**
+ * How the sectors of an extent are to be dealt with
+ */
+typedef enum {
+	/* Metadata area, returned zeroed out */
+	DIS_EXTENT_ZERO = 0,
+	/* W$ 7 first sectors, read from their backup elsewhere on the volume */
+	DIS_EXTENT_BACKUP,
+	/* Not encrypted sectors, copied as is */
+	DIS_EXTENT_PLAIN,
+	/* W$ Vista first sector, whose signature and MFT mirror are changed */
+	DIS_EXTENT_VISTA_VBR,
+	/* Encrypted sectors */
+	DIS_EXTENT_ENCRYPTED
+} dis_extent_class_e;
+
+
+/**
+ * Which way the extents are computed for: reads zero out the metadata areas
+ * and redirect the W$ 7 first sectors, writes (redirected earlier in enlock())
+ * don't
+ */
+typedef enum {
+	DIS_EXTENTS_READ = 0,
+	DIS_EXTENTS_WRITE
+} dis_extents_mode_e;
+
+
+/**
+ * A run of sectors, [start, end) in bytes from the volume's beginning, all
+ * dealt with the same way
+ */
+typedef struct _dis_extent {
+	uint64_t           start;
+	uint64_t           end;
+	dis_extent_class_e type;
+	/*
+	 * Where the first sector is stored on the volume, which is start except for
+	 * the W$ 7 first sectors
+	 */
+	uint64_t           physical;
+} dis_extent_t;
+
+
+/**
+ * Part of a request whose sectors are stored contiguously: the sectors the
+ * volume shows at offset are stored at physical
+ */
+typedef struct _dis_segment {
+	uint64_t offset;
+	uint64_t physical;
+	size_t   size;
+} dis_segment_t;
+
+/*
+ * A request is stored in at most this number of segments: the W$ 7 first
+ * sectors' backup and the rest of the volume
+ */
+#define DIS_SEGMENTS_MAX 2
+
+
+/**
+ * Map of the whole volume into extents, sorted by offset. The last extent goes
+ * on past the volume's end, up to UINT64_MAX.
+ */
+typedef struct _dis_extents* dis_extents_t;
+
+
+
+/*
+ * Functions prototypes
+ */
+dis_extents_t dis_extents_new(
+	dis_metadata_t dis_meta,
+	uint16_t sector_size,
+	dis_extents_mode_e mode
+);
+
+dis_extents_t dis_extents_get(dis_context_t dis_ctx);
+
+size_t dis_extents_count(dis_extents_t extents);
+
+const dis_extent_t* dis_extents_at(dis_extents_t extents, size_t index);
+
+const dis_extent_t* dis_extents_lookup(dis_extents_t extents, uint64_t offset);
+
+size_t dis_extents_translate(
+	dis_extents_t extents,
+	uint64_t offset,
+	size_t size,
+	dis_segment_t* segments,
+	size_t nb_segments
+);
+
+const char* dis_extent_class_str(dis_extent_class_e type);
+
+void dis_extents_print(DIS_LOGS level, dis_extents_t extents);
+
+void dis_extents_destroy(dis_extents_t extents);
+
+
+#endif /* DIS_EXTENTS_H */
@@ -29,6 +29,12 @@
 #include "dislocker/metadata/datums.h"
 #include "dislocker/metadata/metadata.h"
 #include "dislocker/encryption/encommon.h"
+#include "dislocker/inouts/workers.h"
+#include "dislocker/inouts/extents.h"
+#include "dislocker/inouts/cache.h"
+#include "dislocker/inouts/readahead.h"
+#include "dislocker/inouts/uring.h"
+#include "dislocker/inouts/writeback.h"
 
 
 
@@ -54,6 +60,13 @@ struct _data {
 	uint64_t       volume_size;
 	/* File descriptor to access the volume */
 	int            volume_fd;
+	/*
+	 * Whether volume_fd is opened for direct I/O, in which case buffers used to
+	 * read from and write to it have to be aligned on sectors
+	 */
+	int            volume_direct;
+	/* Used to have several reads in flight, NULL if io_uring is unavailable */
+	dis_uring_t    uring;
 
 	/* Size of the encrypted part of the volume */
 	uint64_t       encrypted_volume_size;
@@ -65,10 +78,41 @@ struct _data {
 	};
 	/* Number of NTFS sectors backuped */
 	uint32_t       nb_backup_sectors;
+	/*
+	 * Decrypted copy of the NTFS sectors backuped, kept once read, NULL if not
+	 * used. It's filled with the lock held and invalidated by writes to the
+	 * backup.
+	 */
+	pthread_mutex_t backup_lock;
+	uint8_t*       backup_cache;
+	int            backup_cached;
 
 	/* Structure used to encrypt or decrypt */
 	dis_crypt_t    crypt;
 
+	/* How to deal with each part of the volume, when reading and writing */
+	dis_extents_t  extents;
+	dis_extents_t  write_extents;
+
+	/* Decrypted sectors kept in memory, NULL if disabled */
+	dis_cache_t    cache;
+
+	/* Prefetches data into the cache for sequential readers, NULL if disabled */
+	dis_readahead_t readahead;
+
+	/* Written data kept in memory before being flushed, NULL if disabled */
+	dis_writeback_t writeback;
+
+	/*
+	 * Number of threads enc/decrypting sectors and the threads themselves,
+	 * NULL if running single-threaded.
+	 * NOTE: FUSE uses its own threads so the FUSE's functions can be called in
+	 * parallel. Use the environment variable FUSE_MAX_WORKERS to change the
+	 * FUSE's threads number.
+	 */
+	unsigned int   nb_threads;
+	dis_workers_t  workers;
+
 	/* Volume's state is kept here */
 	int            volume_state;
 
@@ -80,12 +124,12 @@ struct _data {
 		off_t sector_start,
 		uint8_t* output
 	);
-	/* Function to encrypt a region of the volume */
+	/* Function to encrypt sectors of the volume, where they're stored */
 	int(*encrypt_region)(
 		struct _data* io_data,
-		size_t nb_write_sector,
+		const dis_segment_t* segments,
+		size_t nb_segments,
 		uint16_t sector_size,
-		off_t sector_start,
 		uint8_t* input
 	);
 };
@@ -0,0 +1,54 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef DIS_READAHEAD_H
+#define DIS_READAHEAD_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dislocker/inouts/inouts.h"
+
+
+/* Default number of chunks read ahead of a sequential reader */
+#define DIS_READAHEAD_DEFAULT 4
+
+
+/**
+ * Detector of sequential reads, which has the following data read and
+ * decrypted into the sectors cache by a background thread
+ */
+typedef struct _dis_readahead* dis_readahead_t;
+
+
+
+/*
+ * Functions prototypes
+ */
+dis_readahead_t dis_readahead_new(dis_iodata_t* io_data, unsigned int nb_chunks);
+
+void dis_readahead_notify(dis_readahead_t readahead, off_t offset, size_t size);
+
+void dis_readahead_destroy(dis_readahead_t readahead);
+
+
+#endif /* DIS_READAHEAD_H */
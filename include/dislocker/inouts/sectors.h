@@ -26,7 +26,7 @@
 #include <stdint.h>
 #include "dislocker/xstd/xstdio.h"
 #include "dislocker/inouts/inouts.h"
-
+#include "dislocker/inouts/extents.h"
 
 
 /*
@@ -46,5 +46,15 @@ int encrypt_write_sectors(
 	off_t sector_start,
 	uint8_t* input
 );
+int encrypt_write_segments(
+	dis_iodata_t* io_data,
+	const dis_segment_t* segments,
+	size_t nb_segments,
+	uint16_t sector_size,
+	uint8_t* input
+);
+
+void init_backup_sectors_cache(dis_iodata_t* io_data);
+void destroy_backup_sectors_cache(dis_iodata_t* io_data);
 
 #endif /* SECTORS_H */
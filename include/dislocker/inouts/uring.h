@@ -0,0 +1,75 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef DIS_URING_H
+#define DIS_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Number of requests the ring can have in flight */
+#define DIS_URING_DEPTH 64
+
+
+/**
+ * io_uring instance used to have several reads or writes of the volume in
+ * flight at once. It's NULL when io_uring isn't available, in which case
+ * pread() and pwrite() are used.
+ */
+typedef struct _dis_uring* dis_uring_t;
+
+
+/**
+ * One read or write request. The fields below write are set once the request
+ * is completed, done being the last one.
+ */
+typedef struct _dis_uring_io {
+	uint8_t* buffer;
+	size_t   size;
+	off_t    offset;
+	/* Whether the buffer is written instead of read into */
+	int      write;
+
+	/* Number of bytes read or written, or -errno */
+	ssize_t  result;
+	int      done;
+} dis_uring_io_t;
+
+
+
+/*
+ * Functions prototypes
+ */
+dis_uring_t dis_uring_new(int fd, unsigned int depth);
+
+size_t dis_uring_submit(dis_uring_t uring, dis_uring_io_t* ios, size_t nb_ios);
+
+void dis_uring_wait(dis_uring_t uring, dis_uring_io_t* io);
+
+size_t dis_uring_wait_any(dis_uring_t uring, dis_uring_io_t** ios, size_t nb_ios);
+
+void dis_uring_destroy(dis_uring_t uring);
+
+
+#endif /* DIS_URING_H */
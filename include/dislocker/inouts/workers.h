@@ -0,0 +1,68 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef DIS_WORKERS_H
+#define DIS_WORKERS_H
+
+#include <stddef.h>
+
+
+/*
+ * Upper bound of the number of threads a pool can run, to keep the per-request
+ * arguments' arrays reasonably sized
+ */
+#define DIS_WORKERS_MAX 1024
+
+
+/**
+ * Pool of long-lived threads used to run the sectors enc/decryption in
+ * parallel, instead of creating and joining threads for each request
+ */
+typedef struct _dis_workers* dis_workers_t;
+
+
+/**
+ * Function run by a worker, given one element of the arguments' array
+ */
+typedef void* (*dis_workers_fn_t)(void* arg);
+
+
+
+/*
+ * Functions prototypes
+ */
+unsigned int dis_workers_default_count();
+
+dis_workers_t dis_workers_new(unsigned int nb_threads);
+
+int dis_workers_run(
+	dis_workers_t workers,
+	dis_workers_fn_t fn,
+	void* args,
+	size_t arg_size,
+	size_t nb_tasks
+);
+
+void dis_workers_destroy(dis_workers_t workers);
+
+
+#endif /* DIS_WORKERS_H */
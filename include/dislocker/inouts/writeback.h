@@ -0,0 +1,85 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef DIS_WRITEBACK_H
+#define DIS_WRITEBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Dirty data isn't kept longer than this, in milliseconds */
+#define DIS_WRITEBACK_MAX_AGE 1000
+
+
+/**
+ * Buffer keeping written data in memory, merged by contiguous ranges, until
+ * it's flushed to the volume in big writes
+ */
+typedef struct _dis_writeback* dis_writeback_t;
+
+
+/**
+ * Function writing a range of data to the volume, returning a negative errno
+ * on failure
+ */
+typedef int (*dis_writeback_fn_t)(
+	void* arg,
+	uint8_t* buffer,
+	off_t offset,
+	size_t size
+);
+
+
+
+/*
+ * Functions prototypes
+ */
+dis_writeback_t dis_writeback_new(
+	size_t max_size,
+	dis_writeback_fn_t write_fn,
+	void* write_arg
+);
+
+int dis_writeback_write(
+	dis_writeback_t writeback,
+	const uint8_t* buffer,
+	off_t offset,
+	size_t size
+);
+
+void dis_writeback_read_begin(dis_writeback_t writeback);
+
+void dis_writeback_read_end(
+	dis_writeback_t writeback,
+	uint8_t* buffer,
+	off_t offset,
+	size_t size
+);
+
+int dis_writeback_flush(dis_writeback_t writeback);
+
+void dis_writeback_destroy(dis_writeback_t writeback);
+
+
+#endif /* DIS_WRITEBACK_H */
@@ -24,6 +24,33 @@
 #define XSTDLIB_H
 
 #include <stdlib.h>
+#include <stdint.h>
+
+
+/*
+ * Alignment of the buffers given by dis_buffer_get(), a page, which is also a
+ * multiple of a cache line
+ */
+#define DIS_BUFFER_ALIGN 4096
+
+/*
+ * Maximum amount of memory each thread keeps around for reuse, bigger requests
+ * are allocated and freed each time
+ */
+#define DIS_BUFFER_MAX_KEPT (4 * 1024 * 1024)
+
+
+/**
+ * Counters of allocations, to check the steady state doesn't allocate
+ */
+typedef struct _dis_alloc_stats {
+	/* Calls to dis_malloc() and dis_free() */
+	uint64_t nb_malloc;
+	uint64_t nb_free;
+	/* Calls to dis_buffer_get() served by a kept buffer or not */
+	uint64_t nb_buffer_reused;
+	uint64_t nb_buffer_allocated;
+} dis_alloc_stats_t;
 
 
 
@@ -33,5 +60,11 @@
 void* dis_malloc(size_t size);
 void dis_free(void *pointer);
 
+void* dis_buffer_get(size_t size);
+void dis_buffer_put(void* buffer);
+void dis_buffers_release();
+
+void dis_alloc_stats(dis_alloc_stats_t* stats);
+
 
 #endif /* XSTDLIB_H */
@@ -108,6 +108,12 @@ static void setro(dis_context_t dis_ctx, char* optarg)
 	int true = TRUE;
 	dis_setopt(dis_ctx, DIS_OPT_READ_ONLY, &true);
 }
+static void setdirectio(dis_context_t dis_ctx, char* optarg)
+{
+	(void) optarg;
+	int true = TRUE;
+	dis_setopt(dis_ctx, DIS_OPT_DIRECT_IO, &true);
+}
 static void setstateok(dis_context_t dis_ctx, char* optarg)
 {
 	(void) optarg;
@@ -121,6 +127,45 @@ static void setuserpassword(dis_context_t dis_ctx, char* optarg)
 	dis_setopt(dis_ctx, DIS_OPT_SET_USER_PASSWORD, optarg);
 	hide_opt(optarg);
 }
+static void setthreads(dis_context_t dis_ctx, char* optarg)
+{
+	int threads = 0;
+	if(optarg)
+		threads = (int) strtol(optarg, NULL, 10);
+	dis_setopt(dis_ctx, DIS_OPT_THREADS, &threads);
+}
+static void setcachesize(dis_context_t dis_ctx, char* optarg)
+{
+	int cache_size = 0;
+	if(optarg)
+		cache_size = (int) strtol(optarg, NULL, 10);
+	dis_setopt(dis_ctx, DIS_OPT_CACHE_SIZE, &cache_size);
+}
+static void setreadahead(dis_context_t dis_ctx, char* optarg)
+{
+	int readahead = 0;
+	if(optarg)
+		readahead = (int) strtol(optarg, NULL, 10);
+	dis_setopt(dis_ctx, DIS_OPT_READAHEAD, &readahead);
+}
+static void setwritebacksize(dis_context_t dis_ctx, char* optarg)
+{
+	int writeback_size = 0;
+	if(optarg)
+		writeback_size = (int) strtol(optarg, NULL, 10);
+	dis_setopt(dis_ctx, DIS_OPT_WRITEBACK_SIZE, &writeback_size);
+}
+static void setcryptobackend(dis_context_t dis_ctx, char* optarg)
+{
+	dis_crypt_backend_t backend = DIS_CRYPT_BACKEND_BUILTIN;
+	if(optarg && strcmp(optarg, "openssl") == 0)
+		backend = DIS_CRYPT_BACKEND_OPENSSL;
+	else if(optarg && strcmp(optarg, "kernel") == 0)
+		backend = DIS_CRYPT_BACKEND_KERNEL;
+	else if(optarg && strcmp(optarg, "builtin") != 0)
+		fprintf(stderr, "Unknown crypto backend '%s', using the builtin one\n", optarg);
+	dis_setopt(dis_ctx, DIS_OPT_CRYPTO_BACKEND, &backend);
+}
 static void setverbosity(dis_context_t dis_ctx, char* optarg)
 {
 	dis_ctx->cfg.verbosity = (DIS_LOGS)strtol(optarg, NULL, 10);
@@ -134,7 +179,10 @@ struct _dis_options {
 };
 
 static struct _dis_options dis_opt[] = {
+	{ {"crypto-backend",    required_argument, NULL, 'b'}, setcryptobackend },
 	{ {"clearkey",          no_argument,       NULL, 'c'}, setclearkey },
+	{ {"cache-size",        required_argument, NULL, 'C'}, setcachesize },
+	{ {"direct",            no_argument,       NULL, 'D'}, setdirectio },
 	{ {"bekfile",           required_argument, NULL, 'f'}, setbekfile },
 	{ {"force-block",       optional_argument, NULL, 'F'}, setforceblock },
 	{ {"help",              no_argument,       NULL, 'h'}, NULL },
@@ -146,10 +194,13 @@ static struct _dis_options dis_opt[] = {
 	{ {"quiet",             no_argument,       NULL, 'q'}, setquiet },
 	{ {"readonly",          no_argument,       NULL, 'r'}, setro },
 	{ {"ro",                no_argument,       NULL, 'r'}, setro },
+	{ {"readahead",         required_argument, NULL, 'R'}, setreadahead },
 	{ {"stateok",           no_argument,       NULL, 's'}, setstateok },
+	{ {"threads",           required_argument, NULL, 't'}, setthreads },
 	{ {"user-password",     optional_argument, NULL, 'u'}, setuserpassword },
 	{ {"verbosity",         no_argument,       NULL, 'v'}, setverbosity },
-	{ {"volume",            required_argument, NULL, 'V'}, NULL }
+	{ {"volume",            required_argument, NULL, 'V'}, NULL },
+	{ {"writeback",         required_argument, NULL, 'W'}, setwritebacksize }
 };
 
 
@@ -165,11 +216,20 @@ PROGNAME " by " AUTHOR ", v" VERSION " (compiled for " __OS "/" __ARCH ")\n"
 "Compiled version: " VERSION_DBG "\n"
 #endif
 "\n"
-"Usage: " PROGNAME " [-hqrsv] [-l LOG_FILE] [-O OFFSET] [-V VOLUME DECRYPTMETHOD -F[N]] [-- ARGS...]\n"
+"Usage: " PROGNAME " [-Dhqrsv] [-b BACKEND] [-C CACHE_SIZE] [-l LOG_FILE] [-O OFFSET] [-R READAHEAD] [-t THREADS] [-W WRITEBACK] [-V VOLUME DECRYPTMETHOD -F[N]] [-- ARGS...]\n"
 "    with DECRYPTMETHOD = -p[RECOVERY_PASSWORD]|-f BEK_FILE|-u[USER_PASSWORD]|-k FVEK_FILE|-c\n"
 "\n"
 "Options:\n"
+"    -b, --crypto-backend BACKEND\n"
+"                          implementation used to enc/decrypt sectors, builtin\n"
+"                          (default), openssl, if compiled with it, or kernel\n"
+"                          (Linux's AF_ALG, for large requests)\n"
 "    -c, --clearkey        decrypt volume using a clear key (default)\n"
+"    -C, --cache-size CACHE_SIZE\n"
+"                          memory used to cache decrypted sectors, in MiB (0\n"
+"                          disables the cache, default is %d)\n"
+"    -D, --direct          access the volume with direct I/O, bypassing the\n"
+"                          kernel's page cache\n"
 "    -f, --bekfile BEKFILE\n"
 "                          decrypt volume using the bek file (on USB key)\n"
 "    -F, --force-block=[N] force use of metadata block number N (1, 2 or 3)\n"
@@ -182,17 +242,28 @@ PROGNAME " by " AUTHOR ", v" VERSION " (compiled for " __OS "/" __ARCH ")\n"
 "                          decrypt volume using the recovery password method\n"
 "    -q, --quiet           do NOT display anything\n"
 "    -r, --readonly        do not allow to write on the BitLocker volume\n"
+"    -R, --readahead READAHEAD\n"
+"                          number of requests read ahead of sequential readers\n"
+"                          (0 disables readahead, default is %d)\n"
 "    -s, --stateok         do not check the volume's state, assume it's ok to mount it\n"
+"    -t, --threads THREADS number of threads used for enc/decryption (default\n"
+"                          depends on the available CPUs)\n"
 "    -u, --user-password=[USER_PASSWORD]\n"
 "                          decrypt volume using the user password method\n"
 "    -v, --verbosity       increase verbosity (CRITICAL errors are displayed by default)\n"
 "    -V, --volume VOLUME   volume to get metadata and keys from\n"
+"    -W, --writeback WRITEBACK\n"
+"                          memory used to merge written data before writing it\n"
+"                          to the volume, in MiB (default is 0, writing data\n"
+"                          straight away)\n"
 "\n"
 "    --                    end of program options, beginning of FUSE's ones\n"
 "\n"
 "  ARGS are any arguments you want to pass to FUSE. You need to pass at least\n"
 "the mount-point.\n"
-"\n"
+"\n",
+	DIS_CACHE_DEFAULT_SIZE,
+	DIS_READAHEAD_DEFAULT
 	);
 }
 
@@ -251,7 +322,7 @@ int dis_getopts(dis_context_t dis_ctx, int argc, char** argv)
 
 
 	/* Options which could be passed as argument */
-	const char short_opts[] = "cf:F::hk:l:O:o:p::qrsu::vV:";
+	const char short_opts[] = "b:cC:Df:F::hk:l:O:o:p::qrR:st:u::vV:W:";
 	struct option* long_opts;
 
 	if(!dis_ctx || !argv)
@@ -280,6 +351,17 @@ int dis_getopts(dis_context_t dis_ctx, int argc, char** argv)
 				dis_setopt(dis_ctx, DIS_OPT_USE_CLEAR_KEY, &true);
 				break;
 			}
+			case 'C':
+			{
+				int cache_size = (int) strtol(optarg, NULL, 10);
+				dis_setopt(dis_ctx, DIS_OPT_CACHE_SIZE, &cache_size);
+				break;
+			}
+			case 'D':
+			{
+				dis_setopt(dis_ctx, DIS_OPT_DIRECT_IO, &true);
+				break;
+			}
 			case 'f':
 			{
 				dis_setopt(dis_ctx, DIS_OPT_USE_BEK_FILE, &true);
@@ -342,11 +424,23 @@ int dis_getopts(dis_context_t dis_ctx, int argc, char** argv)
 				dis_setopt(dis_ctx, DIS_OPT_READ_ONLY, &true);
 				break;
 			}
+			case 'R':
+			{
+				int readahead = (int) strtol(optarg, NULL, 10);
+				dis_setopt(dis_ctx, DIS_OPT_READAHEAD, &readahead);
+				break;
+			}
 			case 's':
 			{
 				dis_setopt(dis_ctx, DIS_OPT_DONT_CHECK_VOLUME_STATE, &true);
 				break;
 			}
+			case 't':
+			{
+				int threads = (int) strtol(optarg, NULL, 10);
+				dis_setopt(dis_ctx, DIS_OPT_THREADS, &threads);
+				break;
+			}
 			case 'u':
 			{
 				dis_setopt(dis_ctx, DIS_OPT_USE_USER_PASSWORD, &true);
@@ -365,6 +459,17 @@ int dis_getopts(dis_context_t dis_ctx, int argc, char** argv)
 				dis_setopt(dis_ctx, DIS_OPT_VOLUME_PATH, optarg);
 				break;
 			}
+			case 'W':
+			{
+				int writeback_size = (int) strtol(optarg, NULL, 10);
+				dis_setopt(dis_ctx, DIS_OPT_WRITEBACK_SIZE, &writeback_size);
+				break;
+			}
+			case 'b':
+			{
+				setcryptobackend(dis_ctx, optarg);
+				break;
+			}
 			case '?':
 			default:
 			{
@@ -485,6 +590,27 @@ int dis_getopt(dis_context_t dis_ctx, dis_opt_e opt_name, void** opt_value)
 			else
 				*opt_value = (void*) FALSE;
 			break;
+		case DIS_OPT_DIRECT_IO:
+			if(cfg->flags & DIS_FLAG_DIRECT_IO)
+				*opt_value = (void*) TRUE;
+			else
+				*opt_value = (void*) FALSE;
+			break;
+		case DIS_OPT_THREADS:
+			*opt_value = (void*) ((long) cfg->nb_threads);
+			break;
+		case DIS_OPT_CACHE_SIZE:
+			*opt_value = (void*) ((long) cfg->cache_size);
+			break;
+		case DIS_OPT_READAHEAD:
+			*opt_value = (void*) ((long) cfg->readahead);
+			break;
+		case DIS_OPT_WRITEBACK_SIZE:
+			*opt_value = (void*) ((long) cfg->writeback_size);
+			break;
+		case DIS_OPT_CRYPTO_BACKEND:
+			*opt_value = (void*) ((long) cfg->crypto_backend);
+			break;
 		case DIS_OPT_INITIALIZE_STATE:
 			*opt_value = (void*) cfg->init_stop_at;
 			break;
@@ -658,6 +784,72 @@ int dis_setopt(dis_context_t dis_ctx, dis_opt_e opt_name, const void* opt_value)
 					cfg->flags &= (unsigned) ~DIS_FLAG_DONT_CHECK_VOLUME_STATE;
 			}
 			break;
+		case DIS_OPT_DIRECT_IO:
+			if(opt_value == NULL)
+				cfg->flags &= (unsigned) ~DIS_FLAG_DIRECT_IO;
+			else
+			{
+				int flag = *(int*) opt_value;
+				if(flag == TRUE)
+					cfg->flags |= DIS_FLAG_DIRECT_IO;
+				else
+					cfg->flags &= (unsigned) ~DIS_FLAG_DIRECT_IO;
+			}
+			break;
+		case DIS_OPT_THREADS:
+			if(opt_value == NULL)
+				cfg->nb_threads = 0;
+			else
+			{
+				int threads = *(int*) opt_value;
+				if(threads > 0)
+					cfg->nb_threads = (unsigned int) threads;
+				else
+					cfg->nb_threads = 0;
+			}
+			break;
+		case DIS_OPT_CACHE_SIZE:
+			if(opt_value == NULL)
+				cfg->cache_size = DIS_CACHE_DEFAULT_SIZE;
+			else
+			{
+				int cache_size = *(int*) opt_value;
+				if(cache_size > 0)
+					cfg->cache_size = (unsigned int) cache_size;
+				else
+					cfg->cache_size = 0;
+			}
+			break;
+		case DIS_OPT_READAHEAD:
+			if(opt_value == NULL)
+				cfg->readahead = DIS_READAHEAD_DEFAULT;
+			else
+			{
+				int readahead = *(int*) opt_value;
+				if(readahead > 0)
+					cfg->readahead = (unsigned int) readahead;
+				else
+					cfg->readahead = 0;
+			}
+			break;
+		case DIS_OPT_WRITEBACK_SIZE:
+			if(opt_value == NULL)
+				cfg->writeback_size = 0;
+			else
+			{
+				int writeback_size = *(int*) opt_value;
+				if(writeback_size > 0)
+					cfg->writeback_size = (unsigned int) writeback_size;
+				else
+					cfg->writeback_size = 0;
+			}
+			break;
+		case DIS_OPT_CRYPTO_BACKEND:
+			if(opt_value == NULL)
+				cfg->crypto_backend = DIS_CRYPT_BACKEND_BUILTIN;
+			else
+				cfg->crypto_backend = *(dis_crypt_backend_t*) opt_value;
+			break;
 		case DIS_OPT_INITIALIZE_STATE:
 			if(opt_value == NULL)
 				cfg->init_stop_at = DIS_STATE_COMPLETE_EVERYTHING;
@@ -764,6 +956,48 @@ void dis_print_args(dis_context_t dis_ctx)
 			"(read only mode)\n"
 		);
 
+	if(cfg->flags & DIS_FLAG_DIRECT_IO)
+		dis_printf(L_DEBUG, "   Accessing the volume with direct I/O\n");
+
+	if(cfg->nb_threads)
+		dis_printf(
+			L_DEBUG,
+			"   Using %u thread(s) for enc/decryption\n",
+			cfg->nb_threads
+		);
+	else
+		dis_printf(L_DEBUG, "   Using as many threads as available CPUs\n");
+
+	if(cfg->cache_size)
+		dis_printf(
+			L_DEBUG,
+			"   Caching up to %u MiB of decrypted sectors\n",
+			cfg->cache_size
+		);
+	else
+		dis_printf(L_DEBUG, "   Not caching decrypted sectors\n");
+
+	if(cfg->readahead && cfg->cache_size)
+		dis_printf(
+			L_DEBUG,
+			"   Reading up to %u request(s) ahead of sequential readers\n",
+			cfg->readahead
+		);
+	else
+		dis_printf(L_DEBUG, "   Not reading ahead\n");
+
+	if(cfg->writeback_size)
+		dis_printf(
+			L_DEBUG,
+			"   Keeping up to %u MiB of written data before writing it\n",
+			cfg->writeback_size
+		);
+
+	if(cfg->crypto_backend == DIS_CRYPT_BACKEND_OPENSSL)
+		dis_printf(L_DEBUG, "   Enc/decrypting sectors with OpenSSL\n");
+	else if(cfg->crypto_backend == DIS_CRYPT_BACKEND_KERNEL)
+		dis_printf(L_DEBUG, "   Enc/decrypting large requests with the kernel\n");
+
 	dis_printf(L_DEBUG, "... End config ---\n");
 }
 
@@ -176,6 +176,39 @@ static int fs_write(
 }
 
 
+static int fs_flush(
+	const char *path,
+	__attribute__ ((unused)) struct fuse_file_info *fi)
+{
+	if(!path)
+		return -EINVAL;
+
+	if(strcmp(path, NTFS_FILENAME) != 0)
+		return -ENOENT;
+
+	return dis_flush(dis_ctx);
+}
+
+static int fs_fsync(
+	const char *path,
+	int datasync,
+	__attribute__ ((unused)) struct fuse_file_info *fi)
+{
+	if(!path)
+		return -EINVAL;
+
+	if(strcmp(path, NTFS_FILENAME) != 0)
+		return -ENOENT;
+
+	return dis_fsync(dis_ctx, datasync);
+}
+
+static int fs_release(const char *path, struct fuse_file_info *fi)
+{
+	return fs_flush(path, fi);
+}
+
+
 /* Structure used by the FUSE driver */
 struct fuse_operations fs_oper = {
 	.getattr = fs_getattr,
@@ -183,6 +216,9 @@ struct fuse_operations fs_oper = {
 	.open    = fs_open,
 	.read    = fs_read,
 	.write   = fs_write,
+	.flush   = fs_flush,
+	.release = fs_release,
+	.fsync   = fs_fsync,
 };
 
 
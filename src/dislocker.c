@@ -32,6 +32,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include "dislocker/accesses/accesses.h"
 #include "dislocker/metadata/datums.h"
@@ -70,6 +71,10 @@
 int dis_errno;
 
 
+/** Prototype of functions used internally */
+static int write_volume(void* arg, uint8_t* buffer, off_t offset, size_t size);
+
+
 
 dis_context_t dis_new()
 {
@@ -91,6 +96,9 @@ dis_context_t dis_new()
 #endif
 
 	dis_ctx->fve_fd = -1;
+	dis_ctx->cfg.cache_size = DIS_CACHE_DEFAULT_SIZE;
+	dis_ctx->cfg.readahead  = DIS_READAHEAD_DEFAULT;
+	dis_ctx->cfg.writeback_size = 0;
 
 	return dis_ctx;
 }
@@ -226,6 +234,10 @@ int dis_initialize(dis_context_t dis_ctx)
 			dis_metadata_sector_size(dis_ctx->metadata),
 			dis_ctx->metadata->dataset->algorithm
 		);
+		dis_crypt_set_backend(
+			dis_ctx->io_data.crypt,
+			dis_ctx->cfg.crypto_backend
+		);
 
 		/*
 		 * Init the decrypt keys' contexts
@@ -248,6 +260,22 @@ int dis_initialize(dis_context_t dis_ctx)
 	 */
 	if((ret = prepare_crypt(dis_ctx)) != DIS_RET_SUCCESS)
 		dis_printf(L_CRITICAL, "Can't prepare the crypt structure. Abort.\n");
+	else if(dis_ctx->cfg.writeback_size > 0 &&
+	        !(dis_ctx->cfg.flags & DIS_FLAG_READ_ONLY) &&
+	        !dis_ctx->io_data.writeback)
+	{
+		dis_ctx->io_data.writeback = dis_writeback_new(
+			(size_t) dis_ctx->cfg.writeback_size * 1024 * 1024,
+			write_volume,
+			dis_ctx
+		);
+		if(dis_ctx->io_data.writeback)
+			dis_printf(
+				L_INFO,
+				"Keeping up to %u MiB of written data in memory\n",
+				dis_ctx->cfg.writeback_size
+			);
+	}
 
 
 	// TODO add the DIS_STATE_BEFORE_DECRYPTION_CHECKING event here, so add the check here too
@@ -380,13 +408,23 @@ int dislock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 
 
 	/*
+	 * When the request is aligned on sectors, as it is most of the time, the
+	 * sectors are decrypted straight into the user's buffer. Otherwise, they're
+	 * decrypted into a bigger buffer and only the requested part is copied.
+	 *
 	 * NOTE: DO NOT use dis_malloc() here, we don't want to mess everything up!
-	 * In general, do not use xfunctions() but dis_printf() here.
+	 * In general, do not use xfunctions() but dis_printf() here. Buffers are
+	 * taken from the ones the thread keeps, to avoid allocating each time.
 	 */
 
-	size_t to_allocate = size + sector_to_add*sector_size;
-	dis_printf(L_DEBUG, "  Trying to allocate %#" F_SIZE_T " bytes\n",to_allocate);
-	buf = malloc(to_allocate);
+	if(sector_to_add == 0)
+		buf = buffer;
+	else
+	{
+		size_t to_allocate = size + sector_to_add*sector_size;
+		dis_printf(L_DEBUG, "  Trying to allocate %#" F_SIZE_T " bytes\n",to_allocate);
+		buf = dis_buffer_get(to_allocate);
+	}
 
 	/* If buffer could not be allocated, return an error */
 	if(!buf)
@@ -400,6 +438,11 @@ int dislock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 			return -ENOMEM;
 	}
 
+	/* Have what follows prefetched while this request is processed */
+	dis_readahead_notify(dis_ctx->io_data.readahead, offset, size);
+
+	/* Data not written yet mustn't be flushed until it's put over what's read */
+	dis_writeback_read_begin(dis_ctx->io_data.writeback);
 
 	if(!dis_ctx->io_data.decrypt_region(
 		&dis_ctx->io_data,
@@ -408,7 +451,9 @@ int dislock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 		sector_start * sector_size,
 		buf))
 	{
-		free(buf);
+		dis_writeback_read_end(dis_ctx->io_data.writeback, buffer, offset, 0);
+		if(buf != buffer)
+			dis_buffer_put(buf);
 		dis_printf(L_ERROR, "Cannot decrypt sectors, abort.\n");
 		dis_printf(L_DEBUG,
 		       "-----------------------------------------------------------\n");
@@ -416,9 +461,13 @@ int dislock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 	}
 
 	/* Now copy the required amount of data to the user buffer */
-	memcpy(buffer, buf + (offset % sector_size), size);
+	if(buf != buffer)
+	{
+		memcpy(buffer, buf + (offset % sector_size), size);
+		dis_buffer_put(buf);
+	}
 
-	free(buf);
+	dis_writeback_read_end(dis_ctx->io_data.writeback, buffer, offset, size);
 
 	dis_printf(L_DEBUG, "  Outsize which will be returned: %d\n", (int)size);
 	dis_printf(L_DEBUG,
@@ -432,15 +481,6 @@ int dislock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 
 int enlock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 {
-	uint8_t* buf = NULL;
-	int      ret = 0;
-
-	uint16_t sector_size;
-	size_t sector_count;
-	off_t  sector_start;
-	size_t sector_to_add = 0;
-
-
 	if(!dis_ctx || !buffer)
 		return -EINVAL;
 
@@ -516,46 +556,83 @@ int enlock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 		return -EFAULT;
 
 
-	/*
-	 * For BitLocker 7's volume, redirect writes to firsts sectors to the backed
-	 * up ones
-	 */
-	if(dis_ctx->metadata->information->version == V_SEVEN &&
-	   offset < dis_ctx->metadata->virtualized_size)
-	{
-		dis_printf(L_DEBUG, "  Entering virtualized area\n");
-		if(offset + (off_t)size <= dis_ctx->metadata->virtualized_size)
-		{
-			/*
-			 * If all the request is within the virtualized area, just change
-			 * the offset
-			 */
-			offset = offset + (off_t)dis_ctx->metadata->information->boot_sectors_backup;
-			dis_printf(L_DEBUG, "  `-> Just redirecting to %#"F_OFF_T"\n", offset);
-		}
-		else
-		{
-			/*
-			 * But if the buffer is within the virtualized area and overflow it,
-			 * split the request in two:
-			 * - One for the virtualized area completely (which will be handled
-			 *   by "recursing" and entering the case above)
-			 * - One for the rest by changing the offset to the end of the
-			 *   virtualized area and the size to the rest to be dec/encrypted
-			 */
-			dis_printf(L_DEBUG, "  `-> Splitting the request in two, recursing\n");
+	/* Small writes are merged in memory and written later on, if asked to */
+	if(dis_ctx->io_data.writeback)
+		return dis_writeback_write(dis_ctx->io_data.writeback, buffer, offset, size);
 
-			size_t nsize = (size_t)(dis_ctx->metadata->virtualized_size - offset);
-			ret = enlock(dis_ctx, buffer, offset, nsize);
-			if(ret < 0)
-				return ret;
+	return write_volume(dis_ctx, buffer, offset, size);
+}
 
-			offset  = dis_ctx->metadata->virtualized_size;
-			size   -= nsize;
-			buffer += nsize;
-		}
+
+/**
+ * Write to the volume the data kept in the write-back buffer, if there's one
+ *
+ * @param dis_ctx The dislocker context
+ * @return 0 on success, a negative errno otherwise
+ */
+int dis_flush(dis_context_t dis_ctx)
+{
+	if(!dis_ctx)
+		return -EINVAL;
+
+	return dis_writeback_flush(dis_ctx->io_data.writeback);
+}
+
+
+/**
+ * Write to the volume the data kept in the write-back buffer, then have
+ * everything written to the volume reach the device
+ *
+ * @param dis_ctx The dislocker context
+ * @param datasync TRUE to only have the data reach it, as fdatasync(2)
+ * @return 0 on success, a negative errno otherwise
+ */
+int dis_fsync(dis_context_t dis_ctx, int datasync)
+{
+	int ret = dis_flush(dis_ctx);
+
+	if(ret < 0)
+		return ret;
+
+	if(datasync)
+		ret = fdatasync(dis_ctx->io_data.volume_fd);
+	else
+		ret = fsync(dis_ctx->io_data.volume_fd);
+
+	if(ret < 0)
+	{
+		ret = -errno;
+		dis_printf(L_ERROR, "Cannot sync the volume: %s\n", strerror(-ret));
+		return ret;
 	}
 
+	return 0;
+}
+
+
+/**
+ * Encrypt and write data to the volume, once enlock() checked it could be
+ * written. This is also what the write-back buffer flushes its data with.
+ *
+ * @param arg The dislocker context
+ * @param buffer The data to write
+ * @param offset Where to write the data
+ * @param size The size of the data
+ * @return The number of bytes written, or a negative errno
+ */
+static int write_volume(void* arg, uint8_t* buffer, off_t offset, size_t size)
+{
+	dis_context_t dis_ctx = (dis_context_t) arg;
+	uint8_t* buf = NULL;
+
+	dis_segment_t segments[DIS_SEGMENTS_MAX];
+	size_t nb_segments;
+
+	uint16_t sector_size;
+	size_t sector_count;
+	off_t  sector_start;
+	size_t sector_to_add = 0;
+
 
 	/*
 	 * As in the read function, the offset may not be at a sector limit, so we
@@ -576,9 +653,12 @@ int enlock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 	 *
 	 *
 	 * Logic to do this is below :
-	 *  - read and decrypt all sectors completely (2 to 5 in the example above)
+	 *  - read and decrypt the sectors partially written (2 and 5 in the
+	 *  example above), the others are entirely replaced anyway
 	 *  - replace some data by the user's one
-	 *  - encrypt and write the read sectors
+	 *  - encrypt and write the sectors
+	 * When the request is aligned on sectors, nothing has to be read and the
+	 * user's buffer is encrypted as is.
 	 */
 
 	/* Do not add sectors if we're at the edge of one already */
@@ -589,7 +669,13 @@ int enlock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 		sector_to_add += 1;
 
 
-	sector_count = ( size / sector_size ) + sector_to_add;
+	/*
+	 * Count the sectors actually touched: adding the partial ones to the full
+	 * ones would count one too many when both edges are in the same sector or
+	 * in two consecutive ones
+	 */
+	sector_count = (size_t)((offset + (off_t)size + sector_size - 1) / sector_size
+	                        - offset / sector_size);
 	sector_start = offset / sector_size;
 
 	dis_printf(L_DEBUG,
@@ -601,12 +687,46 @@ int enlock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 	        sector_start, sector_count);
 
 
+	/*
+	 * For BitLocker 7's volume, writes to firsts sectors go to the backed up
+	 * ones, as reads come from there. A write overflowing the virtualized area
+	 * is split in two segments, encrypted and written together.
+	 */
+	nb_segments = dis_extents_translate(
+		dis_ctx->io_data.extents,
+		(uint64_t) (sector_start * sector_size),
+		sector_count * sector_size,
+		segments,
+		DIS_SEGMENTS_MAX
+	);
+	if(nb_segments == 0)
+	{
+		dis_printf(L_ERROR, "Cannot find where to write sectors, abort.\n");
+		dis_printf(L_DEBUG,
+		       "-----------------------------------------------------------\n");
+		return -EIO;
+	}
+
+	if(nb_segments > 1 || segments[0].physical != segments[0].offset)
+		dis_printf(
+			L_DEBUG,
+			"  Entering virtualized area, redirected to %#" PRIx64 " in %"
+			F_SIZE_T " segment(s)\n",
+			segments[0].physical,
+			nb_segments
+		);
+
+
 	/*
 	 * NOTE: DO NOT use dis_malloc() here, we don't want to mess everything up!
-	 * In general, do not use xfunctions() but dis_printf() here.
+	 * In general, do not use xfunctions() but dis_printf() here. Buffers are
+	 * taken from the ones the thread keeps, to avoid allocating each time.
 	 */
 
-	buf = malloc(size + sector_to_add * (size_t)sector_size);
+	if(sector_to_add == 0)
+		buf = buffer;
+	else
+		buf = dis_buffer_get(sector_count * sector_size);
 
 	/* If buffer could not be allocated */
 	if(!buf)
@@ -618,36 +738,59 @@ int enlock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 	}
 
 
-	if(!dis_ctx->io_data.decrypt_region(
-		&dis_ctx->io_data,
-		sector_count,
-		sector_size,
-		sector_start * sector_size,
-		buf
-	))
+	if(buf != buffer)
 	{
-		free(buf);
-		dis_printf(L_ERROR, "Cannot decrypt sectors, abort.\n");
-		dis_printf(L_DEBUG,
-		       "-----------------------------------------------------------\n");
-		return -EIO;
-	}
+		/* The first sector, if the write doesn't start at its beginning */
+		int ok = TRUE;
+		if((offset % sector_size) != 0)
+			ok = dis_ctx->io_data.decrypt_region(
+				&dis_ctx->io_data,
+				1,
+				sector_size,
+				sector_start * sector_size,
+				buf
+			);
+
+		/*
+		 * The last sector, if the write doesn't end at its end and it's not
+		 * the first one, decrypted just above
+		 */
+		if(ok && ((offset + (off_t)size) % sector_size) != 0 &&
+		   (sector_count > 1 || (offset % sector_size) == 0))
+			ok = dis_ctx->io_data.decrypt_region(
+				&dis_ctx->io_data,
+				1,
+				sector_size,
+				(sector_start + (off_t)sector_count - 1) * sector_size,
+				buf + (sector_count - 1) * sector_size
+			);
+
+		if(!ok)
+		{
+			dis_buffer_put(buf);
+			dis_printf(L_ERROR, "Cannot decrypt sectors, abort.\n");
+			dis_printf(L_DEBUG,
+			       "-----------------------------------------------------------\n");
+			return -EIO;
+		}
 
 
-	/* Now copy the user's buffer to the received data */
-	memcpy(buf + (offset % sector_size), buffer, size);
+		/* Now copy the user's buffer to the received data */
+		memcpy(buf + (offset % sector_size), buffer, size);
+	}
 
 
 	/* Finally, encrypt the buffer and write it to the disk */
 	if(!dis_ctx->io_data.encrypt_region(
 		&dis_ctx->io_data,
-		sector_count,
+		segments,
+		nb_segments,
 		sector_size,
-		sector_start * sector_size,
 		buf
 	))
 	{
-		free(buf);
+		if(buf != buffer)
+			dis_buffer_put(buf);
 		dis_printf(L_ERROR, "Cannot encrypt sectors, abort.\n");
 		dis_printf(L_DEBUG,
 		       "-----------------------------------------------------------\n");
@@ -655,23 +798,26 @@ int enlock(dis_context_t dis_ctx, uint8_t* buffer, off_t offset, size_t size)
 	}
 
 
-	free(buf);
+	if(buf != buffer)
+		dis_buffer_put(buf);
 
+	/* What's cached of these sectors is outdated */
+	dis_cache_invalidate(dis_ctx->io_data.cache, offset, size);
 
-	/* Note that ret is zero when no recursion occurs */
-	int outsize = (int)size + ret;
 
-	dis_printf(L_DEBUG, "  Outsize which will be returned: %d\n", outsize);
+	dis_printf(L_DEBUG, "  Outsize which will be returned: %d\n", (int)size);
 	dis_printf(L_DEBUG,
 	        "-----------------------------------------------------------\n");
 
-	return outsize;
+	return (int)size;
 }
 
 
 
 int dis_destroy(dis_context_t dis_ctx)
 {
+	dis_alloc_stats_t stats;
+
 	/* Finish cleaning things */
 	if(dis_ctx->io_data.vmk)
 		dis_free(dis_ctx->io_data.vmk);
@@ -679,14 +825,63 @@ int dis_destroy(dis_context_t dis_ctx)
 	if(dis_ctx->io_data.fvek)
 		dis_free(dis_ctx->io_data.fvek);
 
+	/* Flush what's still to be written while everything's there to do it */
+	dis_writeback_destroy(dis_ctx->io_data.writeback);
+
+	/* The readahead uses the workers and the cache, stop it first */
+	dis_readahead_destroy(dis_ctx->io_data.readahead);
+
+	dis_workers_destroy(dis_ctx->io_data.workers);
+
+	dis_uring_destroy(dis_ctx->io_data.uring);
+
+	dis_extents_destroy(dis_ctx->io_data.extents);
+	dis_extents_destroy(dis_ctx->io_data.write_extents);
+
+	destroy_backup_sectors_cache(&dis_ctx->io_data);
+
+	if(dis_ctx->io_data.cache)
+	{
+		dis_cache_stats_t cache_stats;
+		dis_cache_stats(dis_ctx->io_data.cache, &cache_stats);
+		dis_printf(
+			L_INFO,
+			"Sectors cache: %" PRIu64 " hit(s), %" PRIu64 " miss(es) "
+			"(%.1f%% hit rate), %" PRIu64 " invalidation(s)\n",
+			cache_stats.hits,
+			cache_stats.misses,
+			cache_stats.hits + cache_stats.misses ?
+				100.0 * (double) cache_stats.hits /
+				(double) (cache_stats.hits + cache_stats.misses) : 0.0,
+			cache_stats.invalidations
+		);
+		dis_cache_destroy(dis_ctx->io_data.cache);
+	}
+
+	dis_buffers_release();
+
 	dis_crypt_destroy(dis_ctx->io_data.crypt);
 
 	dis_metadata_destroy(dis_ctx->metadata);
 
 	dis_free_args(dis_ctx);
 
+	/* The volume may have been opened a second time, for direct I/O */
+	if(dis_ctx->io_data.volume_direct)
+		dis_close(dis_ctx->fve_fd);
 	dis_close(dis_ctx->io_data.volume_fd);
 
+	dis_alloc_stats(&stats);
+	dis_printf(
+		L_DEBUG,
+		"Allocations: %" PRIu64 " dis_malloc(), %" PRIu64 " dis_free(), "
+		"%" PRIu64 " buffers reused, %" PRIu64 " buffers allocated\n",
+		stats.nb_malloc,
+		stats.nb_free,
+		stats.nb_buffer_reused,
+		stats.nb_buffer_allocated
+	);
+
 	dis_stdio_end();
 
 	dis_free(dis_ctx);
@@ -25,6 +25,14 @@
 #include <string.h>
 
 #include "dislocker/ssl_bindings.h"
+#include "dislocker/encryption/aesni.h"
+
+
+/*
+ * Tweaks are computed this many at a time, before being used by the enc/
+ * decryption loops. That's a 512 bytes sector's worth.
+ */
+#define XTS_TWEAKS_BLOCKS 32
 
 #ifndef GET_UINT64_LE
 #define GET_UINT64_LE(n,b,i)                            \
@@ -119,6 +127,53 @@ static void gf128mul_x_ble(be128 r, const be128 x)
 }
 
 
+/**
+ * Compute the tweaks of one or several XTS sequences, such as the sectors of a
+ * run: tweaks[s * nb_blocks + i] is first[s] times x^i. This is done with SIMD
+ * shifts and carry-less multiplications when the CPU has them, and with
+ * gf128mul_x_ble() otherwise.
+ *
+ * @param first The (encrypted) tweak of each sequence's first block
+ * @param nb_sequences The number of sequences
+ * @param nb_blocks The number of blocks of each sequence
+ * @param tweaks Where to put the nb_sequences * nb_blocks tweaks
+ */
+void dis_xts_tweaks(
+	const unsigned char (*first)[16],
+	size_t nb_sequences,
+	size_t nb_blocks,
+	unsigned char (*tweaks)[16]
+)
+{
+	/*
+	 * Found out on the first call; concurrent callers would only store the
+	 * same value
+	 */
+	static volatile int clmul = -1;
+	size_t seq   = 0;
+	size_t block = 0;
+
+	if( clmul < 0 )
+		clmul = ( dis_aesni_features() & DIS_AESNI_CLMUL ) ? 1 : 0;
+
+	if( clmul )
+	{
+		dis_aesni_xts_tweaks( first, nb_sequences, nb_blocks, tweaks );
+		return;
+	}
+
+	for( seq = 0; seq < nb_sequences && nb_blocks > 0; seq++ )
+	{
+		memmove( tweaks[0], first[seq], 16 );
+
+		for( block = 1; block < nb_blocks; block++ )
+			gf128mul_x_ble( tweaks[block], tweaks[block - 1] );
+
+		tweaks += nb_blocks;
+	}
+}
+
+
 /*
  * AES-XEX buffer encryption/decryption
  */
@@ -138,41 +193,51 @@ int dis_aes_crypt_xex(
 	};
 
 	union xex_buf128 scratch;
-	union xex_buf128 t_buf;
+	union xex_buf128 tweaks[XTS_TWEAKS_BLOCKS + 1];
 	union xex_buf128 *inbuf;
 	union xex_buf128 *outbuf;
+	size_t nb_blocks = length / 16;
+	size_t nb_tweaks = 0;
+	size_t i = 0;
 
 	inbuf = (union xex_buf128*)input;
 	outbuf = (union xex_buf128*)output;
 
-	if( length % 16 )
+	if( length % 16 || length == 0 )
 		return( -1 );
 
 
-	AES_ECB_ENC( tweak_ctx, AES_ENCRYPT, iv, t_buf.u8 );
+	AES_ECB_ENC( tweak_ctx, AES_ENCRYPT, iv, tweaks[0].u8 );
 
-	goto first;
-
-	do
+	while( nb_blocks > 0 )
 	{
-		gf128mul_x_ble( t_buf.u8, t_buf.u8 );
+		/* The tweaks of these blocks, plus the next one's to carry on with */
+		nb_tweaks = nb_blocks < XTS_TWEAKS_BLOCKS ? nb_blocks : XTS_TWEAKS_BLOCKS;
+		dis_xts_tweaks(
+			(const unsigned char (*)[16]) tweaks[0].u8, 1, nb_tweaks + 1,
+			(unsigned char (*)[16]) tweaks[0].u8
+		);
+
+		for( i = 0; i < nb_tweaks; i++ )
+		{
+			/* PP <- T xor P */
+			scratch.u64[0] = (uint64_t)( inbuf->u64[0] ^ tweaks[i].u64[0] );
+			scratch.u64[1] = (uint64_t)( inbuf->u64[1] ^ tweaks[i].u64[1] );
 
-first:
-		/* PP <- T xor P */
-		scratch.u64[0] = (uint64_t)( inbuf->u64[0] ^ t_buf.u64[0] );
-		scratch.u64[1] = (uint64_t)( inbuf->u64[1] ^ t_buf.u64[1] );
+			/* CC <- E(Key2,PP) */
+			AES_ECB_ENC( crypt_ctx, mode, scratch.u8, outbuf->u8 );
 
-		/* CC <- E(Key2,PP) */
-		AES_ECB_ENC( crypt_ctx, mode, scratch.u8, outbuf->u8 );
+			/* C <- T xor CC */
+			outbuf->u64[0] = (uint64_t)( outbuf->u64[0] ^ tweaks[i].u64[0] );
+			outbuf->u64[1] = (uint64_t)( outbuf->u64[1] ^ tweaks[i].u64[1] );
 
-		/* C <- T xor CC */
-		outbuf->u64[0] = (uint64_t)( outbuf->u64[0] ^ t_buf.u64[0] );
-		outbuf->u64[1] = (uint64_t)( outbuf->u64[1] ^ t_buf.u64[1] );
+			inbuf  += 1;
+			outbuf += 1;
+		}
 
-		inbuf  += 1;
-		outbuf += 1;
-		length -= 16;
-	} while( length > 0 );
+		nb_blocks -= nb_tweaks;
+		tweaks[0] = tweaks[nb_tweaks];
+	}
 
 	return( 0 );
 }
@@ -200,10 +265,13 @@ int dis_aes_crypt_xts(
 	union xts_buf128 cts_scratch;
 	union xts_buf128 t_buf;
 	union xts_buf128 cts_t_buf;
+	union xts_buf128 tweaks[XTS_TWEAKS_BLOCKS + 1];
 	union xts_buf128 *inbuf;
 	union xts_buf128 *outbuf;
 	size_t nb_blocks = length / 16;
 	size_t remaining = length % 16;
+	size_t nb_tweaks = 0;
+	size_t i = 0;
 
 	inbuf = (union xts_buf128*)input;
 	outbuf = (union xts_buf128*)output;
@@ -214,30 +282,38 @@ int dis_aes_crypt_xts(
 		return( -1 );
 
 
-	AES_ECB_ENC( tweak_ctx, AES_ENCRYPT, iv, t_buf.u8 );
-
-	goto first;
+	AES_ECB_ENC( tweak_ctx, AES_ENCRYPT, iv, tweaks[0].u8 );
 
-	do
+	while( nb_blocks > 0 )
 	{
-		gf128mul_x_ble( t_buf.u8, t_buf.u8 );
+		/* The tweaks of these blocks, plus the next one's to carry on with */
+		nb_tweaks = nb_blocks < XTS_TWEAKS_BLOCKS ? nb_blocks : XTS_TWEAKS_BLOCKS;
+		dis_xts_tweaks(
+			(const unsigned char (*)[16]) tweaks[0].u8, 1, nb_tweaks + 1,
+			(unsigned char (*)[16]) tweaks[0].u8
+		);
+
+		for( i = 0; i < nb_tweaks; i++ )
+		{
+			/* PP <- T xor P */
+			scratch.u64[0] = (uint64_t)( inbuf->u64[0] ^ tweaks[i].u64[0] );
+			scratch.u64[1] = (uint64_t)( inbuf->u64[1] ^ tweaks[i].u64[1] );
 
-first:
-		/* PP <- T xor P */
-		scratch.u64[0] = (uint64_t)( inbuf->u64[0] ^ t_buf.u64[0] );
-		scratch.u64[1] = (uint64_t)( inbuf->u64[1] ^ t_buf.u64[1] );
+			/* CC <- E(Key2,PP) */
+			AES_ECB_ENC( crypt_ctx, mode, scratch.u8, outbuf->u8 );
 
-		/* CC <- E(Key2,PP) */
-		AES_ECB_ENC( crypt_ctx, mode, scratch.u8, outbuf->u8 );
+			/* C <- T xor CC */
+			outbuf->u64[0] = (uint64_t)( outbuf->u64[0] ^ tweaks[i].u64[0] );
+			outbuf->u64[1] = (uint64_t)( outbuf->u64[1] ^ tweaks[i].u64[1] );
 
-		/* C <- T xor CC */
-		outbuf->u64[0] = (uint64_t)( outbuf->u64[0] ^ t_buf.u64[0] );
-		outbuf->u64[1] = (uint64_t)( outbuf->u64[1] ^ t_buf.u64[1] );
+			inbuf  += 1;
+			outbuf += 1;
+		}
 
-		inbuf     += 1;
-		outbuf    += 1;
-		nb_blocks -= 1;
-	} while( nb_blocks > 0 );
+		nb_blocks -= nb_tweaks;
+		t_buf      = tweaks[nb_tweaks - 1];
+		tweaks[0]  = tweaks[nb_tweaks];
+	}
 
 	/* Ciphertext stealing, if necessary */
 	if( remaining != 0 )
@@ -0,0 +1,1437 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <string.h>
+
+#include "dislocker/common.h"
+#include "dislocker/encryption/aesni.h"
+
+
+#ifdef _HAVE_AESNI
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+
+/* The AES-NI code is built for these instructions whatever the compiler flags */
+#define AESNI_TARGET   __attribute__ ((target ("aes,sse2")))
+#define CLMUL_TARGET   __attribute__ ((target ("pclmul,sse2")))
+#define VAES256_TARGET __attribute__ ((target ("aes,sse2,avx2,vaes,vpclmulqdq")))
+#define VAES512_TARGET \
+	__attribute__ ((target ("aes,sse2,avx2,avx512f,vaes,vpclmulqdq")))
+
+/* XCR0 bits telling the OS saves the AVX and AVX-512 registers */
+#define XCR0_AVX    0x06
+#define XCR0_AVX512 0xe6
+
+/* Number of blocks in flight in the kernels below */
+#define AESNI_BLOCKS 8
+
+/* Do an operation on each of the blocks in flight, named 0 to 7 */
+#define FOR_EACH_BLOCK(op) op(0) op(1) op(2) op(3) op(4) op(5) op(6) op(7)
+
+
+
+/* An XTS kernel, once the tweak is encrypted, see xts_blocks() */
+typedef int (*xts_blocks_fn_t)(
+	const dis_aesni_key_t* crypt_key,
+	int encrypt,
+	size_t length,
+	__m128i tweak,
+	const uint8_t* input,
+	uint8_t* output
+);
+
+
+
+/** Prototype of functions used internally */
+AESNI_TARGET static __m128i expand_key(__m128i key, __m128i assist);
+AESNI_TARGET static __m128i encrypt_block(const dis_aesni_key_t* key, __m128i block);
+AESNI_TARGET static __m128i decrypt_block(const dis_aesni_key_t* key, __m128i block);
+AESNI_TARGET static __m128i xts_mul_x(__m128i tweak);
+CLMUL_TARGET static __m128i xts_mul_x4(__m128i tweak);
+AESNI_TARGET static int xts_blocks(
+	const dis_aesni_key_t* crypt_key,
+	int encrypt,
+	size_t length,
+	__m128i tweak,
+	const uint8_t* input,
+	uint8_t* output
+);
+VAES256_TARGET static int xts_blocks_vaes256(
+	const dis_aesni_key_t* crypt_key,
+	int encrypt,
+	size_t length,
+	__m128i tweak,
+	const uint8_t* input,
+	uint8_t* output
+);
+VAES512_TARGET static int xts_blocks_vaes512(
+	const dis_aesni_key_t* crypt_key,
+	int encrypt,
+	size_t length,
+	__m128i tweak,
+	const uint8_t* input,
+	uint8_t* output
+);
+VAES256_TARGET static __m256i xts_mul_x2_256(__m256i tweaks);
+VAES512_TARGET static __m512i xts_mul_x4_512(__m512i tweaks);
+static uint64_t xgetbv0(void);
+
+
+
+
+/**
+ * Find out which of the instructions the AES-NI code uses the CPU has
+ *
+ * @return The features available, a mask of dis_aesni_features_e
+ */
+unsigned int dis_aesni_features(void)
+{
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	unsigned int features = 0;
+	uint64_t     xcr0     = 0;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	if(!(edx & bit_SSE2))
+		return 0;
+
+	if(ecx & bit_PCLMUL)
+		features |= DIS_AESNI_CLMUL;
+
+	if(ecx & bit_AES)
+		features |= DIS_AESNI_AES;
+
+	/* The wider registers have to be enabled by the OS too */
+	if(!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return features;
+
+	xcr0 = xgetbv0();
+
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return features;
+
+	if((ebx & bit_AVX2) && (xcr0 & XCR0_AVX) == XCR0_AVX)
+		features |= DIS_AESNI_AVX2;
+
+	if(!(features & DIS_AESNI_AES))
+		return features;
+
+	if(!(ecx & bit_VAES) || !(ecx & bit_VPCLMULQDQ))
+		return features;
+
+	if(features & DIS_AESNI_AVX2)
+		features |= DIS_AESNI_VAES_AVX2;
+
+	if((ebx & bit_AVX512F) && (xcr0 & XCR0_AVX512) == XCR0_AVX512)
+		features |= DIS_AESNI_VAES_AVX512;
+
+	return features;
+}
+
+
+/**
+ * Compute the round keys of a key, for both encryption and decryption
+ *
+ * @param key Where to put the round keys
+ * @param raw_key The key
+ * @param bits The size of the key, 128 or 256
+ * @return TRUE if result can be trusted, FALSE otherwise
+ */
+AESNI_TARGET
+int dis_aesni_set_key(dis_aesni_key_t* key, const uint8_t* raw_key, unsigned int bits)
+{
+	__m128i rk[15];
+	int     loop = 0;
+
+	if(!key || !raw_key)
+		return FALSE;
+
+/* The RCON given to AESKEYGENASSIST has to be an immediate */
+#define EXPAND_128(n, rcon) \
+	rk[n] = expand_key(rk[n - 1], _mm_shuffle_epi32( \
+		_mm_aeskeygenassist_si128(rk[n - 1], rcon), 0xff))
+#define EXPAND_256_EVEN(n, rcon) \
+	rk[n] = expand_key(rk[n - 2], _mm_shuffle_epi32( \
+		_mm_aeskeygenassist_si128(rk[n - 1], rcon), 0xff))
+#define EXPAND_256_ODD(n) \
+	rk[n] = expand_key(rk[n - 2], _mm_shuffle_epi32( \
+		_mm_aeskeygenassist_si128(rk[n - 1], 0x00), 0xaa))
+
+	rk[0] = _mm_loadu_si128((const __m128i*) raw_key);
+
+	if(bits == 128)
+	{
+		key->rounds = 10;
+		EXPAND_128(1, 0x01);
+		EXPAND_128(2, 0x02);
+		EXPAND_128(3, 0x04);
+		EXPAND_128(4, 0x08);
+		EXPAND_128(5, 0x10);
+		EXPAND_128(6, 0x20);
+		EXPAND_128(7, 0x40);
+		EXPAND_128(8, 0x80);
+		EXPAND_128(9, 0x1b);
+		EXPAND_128(10, 0x36);
+	}
+	else if(bits == 256)
+	{
+		key->rounds = 14;
+		rk[1] = _mm_loadu_si128((const __m128i*) (raw_key + 16));
+		EXPAND_256_EVEN(2, 0x01);
+		EXPAND_256_ODD(3);
+		EXPAND_256_EVEN(4, 0x02);
+		EXPAND_256_ODD(5);
+		EXPAND_256_EVEN(6, 0x04);
+		EXPAND_256_ODD(7);
+		EXPAND_256_EVEN(8, 0x08);
+		EXPAND_256_ODD(9);
+		EXPAND_256_EVEN(10, 0x10);
+		EXPAND_256_ODD(11);
+		EXPAND_256_EVEN(12, 0x20);
+		EXPAND_256_ODD(13);
+		EXPAND_256_EVEN(14, 0x40);
+	}
+	else
+		return FALSE;
+
+#undef EXPAND_128
+#undef EXPAND_256_EVEN
+#undef EXPAND_256_ODD
+
+	for(loop = 0; loop <= key->rounds; loop++)
+	{
+		_mm_store_si128((__m128i*) key->enc[loop], rk[loop]);
+
+		/* The first and last decryption round keys aren't mixed */
+		if(loop == 0 || loop == key->rounds)
+			_mm_store_si128((__m128i*) key->dec[loop], rk[key->rounds - loop]);
+		else
+			_mm_store_si128(
+				(__m128i*) key->dec[loop],
+				_mm_aesimc_si128(rk[key->rounds - loop])
+			);
+	}
+
+	memset(rk, 0, sizeof(rk));
+
+	return TRUE;
+}
+
+
+/**
+ * AES-XTS buffer encryption/decryption, as dis_aes_crypt_xts() does, with
+ * AESNI_BLOCKS blocks in flight and the tweaks kept in registers
+ *
+ * @param crypt_key The key used to encrypt or decrypt the data
+ * @param tweak_key The key used to encrypt the tweak
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param length The size of the data, a multiple of 16
+ * @param iv The tweak, before its encryption
+ * @param input The data to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return 0 on success, -1 if the length isn't supported
+ */
+AESNI_TARGET
+int dis_aesni_xts(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	/* No ciphertext stealing here, sectors are made of whole blocks */
+	if(length == 0 || length % 16)
+		return -1;
+
+	return xts_blocks(
+		crypt_key,
+		encrypt,
+		length,
+		encrypt_block(tweak_key, _mm_loadu_si128((const __m128i*) iv)),
+		input,
+		output
+	);
+}
+
+
+/**
+ * AES-XTS buffer encryption/decryption, as dis_aesni_xts() does, with VAES on
+ * 256 bits registers: 8 blocks in flight in 4 registers
+ *
+ * @param crypt_key The key used to encrypt or decrypt the data
+ * @param tweak_key The key used to encrypt the tweak
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param length The size of the data, a multiple of 16
+ * @param iv The tweak, before its encryption
+ * @param input The data to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return 0 on success, -1 if the length isn't supported
+ */
+VAES256_TARGET
+int dis_aesni_xts_vaes256(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	if(length < DIS_AESNI_WIDE_MIN_SIZE)
+		return dis_aesni_xts(
+			crypt_key, tweak_key, encrypt, length, iv, input, output
+		);
+
+	if(length % 16)
+		return -1;
+
+	return xts_blocks_vaes256(
+		crypt_key,
+		encrypt,
+		length,
+		encrypt_block(tweak_key, _mm_loadu_si128((const __m128i*) iv)),
+		input,
+		output
+	);
+}
+
+
+/**
+ * AES-XTS buffer encryption/decryption, as dis_aesni_xts() does, with VAES on
+ * AVX-512 registers: 16 blocks in flight in 4 registers
+ *
+ * @param crypt_key The key used to encrypt or decrypt the data
+ * @param tweak_key The key used to encrypt the tweak
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param length The size of the data, a multiple of 16
+ * @param iv The tweak, before its encryption
+ * @param input The data to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return 0 on success, -1 if the length isn't supported
+ */
+VAES512_TARGET
+int dis_aesni_xts_vaes512(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	if(length < DIS_AESNI_WIDE_MIN_SIZE)
+		return dis_aesni_xts(
+			crypt_key, tweak_key, encrypt, length, iv, input, output
+		);
+
+	if(length % 16)
+		return -1;
+
+	return xts_blocks_vaes512(
+		crypt_key,
+		encrypt,
+		length,
+		encrypt_block(tweak_key, _mm_loadu_si128((const __m128i*) iv)),
+		input,
+		output
+	);
+}
+
+
+/**
+ * Choose the fastest XTS kernel the CPU can run
+ *
+ * @param features The CPU's features, from dis_aesni_features()
+ * @return The kernel, NULL if AES-NI isn't available
+ */
+dis_aesni_xts_fn_t dis_aesni_xts_select(unsigned int features)
+{
+	if(!(features & DIS_AESNI_AES))
+		return NULL;
+
+	if(features & DIS_AESNI_VAES_AVX512)
+		return dis_aesni_xts_vaes512;
+
+	if(features & DIS_AESNI_VAES_AVX2)
+		return dis_aesni_xts_vaes256;
+
+	return dis_aesni_xts;
+}
+
+
+/**
+ * AES-XTS encryption/decryption of contiguous sectors, each sector's tweak
+ * being its index. The tweaks of AESNI_BLOCKS sectors are encrypted at once,
+ * then each sector goes through the kernel dis_aesni_xts_select() would give.
+ * The wide kernels are chosen on the whole batch's size, so that small sectors
+ * get them too.
+ *
+ * @param crypt_key The key used to encrypt or decrypt the data
+ * @param tweak_key The key used to encrypt the tweaks
+ * @param features The CPU's features, from dis_aesni_features()
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param sector_size The size of a sector, a multiple of 16
+ * @param nb_sectors The number of sectors
+ * @param first_index The index of the first sector
+ * @param input The sectors to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return 0 on success, -1 if the sector size isn't supported
+ */
+AESNI_TARGET
+int dis_aesni_xts_sectors(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	unsigned int features,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_index,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	uint8_t  tweaks[AESNI_BLOCKS][16];
+	xts_blocks_fn_t blocks = xts_blocks;
+	uint64_t index  = 0;
+	size_t   loop   = 0;
+	size_t   nb     = 0;
+	size_t   sector = 0;
+
+	if(sector_size == 0 || sector_size % 16)
+		return -1;
+
+	/* Same choice as dis_aesni_xts_select()'s kernels, for the whole batch */
+	if(sector_size * nb_sectors >= DIS_AESNI_WIDE_MIN_SIZE)
+	{
+		if(features & DIS_AESNI_VAES_AVX512)
+			blocks = xts_blocks_vaes512;
+		else if(features & DIS_AESNI_VAES_AVX2)
+			blocks = xts_blocks_vaes256;
+	}
+
+	for(loop = 0; loop < nb_sectors; loop += nb)
+	{
+		nb = nb_sectors - loop;
+		if(nb > AESNI_BLOCKS)
+			nb = AESNI_BLOCKS;
+
+		/* The tweaks of these sectors, encrypted together */
+		for(sector = 0; sector < nb; sector++)
+		{
+			index = first_index + loop + sector;
+			memset(tweaks[sector], 0, 16);
+			memcpy(tweaks[sector], &index, sizeof(index));
+		}
+		dis_aesni_ecb_encrypt(tweak_key, nb, tweaks[0], tweaks[0]);
+
+		for(sector = 0; sector < nb; sector++)
+			blocks(
+				crypt_key,
+				encrypt,
+				sector_size,
+				_mm_loadu_si128((const __m128i*) tweaks[sector]),
+				input + sector_size * (loop + sector),
+				output + sector_size * (loop + sector)
+			);
+	}
+
+	return 0;
+}
+
+
+/**
+ * AES-ECB encryption of independent blocks, AESNI_BLOCKS at a time
+ *
+ * @param key The key used to encrypt the blocks
+ * @param nb_blocks The number of blocks
+ * @param input The blocks to encrypt
+ * @param output Where to put the result, may be the input
+ * @return 0 on success, -1 if there's no block
+ */
+AESNI_TARGET
+int dis_aesni_ecb_encrypt(
+	const dis_aesni_key_t* key,
+	size_t nb_blocks,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	const uint8_t (*rk)[16] = key->enc;
+	int     rounds = key->rounds;
+	int     round  = 0;
+	__m128i round_key, first_key;
+	__m128i b0, b1, b2, b3, b4, b5, b6, b7;
+
+	if(nb_blocks == 0)
+		return -1;
+
+	first_key = _mm_load_si128((const __m128i*) rk[0]);
+
+#define ECB_LOAD(j) \
+	b##j = _mm_xor_si128( \
+		_mm_loadu_si128((const __m128i*) (input + 16 * j)), \
+		first_key \
+	);
+#define ECB_ENC(j)      b##j = _mm_aesenc_si128(b##j, round_key);
+#define ECB_ENC_LAST(j) b##j = _mm_aesenclast_si128(b##j, round_key);
+#define ECB_STORE(j) \
+	_mm_storeu_si128((__m128i*) (output + 16 * j), b##j);
+
+	while(nb_blocks >= AESNI_BLOCKS)
+	{
+		FOR_EACH_BLOCK(ECB_LOAD)
+
+		for(round = 1; round < rounds; round++)
+		{
+			round_key = _mm_load_si128((const __m128i*) rk[round]);
+			FOR_EACH_BLOCK(ECB_ENC)
+		}
+		round_key = _mm_load_si128((const __m128i*) rk[rounds]);
+		FOR_EACH_BLOCK(ECB_ENC_LAST)
+
+		FOR_EACH_BLOCK(ECB_STORE)
+
+		input     += AESNI_BLOCKS * 16;
+		output    += AESNI_BLOCKS * 16;
+		nb_blocks -= AESNI_BLOCKS;
+	}
+
+#undef ECB_LOAD
+#undef ECB_ENC
+#undef ECB_ENC_LAST
+#undef ECB_STORE
+
+	/* What's left, one block at a time */
+	while(nb_blocks > 0)
+	{
+		b0 = encrypt_block(key, _mm_loadu_si128((const __m128i*) input));
+		_mm_storeu_si128((__m128i*) output, b0);
+
+		input     += 16;
+		output    += 16;
+		nb_blocks -= 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * AES-CBC buffer decryption. Each plaintext block only depends on two
+ * ciphertext blocks, so AESNI_BLOCKS blocks are decrypted at once.
+ *
+ * @param key The key used to decrypt the data
+ * @param length The size of the data, a multiple of 16
+ * @param iv The initialization vector
+ * @param input The data to decrypt
+ * @param output Where to put the result, may be the input
+ * @return 0 on success, -1 if the length isn't supported
+ */
+AESNI_TARGET
+int dis_aesni_cbc_decrypt(
+	const dis_aesni_key_t* key,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	const uint8_t (*rk)[16] = key->dec;
+	int     rounds = key->rounds;
+	int     round  = 0;
+	__m128i round_key, first_key, previous;
+	__m128i b0, b1, b2, b3, b4, b5, b6, b7;
+	__m128i c0, c1, c2, c3, c4, c5, c6, c7;
+
+	if(length == 0 || length % 16)
+		return -1;
+
+	first_key = _mm_load_si128((const __m128i*) rk[0]);
+	previous  = _mm_loadu_si128((const __m128i*) iv);
+
+/* The ciphertext is kept, it's XORed with the next block's output */
+#define CBC_LOAD(j) \
+	c##j = _mm_loadu_si128((const __m128i*) (input + 16 * j)); \
+	b##j = _mm_xor_si128(c##j, first_key);
+#define CBC_DEC(j)      b##j = _mm_aesdec_si128(b##j, round_key);
+#define CBC_DEC_LAST(j) b##j = _mm_aesdeclast_si128(b##j, round_key);
+#define CBC_STORE(j) \
+	_mm_storeu_si128((__m128i*) (output + 16 * j), b##j);
+
+	while(length >= AESNI_BLOCKS * 16)
+	{
+		FOR_EACH_BLOCK(CBC_LOAD)
+
+		for(round = 1; round < rounds; round++)
+		{
+			round_key = _mm_load_si128((const __m128i*) rk[round]);
+			FOR_EACH_BLOCK(CBC_DEC)
+		}
+		round_key = _mm_load_si128((const __m128i*) rk[rounds]);
+		FOR_EACH_BLOCK(CBC_DEC_LAST)
+
+		/* P <- D(C) xor previous C */
+		b0 = _mm_xor_si128(b0, previous);
+		b1 = _mm_xor_si128(b1, c0);
+		b2 = _mm_xor_si128(b2, c1);
+		b3 = _mm_xor_si128(b3, c2);
+		b4 = _mm_xor_si128(b4, c3);
+		b5 = _mm_xor_si128(b5, c4);
+		b6 = _mm_xor_si128(b6, c5);
+		b7 = _mm_xor_si128(b7, c6);
+		previous = c7;
+
+		FOR_EACH_BLOCK(CBC_STORE)
+
+		input  += AESNI_BLOCKS * 16;
+		output += AESNI_BLOCKS * 16;
+		length -= AESNI_BLOCKS * 16;
+	}
+
+#undef CBC_LOAD
+#undef CBC_DEC
+#undef CBC_DEC_LAST
+#undef CBC_STORE
+
+	/* What's left, one block at a time */
+	while(length > 0)
+	{
+		c0 = _mm_loadu_si128((const __m128i*) input);
+		b0 = _mm_xor_si128(decrypt_block(key, c0), previous);
+		_mm_storeu_si128((__m128i*) output, b0);
+
+		previous = c0;
+		input  += 16;
+		output += 16;
+		length -= 16;
+	}
+
+	return 0;
+}
+
+
+/**
+ * AES-CBC encryption of several independent buffers, such as sectors which
+ * each have their own IV. CBC encryption is serial within a buffer, but the
+ * buffers' chains don't depend on each other, so they go through AESENC
+ * together.
+ *
+ * @param key The key used to encrypt the data
+ * @param nb_chains The number of buffers, up to DIS_AESNI_CBC_CHAINS
+ * @param length The size of each buffer, a multiple of 16
+ * @param ivs The initialization vector of each buffer
+ * @param input The buffers to encrypt, one after the other
+ * @param output Where to put the result, may be the input
+ * @return 0 on success, -1 if the parameters aren't supported
+ */
+AESNI_TARGET
+int dis_aesni_cbc_encrypt_chains(
+	const dis_aesni_key_t* key,
+	size_t nb_chains,
+	size_t length,
+	const uint8_t (*ivs)[16],
+	const uint8_t* input,
+	uint8_t* output)
+{
+	const uint8_t (*rk)[16] = key->enc;
+	int     rounds = key->rounds;
+	int     round  = 0;
+	size_t  chain  = 0;
+	size_t  offset = 0;
+	__m128i round_key, first_key;
+	__m128i blocks[DIS_AESNI_CBC_CHAINS];
+
+	if(nb_chains == 0 || nb_chains > DIS_AESNI_CBC_CHAINS)
+		return -1;
+
+	if(length == 0 || length % 16)
+		return -1;
+
+	first_key = _mm_load_si128((const __m128i*) rk[0]);
+
+	/* The "previous ciphertext" of each chain's first block is its IV */
+	for(chain = 0; chain < nb_chains; chain++)
+		blocks[chain] = _mm_loadu_si128((const __m128i*) ivs[chain]);
+
+	for(offset = 0; offset < length; offset += 16)
+	{
+		/* PP <- P xor previous C, with the first round key */
+		for(chain = 0; chain < nb_chains; chain++)
+			blocks[chain] = _mm_xor_si128(
+				_mm_xor_si128(blocks[chain], first_key),
+				_mm_loadu_si128(
+					(const __m128i*) (input + chain * length + offset)
+				)
+			);
+
+		for(round = 1; round < rounds; round++)
+		{
+			round_key = _mm_load_si128((const __m128i*) rk[round]);
+			for(chain = 0; chain < nb_chains; chain++)
+				blocks[chain] = _mm_aesenc_si128(blocks[chain], round_key);
+		}
+
+		round_key = _mm_load_si128((const __m128i*) rk[rounds]);
+		for(chain = 0; chain < nb_chains; chain++)
+		{
+			blocks[chain] = _mm_aesenclast_si128(blocks[chain], round_key);
+			_mm_storeu_si128(
+				(__m128i*) (output + chain * length + offset),
+				blocks[chain]
+			);
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Compute the tweaks of one or several XTS sequences, such as the sectors of a
+ * run: tweaks[s * nb_blocks + i] is first[s] times x^i. Four tweaks of a
+ * sequence are computed at once, each from the one four blocks before, so
+ * that there's no dependency between them.
+ *
+ * @param first The (encrypted) tweak of each sequence's first block
+ * @param nb_sequences The number of sequences
+ * @param nb_blocks The number of blocks of each sequence
+ * @param tweaks Where to put the nb_sequences * nb_blocks tweaks
+ */
+CLMUL_TARGET
+void dis_aesni_xts_tweaks(
+	const uint8_t (*first)[16],
+	size_t nb_sequences,
+	size_t nb_blocks,
+	uint8_t (*tweaks)[16])
+{
+	const __m128i poly = _mm_set_epi32(0, 1, 0, 0x87);
+	__m128i t0, t1, t2, t3, carry;
+	size_t  seq   = 0;
+	size_t  block = 0;
+
+/* Multiply by x, as xts_mul_x() does but without requiring AES-NI */
+#define MUL_X(t) ( \
+	carry = _mm_shuffle_epi32(_mm_srai_epi32(t, 31), 0x13), \
+	_mm_xor_si128(_mm_slli_epi64(t, 1), _mm_and_si128(carry, poly)) \
+)
+#define STORE(i, t) _mm_storeu_si128((__m128i*) tweaks[i], t)
+
+	for(seq = 0; seq < nb_sequences; seq++, tweaks += nb_blocks)
+	{
+		if(nb_blocks == 0)
+			break;
+
+		t0 = _mm_loadu_si128((const __m128i*) first[seq]);
+		t1 = MUL_X(t0);
+		t2 = MUL_X(t1);
+		t3 = MUL_X(t2);
+
+		for(block = 0; block + 4 <= nb_blocks; block += 4)
+		{
+			STORE(block,     t0);
+			STORE(block + 1, t1);
+			STORE(block + 2, t2);
+			STORE(block + 3, t3);
+
+			t0 = xts_mul_x4(t0);
+			t1 = xts_mul_x4(t1);
+			t2 = xts_mul_x4(t2);
+			t3 = xts_mul_x4(t3);
+		}
+
+		/* The last ones, when the sequence isn't a multiple of 4 blocks */
+		if(block < nb_blocks)
+			STORE(block++, t0);
+		if(block < nb_blocks)
+			STORE(block++, t1);
+		if(block < nb_blocks)
+			STORE(block++, t2);
+	}
+
+#undef MUL_X
+#undef STORE
+}
+
+
+
+
+/**
+ * Encrypt or decrypt XTS blocks, once the tweak is encrypted, AESNI_BLOCKS at
+ * a time then one at a time
+ *
+ * @param crypt_key The key used to encrypt or decrypt the data
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param length The size of the data, a multiple of 16
+ * @param tweak The tweak of the first block
+ * @param input The data to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return 0
+ */
+AESNI_TARGET
+static int xts_blocks(
+	const dis_aesni_key_t* crypt_key,
+	int encrypt,
+	size_t length,
+	__m128i tweak,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	const uint8_t (*rk)[16] = encrypt ? crypt_key->enc : crypt_key->dec;
+	int     rounds = crypt_key->rounds;
+	int     round  = 0;
+	__m128i key, first_key;
+	__m128i b0, b1, b2, b3, b4, b5, b6, b7;
+	__m128i t0, t1, t2, t3, t4, t5, t6, t7;
+
+	first_key = _mm_load_si128((const __m128i*) rk[0]);
+
+/* PP <- T xor P, with the first round key */
+#define XTS_LOAD(j) \
+	t##j  = tweak; \
+	tweak = xts_mul_x(tweak); \
+	b##j  = _mm_xor_si128( \
+		_mm_loadu_si128((const __m128i*) (input + 16 * j)), \
+		_mm_xor_si128(t##j, first_key) \
+	);
+#define XTS_ENC(j)      b##j = _mm_aesenc_si128(b##j, key);
+#define XTS_ENC_LAST(j) b##j = _mm_aesenclast_si128(b##j, key);
+#define XTS_DEC(j)      b##j = _mm_aesdec_si128(b##j, key);
+#define XTS_DEC_LAST(j) b##j = _mm_aesdeclast_si128(b##j, key);
+/* C <- T xor CC */
+#define XTS_STORE(j) \
+	_mm_storeu_si128((__m128i*) (output + 16 * j), _mm_xor_si128(b##j, t##j));
+
+	while(length >= AESNI_BLOCKS * 16)
+	{
+		FOR_EACH_BLOCK(XTS_LOAD)
+
+		if(encrypt)
+		{
+			for(round = 1; round < rounds; round++)
+			{
+				key = _mm_load_si128((const __m128i*) rk[round]);
+				FOR_EACH_BLOCK(XTS_ENC)
+			}
+			key = _mm_load_si128((const __m128i*) rk[rounds]);
+			FOR_EACH_BLOCK(XTS_ENC_LAST)
+		}
+		else
+		{
+			for(round = 1; round < rounds; round++)
+			{
+				key = _mm_load_si128((const __m128i*) rk[round]);
+				FOR_EACH_BLOCK(XTS_DEC)
+			}
+			key = _mm_load_si128((const __m128i*) rk[rounds]);
+			FOR_EACH_BLOCK(XTS_DEC_LAST)
+		}
+
+		FOR_EACH_BLOCK(XTS_STORE)
+
+		input  += AESNI_BLOCKS * 16;
+		output += AESNI_BLOCKS * 16;
+		length -= AESNI_BLOCKS * 16;
+	}
+
+#undef XTS_LOAD
+#undef XTS_ENC
+#undef XTS_ENC_LAST
+#undef XTS_DEC
+#undef XTS_DEC_LAST
+#undef XTS_STORE
+
+	/* What's left, one block at a time */
+	while(length > 0)
+	{
+		b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) input), tweak);
+		if(encrypt)
+			b0 = encrypt_block(crypt_key, b0);
+		else
+			b0 = decrypt_block(crypt_key, b0);
+		_mm_storeu_si128((__m128i*) output, _mm_xor_si128(b0, tweak));
+
+		tweak   = xts_mul_x(tweak);
+		input  += 16;
+		output += 16;
+		length -= 16;
+	}
+
+	return 0;
+}
+
+
+/**
+ * One step of the key expansion
+ *
+ * @param key The round key the new one is derived from
+ * @param assist The AESKEYGENASSIST result, with the right word broadcast
+ * @return The new round key
+ */
+AESNI_TARGET
+static __m128i expand_key(__m128i key, __m128i assist)
+{
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+
+	return _mm_xor_si128(key, assist);
+}
+
+
+/**
+ * Encrypt a single block
+ *
+ * @param key The round keys
+ * @param block The block to encrypt
+ * @return The encrypted block
+ */
+AESNI_TARGET
+static __m128i encrypt_block(const dis_aesni_key_t* key, __m128i block)
+{
+	int round = 0;
+
+	block = _mm_xor_si128(block, _mm_load_si128((const __m128i*) key->enc[0]));
+	for(round = 1; round < key->rounds; round++)
+		block = _mm_aesenc_si128(
+			block,
+			_mm_load_si128((const __m128i*) key->enc[round])
+		);
+
+	return _mm_aesenclast_si128(
+		block,
+		_mm_load_si128((const __m128i*) key->enc[key->rounds])
+	);
+}
+
+
+/**
+ * Decrypt a single block
+ *
+ * @param key The round keys
+ * @param block The block to decrypt
+ * @return The decrypted block
+ */
+AESNI_TARGET
+static __m128i decrypt_block(const dis_aesni_key_t* key, __m128i block)
+{
+	int round = 0;
+
+	block = _mm_xor_si128(block, _mm_load_si128((const __m128i*) key->dec[0]));
+	for(round = 1; round < key->rounds; round++)
+		block = _mm_aesdec_si128(
+			block,
+			_mm_load_si128((const __m128i*) key->dec[round])
+		);
+
+	return _mm_aesdeclast_si128(
+		block,
+		_mm_load_si128((const __m128i*) key->dec[key->rounds])
+	);
+}
+
+
+/**
+ * Multiply a tweak by x in GF(2^128), as gf128mul_x_ble() does: both 64 bits
+ * halves are shifted, the carry of the low one goes into the high one and the
+ * carry of the high one is reduced into the low one
+ *
+ * @param tweak The tweak to multiply
+ * @return The tweak multiplied
+ */
+AESNI_TARGET
+static __m128i xts_mul_x(__m128i tweak)
+{
+	const __m128i poly = _mm_set_epi32(0, 1, 0, 0x87);
+	__m128i carry = _mm_shuffle_epi32(_mm_srai_epi32(tweak, 31), 0x13);
+
+	return _mm_xor_si128(_mm_slli_epi64(tweak, 1), _mm_and_si128(carry, poly));
+}
+
+
+/**
+ * Encrypt or decrypt XTS blocks on 256 bits registers, once the tweak is
+ * encrypted, as dis_aesni_xts_vaes256() does
+ *
+ * @param crypt_key The key used to encrypt or decrypt the data
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param length The size of the data, a multiple of 16
+ * @param tweak The tweak of the first block
+ * @param input The data to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return 0
+ */
+VAES256_TARGET
+static int xts_blocks_vaes256(
+	const dis_aesni_key_t* crypt_key,
+	int encrypt,
+	size_t length,
+	__m128i tweak,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	const uint8_t (*rk)[16] = encrypt ? crypt_key->enc : crypt_key->dec;
+	int     rounds = crypt_key->rounds;
+	int     round  = 0;
+	__m256i tweaks, key, first_key;
+	__m256i b0, b1, b2, b3;
+	__m256i t0, t1, t2, t3;
+
+	/* The tweaks of the first 2 blocks, each register's are x^2 times these */
+	tweaks = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(tweak),
+		xts_mul_x(tweak),
+		1
+	);
+	first_key = _mm256_broadcastsi128_si256(
+		_mm_load_si128((const __m128i*) rk[0])
+	);
+
+/* PP <- T xor P, with the first round key */
+#define XTS_LOAD(j) \
+	t##j   = tweaks; \
+	tweaks = xts_mul_x2_256(tweaks); \
+	b##j   = _mm256_xor_si256( \
+		_mm256_loadu_si256((const __m256i*) (input + 32 * j)), \
+		_mm256_xor_si256(t##j, first_key) \
+	);
+#define XTS_ROUND_KEY(r) \
+	key = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) rk[r]));
+#define XTS_ENC(j)      b##j = _mm256_aesenc_epi128(b##j, key);
+#define XTS_ENC_LAST(j) b##j = _mm256_aesenclast_epi128(b##j, key);
+#define XTS_DEC(j)      b##j = _mm256_aesdec_epi128(b##j, key);
+#define XTS_DEC_LAST(j) b##j = _mm256_aesdeclast_epi128(b##j, key);
+/* C <- T xor CC */
+#define XTS_STORE(j) \
+	_mm256_storeu_si256((__m256i*) (output + 32 * j), _mm256_xor_si256(b##j, t##j));
+#define FOR_EACH_REGISTER(op) op(0) op(1) op(2) op(3)
+
+	while(length >= AESNI_BLOCKS * 16)
+	{
+		FOR_EACH_REGISTER(XTS_LOAD)
+
+		if(encrypt)
+		{
+			for(round = 1; round < rounds; round++)
+			{
+				XTS_ROUND_KEY(round)
+				FOR_EACH_REGISTER(XTS_ENC)
+			}
+			XTS_ROUND_KEY(rounds)
+			FOR_EACH_REGISTER(XTS_ENC_LAST)
+		}
+		else
+		{
+			for(round = 1; round < rounds; round++)
+			{
+				XTS_ROUND_KEY(round)
+				FOR_EACH_REGISTER(XTS_DEC)
+			}
+			XTS_ROUND_KEY(rounds)
+			FOR_EACH_REGISTER(XTS_DEC_LAST)
+		}
+
+		FOR_EACH_REGISTER(XTS_STORE)
+
+		input  += AESNI_BLOCKS * 16;
+		output += AESNI_BLOCKS * 16;
+		length -= AESNI_BLOCKS * 16;
+	}
+
+#undef XTS_LOAD
+#undef XTS_ROUND_KEY
+#undef XTS_ENC
+#undef XTS_ENC_LAST
+#undef XTS_DEC
+#undef XTS_DEC_LAST
+#undef XTS_STORE
+#undef FOR_EACH_REGISTER
+
+	/* Going back to SSE code with dirty upper halves would stall it */
+	tweak = _mm256_castsi256_si128(tweaks);
+	_mm256_zeroupper();
+
+	if(length == 0)
+		return 0;
+
+	/* What's left, from the next tweak on */
+	return xts_blocks(crypt_key, encrypt, length, tweak, input, output);
+}
+
+
+/**
+ * Encrypt or decrypt XTS blocks on 512 bits registers, once the tweak is
+ * encrypted, as dis_aesni_xts_vaes512() does
+ *
+ * @param crypt_key The key used to encrypt or decrypt the data
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param length The size of the data, a multiple of 16
+ * @param tweak The tweak of the first block
+ * @param input The data to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return 0
+ */
+VAES512_TARGET
+static int xts_blocks_vaes512(
+	const dis_aesni_key_t* crypt_key,
+	int encrypt,
+	size_t length,
+	__m128i tweak,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	const uint8_t (*rk)[16] = encrypt ? crypt_key->enc : crypt_key->dec;
+	int     rounds = crypt_key->rounds;
+	int     round  = 0;
+	__m128i tweak_x2;
+	__m512i tweaks, key, first_key;
+	__m512i b0, b1, b2, b3;
+	__m512i t0, t1, t2, t3;
+
+	/* The tweaks of the first 4 blocks, each register's are x^4 times these */
+	tweak_x2 = xts_mul_x(xts_mul_x(tweak));
+	tweaks   = _mm512_inserti64x4(
+		_mm512_castsi256_si512(_mm256_inserti128_si256(
+			_mm256_castsi128_si256(tweak), xts_mul_x(tweak), 1
+		)),
+		_mm256_inserti128_si256(
+			_mm256_castsi128_si256(tweak_x2), xts_mul_x(tweak_x2), 1
+		),
+		1
+	);
+	first_key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*) rk[0]));
+
+/* PP <- T xor P, with the first round key */
+#define XTS_LOAD(j) \
+	t##j   = tweaks; \
+	tweaks = xts_mul_x4_512(tweaks); \
+	b##j   = _mm512_xor_si512( \
+		_mm512_loadu_si512((const void*) (input + 64 * j)), \
+		_mm512_xor_si512(t##j, first_key) \
+	);
+#define XTS_ROUND_KEY(r) \
+	key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*) rk[r]));
+#define XTS_ENC(j)      b##j = _mm512_aesenc_epi128(b##j, key);
+#define XTS_ENC_LAST(j) b##j = _mm512_aesenclast_epi128(b##j, key);
+#define XTS_DEC(j)      b##j = _mm512_aesdec_epi128(b##j, key);
+#define XTS_DEC_LAST(j) b##j = _mm512_aesdeclast_epi128(b##j, key);
+/* C <- T xor CC */
+#define XTS_STORE(j) \
+	_mm512_storeu_si512((void*) (output + 64 * j), _mm512_xor_si512(b##j, t##j));
+#define FOR_EACH_REGISTER(op) op(0) op(1) op(2) op(3)
+
+	while(length >= 2 * AESNI_BLOCKS * 16)
+	{
+		FOR_EACH_REGISTER(XTS_LOAD)
+
+		if(encrypt)
+		{
+			for(round = 1; round < rounds; round++)
+			{
+				XTS_ROUND_KEY(round)
+				FOR_EACH_REGISTER(XTS_ENC)
+			}
+			XTS_ROUND_KEY(rounds)
+			FOR_EACH_REGISTER(XTS_ENC_LAST)
+		}
+		else
+		{
+			for(round = 1; round < rounds; round++)
+			{
+				XTS_ROUND_KEY(round)
+				FOR_EACH_REGISTER(XTS_DEC)
+			}
+			XTS_ROUND_KEY(rounds)
+			FOR_EACH_REGISTER(XTS_DEC_LAST)
+		}
+
+		FOR_EACH_REGISTER(XTS_STORE)
+
+		input  += 2 * AESNI_BLOCKS * 16;
+		output += 2 * AESNI_BLOCKS * 16;
+		length -= 2 * AESNI_BLOCKS * 16;
+	}
+
+#undef XTS_LOAD
+#undef XTS_ROUND_KEY
+#undef XTS_ENC
+#undef XTS_ENC_LAST
+#undef XTS_DEC
+#undef XTS_DEC_LAST
+#undef XTS_STORE
+#undef FOR_EACH_REGISTER
+
+	/* Going back to SSE code with dirty upper halves would stall it */
+	tweak = _mm512_castsi512_si128(tweaks);
+	_mm256_zeroupper();
+
+	if(length == 0)
+		return 0;
+
+	/* What's left, from the next tweak on */
+	return xts_blocks(crypt_key, encrypt, length, tweak, input, output);
+}
+
+
+/**
+ * Multiply an XTS tweak by x^4: the 4 bits carried out of the high half are
+ * reduced with a carry-less multiplication
+ *
+ * @param tweak The tweak to multiply
+ * @return The tweak multiplied
+ */
+CLMUL_TARGET
+static __m128i xts_mul_x4(__m128i tweak)
+{
+	const __m128i poly = _mm_set_epi64x(0, 0x87);
+	__m128i carry = _mm_srli_epi64(tweak, 60);
+
+	tweak = _mm_xor_si128(
+		_mm_slli_epi64(tweak, 4),
+		_mm_unpacklo_epi64(_mm_setzero_si128(), carry)
+	);
+
+	return _mm_xor_si128(tweak, _mm_clmulepi64_si128(carry, poly, 0x01));
+}
+
+
+/**
+ * Multiply the 2 tweaks of a register by x^2: the bits carried out of the high
+ * halves are reduced with a carry-less multiplication
+ *
+ * @param tweaks The tweaks to multiply
+ * @return The tweaks multiplied
+ */
+VAES256_TARGET
+static __m256i xts_mul_x2_256(__m256i tweaks)
+{
+	const __m256i poly = _mm256_set_epi64x(0, 0x87, 0, 0x87);
+	__m256i carry = _mm256_srli_epi64(tweaks, 62);
+
+	tweaks = _mm256_xor_si256(
+		_mm256_slli_epi64(tweaks, 2),
+		_mm256_unpacklo_epi64(_mm256_setzero_si256(), carry)
+	);
+
+	return _mm256_xor_si256(tweaks, _mm256_clmulepi64_epi128(carry, poly, 0x01));
+}
+
+
+/**
+ * Multiply the 4 tweaks of a register by x^4, as xts_mul_x2_256() does
+ *
+ * @param tweaks The tweaks to multiply
+ * @return The tweaks multiplied
+ */
+VAES512_TARGET
+static __m512i xts_mul_x4_512(__m512i tweaks)
+{
+	const __m512i poly = _mm512_set_epi64(0, 0x87, 0, 0x87, 0, 0x87, 0, 0x87);
+	__m512i carry = _mm512_srli_epi64(tweaks, 60);
+
+	tweaks = _mm512_xor_si512(
+		_mm512_slli_epi64(tweaks, 4),
+		_mm512_unpacklo_epi64(_mm512_setzero_si512(), carry)
+	);
+
+	return _mm512_xor_si512(tweaks, _mm512_clmulepi64_epi128(carry, poly, 0x01));
+}
+
+
+/**
+ * Read XCR0, to know which registers the OS saves
+ *
+ * @return XCR0's value
+ */
+static uint64_t xgetbv0(void)
+{
+	uint32_t eax = 0, edx = 0;
+
+	__asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+
+	return ((uint64_t) edx << 32) | eax;
+}
+
+
+#else /* _HAVE_AESNI */
+
+
+unsigned int dis_aesni_features(void)
+{
+	return 0;
+}
+
+
+int dis_aesni_set_key(dis_aesni_key_t* key, const uint8_t* raw_key, unsigned int bits)
+{
+	(void) key;
+	(void) raw_key;
+	(void) bits;
+	return FALSE;
+}
+
+
+int dis_aesni_xts(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) crypt_key;
+	(void) tweak_key;
+	(void) encrypt;
+	(void) length;
+	(void) iv;
+	(void) input;
+	(void) output;
+	return -1;
+}
+
+
+int dis_aesni_xts_vaes256(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	return dis_aesni_xts(
+		crypt_key, tweak_key, encrypt, length, iv, input, output
+	);
+}
+
+
+int dis_aesni_xts_vaes512(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	int encrypt,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	return dis_aesni_xts(
+		crypt_key, tweak_key, encrypt, length, iv, input, output
+	);
+}
+
+
+dis_aesni_xts_fn_t dis_aesni_xts_select(unsigned int features)
+{
+	(void) features;
+	return NULL;
+}
+
+
+int dis_aesni_xts_sectors(
+	const dis_aesni_key_t* crypt_key,
+	const dis_aesni_key_t* tweak_key,
+	unsigned int features,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_index,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) crypt_key;
+	(void) tweak_key;
+	(void) features;
+	(void) encrypt;
+	(void) sector_size;
+	(void) nb_sectors;
+	(void) first_index;
+	(void) input;
+	(void) output;
+	return -1;
+}
+
+
+int dis_aesni_ecb_encrypt(
+	const dis_aesni_key_t* key,
+	size_t nb_blocks,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) key;
+	(void) nb_blocks;
+	(void) input;
+	(void) output;
+	return -1;
+}
+
+
+int dis_aesni_cbc_decrypt(
+	const dis_aesni_key_t* key,
+	size_t length,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) key;
+	(void) length;
+	(void) iv;
+	(void) input;
+	(void) output;
+	return -1;
+}
+
+
+int dis_aesni_cbc_encrypt_chains(
+	const dis_aesni_key_t* key,
+	size_t nb_chains,
+	size_t length,
+	const uint8_t (*ivs)[16],
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) key;
+	(void) nb_chains;
+	(void) length;
+	(void) ivs;
+	(void) input;
+	(void) output;
+	return -1;
+}
+
+
+void dis_aesni_xts_tweaks(
+	const uint8_t (*first)[16],
+	size_t nb_sequences,
+	size_t nb_blocks,
+	uint8_t (*tweaks)[16])
+{
+	(void) first;
+	(void) nb_sequences;
+	(void) nb_blocks;
+	(void) tweaks;
+}
+
+
+#endif /* _HAVE_AESNI */
@@ -0,0 +1,645 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <string.h>
+
+#include "dislocker/common.h"
+#include "dislocker/encryption/encommon.h"
+#include "dislocker/encryption/afalg.h"
+
+
+#ifdef _HAVE_AF_ALG
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_alg.h>
+
+#ifndef SOL_ALG
+#  define SOL_ALG 279
+#endif
+
+
+/* Number of CBC ivs encrypted with a single request */
+#define AFALG_IVS 64
+
+/*
+ * From this size on, a sector is spliced to the kernel instead of being
+ * copied by sendmsg(), see splice_data()
+ */
+#define AFALG_SPLICE_MIN 4096
+
+
+/*
+ * The transforms are bound and keyed once. Each enc/decryption accepts its own
+ * operation sockets from them, so that several threads can use the same keys.
+ */
+struct _dis_afalg_keys {
+	/* xts(aes) or cbc(aes) */
+	int cipher;
+
+	/* ecb(aes) with the FVEK, for the CBC ivs, -1 with XTS */
+	int ivs;
+};
+
+
+
+/** Prototype of functions used internally */
+static int new_transform(const char* name, const uint8_t* key, unsigned int key_size);
+static void close_transforms(dis_afalg_keys_t* keys);
+static int worth_it(size_t sector_size, size_t nb_sectors);
+static int open_pipe(size_t sector_size, int pipe_fds[2]);
+static void close_pipe(int pipe_fds[2]);
+static int crypt_request(
+	int op,
+	int encrypt,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output,
+	size_t size,
+	int pipe_fds[2],
+	uint8_t* scratch
+);
+static int splice_data(int op, int pipe_fds[2], const uint8_t* input, size_t size);
+
+
+
+/**
+ * Create the keys' structure, without any key in it
+ *
+ * @return The keys, to be set with dis_afalg_set_key()
+ */
+dis_afalg_keys_t* dis_afalg_new(void)
+{
+	dis_afalg_keys_t* keys = dis_malloc(sizeof(dis_afalg_keys_t));
+	keys->cipher = -1;
+	keys->ivs    = -1;
+	return keys;
+}
+
+
+/**
+ * Give the keys to the kernel for the given algorithm, replacing the previous
+ * ones
+ *
+ * @param keys The keys' structure
+ * @param algorithm The algorithm, one of the cipher_types data ones
+ * @param fvekey The entire FVEK, the XTS tweak key being right after the
+ * data one
+ * @return 0 on success, -1 if the kernel can't be used for this algorithm or
+ * these keys
+ */
+int dis_afalg_set_key(dis_afalg_keys_t* keys, uint16_t algorithm, const uint8_t* fvekey)
+{
+	if(!keys || !fvekey)
+		return -1;
+
+	close_transforms(keys);
+
+	switch(algorithm)
+	{
+		case AES_128_DIFFUSER:
+		case AES_128_NO_DIFFUSER:
+			keys->cipher = new_transform("cbc(aes)", fvekey, 16);
+			keys->ivs    = new_transform("ecb(aes)", fvekey, 16);
+			break;
+		case AES_256_DIFFUSER:
+		case AES_256_NO_DIFFUSER:
+			keys->cipher = new_transform("cbc(aes)", fvekey, 32);
+			keys->ivs    = new_transform("ecb(aes)", fvekey, 32);
+			break;
+		case AES_XTS_128:
+			keys->cipher = new_transform("xts(aes)", fvekey, 32);
+			return keys->cipher < 0 ? -1 : 0;
+		case AES_XTS_256:
+			keys->cipher = new_transform("xts(aes)", fvekey, 64);
+			return keys->cipher < 0 ? -1 : 0;
+		default:
+			return -1;
+	}
+
+	if(keys->cipher < 0 || keys->ivs < 0)
+	{
+		close_transforms(keys);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * AES-XTS encryption/decryption of contiguous sectors by the kernel, each
+ * sector's tweak being its index. Batches smaller than DIS_AFALG_MIN_SIZE are
+ * left to the caller. A sector is either entirely done or untouched, so the
+ * caller can deal with the remaining ones if the kernel fails.
+ *
+ * @param keys The keys, set up for XTS
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param sector_size The size of a sector, a multiple of 16
+ * @param nb_sectors The number of sectors
+ * @param first_index The index of the first sector
+ * @param input The sectors to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return The number of sectors done, from the first one
+ */
+size_t dis_afalg_xts_sectors(
+	dis_afalg_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_index,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	uint8_t  iv[16];
+	uint8_t* scratch = NULL;
+	uint64_t index   = 0;
+	size_t   loop    = 0;
+	int      op      = -1;
+	int      pipe_fds[2] = {-1, -1};
+
+	if(!keys || keys->cipher < 0 || keys->ivs >= 0 ||
+	   !worth_it(sector_size, nb_sectors))
+		return 0;
+
+	op = accept4(keys->cipher, NULL, 0, SOCK_CLOEXEC);
+	if(op < 0)
+		return 0;
+
+	open_pipe(sector_size, pipe_fds);
+
+	/* In place, a failing sector must not be left half-overwritten */
+	if(input == output)
+		scratch = dis_malloc(sector_size);
+
+	for(loop = 0; loop < nb_sectors; loop++)
+	{
+		index = first_index + loop;
+		memset(iv, 0, 16);
+		memcpy(iv, &index, sizeof(index));
+
+		if(crypt_request(
+				op,
+				encrypt,
+				iv,
+				input + sector_size * loop,
+				output + sector_size * loop,
+				sector_size,
+				pipe_fds,
+				scratch) != 0)
+			break;
+	}
+
+	if(scratch)
+		dis_free(scratch);
+	close_pipe(pipe_fds);
+	close(op);
+	return loop;
+}
+
+
+/**
+ * AES-CBC encryption/decryption of contiguous sectors by the kernel, each
+ * sector's iv being the encryption of its address. The ivs of AFALG_IVS
+ * sectors are encrypted with a single request. Batches smaller than
+ * DIS_AFALG_MIN_SIZE are left to the caller. A sector is either entirely done
+ * or untouched, so the caller can deal with the remaining ones if the kernel
+ * fails.
+ *
+ * @param keys The keys, set up for CBC
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param sector_size The size of a sector, a multiple of 16
+ * @param nb_sectors The number of sectors
+ * @param first_address The address of the first sector
+ * @param input The sectors to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return The number of sectors done, from the first one
+ */
+size_t dis_afalg_cbc_sectors(
+	dis_afalg_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_address,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	uint8_t  ivs[AFALG_IVS][16];
+	uint8_t* scratch = NULL;
+	uint64_t address = 0;
+	size_t   done    = 0;
+	size_t   nb      = 0;
+	size_t   sector  = 0;
+	size_t   offset  = 0;
+	int      op      = -1;
+	int      ivs_op  = -1;
+	int      pipe_fds[2] = {-1, -1};
+
+	if(!keys || keys->ivs < 0 || !worth_it(sector_size, nb_sectors))
+		return 0;
+
+	op     = accept4(keys->cipher, NULL, 0, SOCK_CLOEXEC);
+	ivs_op = accept4(keys->ivs, NULL, 0, SOCK_CLOEXEC);
+	if(op < 0 || ivs_op < 0)
+		goto end;
+
+	open_pipe(sector_size, pipe_fds);
+
+	/* In place, a failing sector must not be left half-overwritten */
+	if(input == output)
+		scratch = dis_malloc(sector_size);
+
+	while(done < nb_sectors)
+	{
+		nb = nb_sectors - done;
+		if(nb > AFALG_IVS)
+			nb = AFALG_IVS;
+
+		/* First, create the ivs of these sectors */
+		for(sector = 0; sector < nb; sector++)
+		{
+			address = first_address + sector_size * (done + sector);
+			memset(ivs[sector], 0, 16);
+			memcpy(ivs[sector], &address, sizeof(address));
+		}
+		if(crypt_request(ivs_op, TRUE, NULL, ivs[0], ivs[0], 16 * nb, NULL, NULL) != 0)
+			goto end;
+
+		/* Then actually enc/decrypt them */
+		for(sector = 0; sector < nb; sector++, done++)
+		{
+			offset = sector_size * done;
+			if(crypt_request(
+					op,
+					encrypt,
+					ivs[sector],
+					input + offset,
+					output + offset,
+					sector_size,
+					pipe_fds,
+					scratch) != 0)
+				goto end;
+		}
+	}
+
+end:
+	memset(ivs, 0, sizeof(ivs));
+	if(scratch)
+		dis_free(scratch);
+	close_pipe(pipe_fds);
+	if(op >= 0)
+		close(op);
+	if(ivs_op >= 0)
+		close(ivs_op);
+	return done;
+}
+
+
+/**
+ * Free the keys, along with the kernel's transforms
+ *
+ * @param keys The keys to free, may be NULL
+ */
+void dis_afalg_destroy(dis_afalg_keys_t* keys)
+{
+	if(!keys)
+		return;
+
+	close_transforms(keys);
+	dis_free(keys);
+}
+
+
+
+
+/**
+ * Bind a transform socket to a cipher and give it its key
+ *
+ * @param name The kernel's name of the cipher
+ * @param key The key
+ * @param key_size The key's size, in bytes
+ * @return The socket, -1 on error
+ */
+static int new_transform(const char* name, const uint8_t* key, unsigned int key_size)
+{
+	struct sockaddr_alg sa;
+	int fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	if(fd < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.salg_family = AF_ALG;
+	memcpy(sa.salg_type, "skcipher", sizeof("skcipher"));
+	memcpy(sa.salg_name, name, strlen(name) + 1);
+
+	if(bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0 ||
+	   setsockopt(fd, SOL_ALG, ALG_SET_KEY, key, key_size) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/**
+ * Close the transform sockets of the keys
+ *
+ * @param keys The keys
+ */
+static void close_transforms(dis_afalg_keys_t* keys)
+{
+	if(keys->cipher >= 0)
+		close(keys->cipher);
+	if(keys->ivs >= 0)
+		close(keys->ivs);
+	keys->cipher = -1;
+	keys->ivs    = -1;
+}
+
+
+/**
+ * Tell whether a batch of sectors is worth giving to the kernel
+ *
+ * @param sector_size The size of a sector
+ * @param nb_sectors The number of sectors
+ * @return TRUE if it is, FALSE otherwise
+ */
+static int worth_it(size_t sector_size, size_t nb_sectors)
+{
+	if(sector_size < 16 || sector_size % 16)
+		return FALSE;
+
+	return nb_sectors * sector_size >= DIS_AFALG_MIN_SIZE;
+}
+
+
+/**
+ * Open the pipe the sectors are spliced through, if they're large enough
+ *
+ * @param sector_size The size of a sector
+ * @param pipe_fds Where to put the pipe's ends, left to -1 if it's not used
+ * @return 0 if the pipe is used, -1 otherwise
+ */
+static int open_pipe(size_t sector_size, int pipe_fds[2])
+{
+	if(sector_size < AFALG_SPLICE_MIN)
+		return -1;
+
+	if(pipe2(pipe_fds, O_CLOEXEC) < 0)
+	{
+		pipe_fds[0] = -1;
+		pipe_fds[1] = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Close the pipe opened by open_pipe(), if any
+ *
+ * @param pipe_fds The pipe's ends
+ */
+static void close_pipe(int pipe_fds[2])
+{
+	if(pipe_fds[0] >= 0)
+		close(pipe_fds[0]);
+	if(pipe_fds[1] >= 0)
+		close(pipe_fds[1]);
+}
+
+
+/**
+ * Enc/decrypt data with a single request on an operation socket: the
+ * operation and the iv are sent along with the data, then the result is read
+ * back
+ *
+ * @param op The operation socket
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param iv The request's iv, NULL for ECB
+ * @param input The data to enc/decrypt
+ * @param output Where to put the result, may be the input
+ * @param size The data's size
+ * @param pipe_fds The pipe to splice the data through, or NULL/-1 to copy it
+ * @param scratch Where to read the result before copying it to the output, so
+ * that a short read leaves the output untouched, NULL to read it directly
+ * @return 0 on success, -1 otherwise
+ */
+static int crypt_request(
+	int op,
+	int encrypt,
+	const uint8_t* iv,
+	const uint8_t* input,
+	uint8_t* output,
+	size_t size,
+	int pipe_fds[2],
+	uint8_t* scratch)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(uint32_t)) +
+		         CMSG_SPACE(sizeof(struct af_alg_iv) + 16)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr     msg;
+	struct cmsghdr*   cmsg   = NULL;
+	struct af_alg_iv* alg_iv = NULL;
+	struct iovec      iov;
+	uint32_t          type   = encrypt ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+	ssize_t           ret    = 0;
+
+	memset(&control, 0, sizeof(control));
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type  = ALG_SET_OP;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(uint32_t));
+	memcpy(CMSG_DATA(cmsg), &type, sizeof(uint32_t));
+
+	if(iv)
+	{
+		cmsg = CMSG_NXTHDR(&msg, cmsg);
+		cmsg->cmsg_level = SOL_ALG;
+		cmsg->cmsg_type  = ALG_SET_IV;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(struct af_alg_iv) + 16);
+		alg_iv = (struct af_alg_iv*) CMSG_DATA(cmsg);
+		alg_iv->ivlen = 16;
+		memcpy(alg_iv->iv, iv, 16);
+	}
+	else
+		msg.msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+
+	if(pipe_fds && pipe_fds[0] >= 0)
+	{
+		/* Only the operation goes through sendmsg(), the data is spliced */
+		if(sendmsg(op, &msg, MSG_MORE) < 0 ||
+		   splice_data(op, pipe_fds, input, size) != 0)
+			return -1;
+	}
+	else
+	{
+		iov.iov_base   = (void*) input;
+		iov.iov_len    = size;
+		msg.msg_iov    = &iov;
+		msg.msg_iovlen = 1;
+
+		do
+			ret = sendmsg(op, &msg, 0);
+		while(ret < 0 && errno == EINTR);
+
+		if(ret != (ssize_t) size)
+			return -1;
+	}
+
+	do
+		ret = read(op, scratch ? scratch : output, size);
+	while(ret < 0 && errno == EINTR);
+
+	if(ret != (ssize_t) size)
+		return -1;
+
+	if(scratch)
+		memcpy(output, scratch, size);
+
+	return 0;
+}
+
+
+/**
+ * Give data to an operation socket without copying it: the user pages are
+ * mapped into the pipe, then moved to the socket. The last part ends the
+ * request.
+ *
+ * @param op The operation socket
+ * @param pipe_fds The pipe, empty
+ * @param input The data
+ * @param size The data's size
+ * @return 0 on success, -1 otherwise, the pipe being then unusable
+ */
+static int splice_data(int op, int pipe_fds[2], const uint8_t* input, size_t size)
+{
+	struct iovec iov;
+	ssize_t      ret  = 0;
+	size_t       done = 0;
+
+	while(done < size)
+	{
+		iov.iov_base = (void*) (input + done);
+		iov.iov_len  = size - done;
+
+		ret = vmsplice(pipe_fds[1], &iov, 1, 0);
+		if(ret <= 0)
+			return -1;
+
+		if(splice(
+				pipe_fds[0],
+				NULL,
+				op,
+				NULL,
+				(size_t) ret,
+				done + (size_t) ret < size ? SPLICE_F_MORE : 0) != ret)
+			return -1;
+
+		done += (size_t) ret;
+	}
+
+	return 0;
+}
+
+
+#else /* _HAVE_AF_ALG */
+
+
+dis_afalg_keys_t* dis_afalg_new(void)
+{
+	return NULL;
+}
+
+
+int dis_afalg_set_key(dis_afalg_keys_t* keys, uint16_t algorithm, const uint8_t* fvekey)
+{
+	(void) keys;
+	(void) algorithm;
+	(void) fvekey;
+	return -1;
+}
+
+
+size_t dis_afalg_xts_sectors(
+	dis_afalg_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_index,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) keys;
+	(void) encrypt;
+	(void) sector_size;
+	(void) nb_sectors;
+	(void) first_index;
+	(void) input;
+	(void) output;
+	return 0;
+}
+
+
+size_t dis_afalg_cbc_sectors(
+	dis_afalg_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_address,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) keys;
+	(void) encrypt;
+	(void) sector_size;
+	(void) nb_sectors;
+	(void) first_address;
+	(void) input;
+	(void) output;
+	return 0;
+}
+
+
+void dis_afalg_destroy(dis_afalg_keys_t* keys)
+{
+	(void) keys;
+}
+
+
+#endif /* _HAVE_AF_ALG */
@@ -28,6 +28,10 @@
 #include "dislocker/encryption/encommon.priv.h"
 
 
+/* Number of sectors whose sector keys are computed together */
+#define SECTOR_KEYS_BATCH 8
+
+
 
 /*
  * Two functions used by decrypt_key
@@ -47,6 +51,35 @@ static int aes_ccm_compute_unencrypted_tag(
 									unsigned char* mac
 								   );
 
+/*
+ * The bodies of the functions depending on the sector size, instantiated for
+ * any size and for the usual ones, see DECRYPT_SIZED()
+ */
+DIS_CRYPT_TEMPLATE void decrypt_cbc_sectors_with_diffuser_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer,
+	void (*diffuser)(uint8_t*, uint16_t, const uint8_t*)
+);
+DIS_CRYPT_TEMPLATE void decrypt_xts_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	uint8_t* sector,
+	off_t sector_address,
+	uint8_t* buffer
+);
+DIS_CRYPT_TEMPLATE void decrypt_xts_sectors_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+
 
 
 
@@ -409,6 +442,52 @@ int decrypt_sector(dis_crypt_t crypt, uint8_t* sector, off_t sector_address, uin
 }
 
 
+/**
+ * Interface to decrypt contiguous sectors, all at once with the decryption's
+ * own batch function, one after the other if it hasn't any
+ *
+ * @param crypt Data needed by the decryption to deal with encrypted data
+ * @param nb_sectors The number of sectors to decrypt
+ * @param sector_address Address of the first sector to decrypt
+ * @param input The sectors to decrypt
+ * @param output The place where we have to put decrypted data, may be the
+ * input
+ * @return TRUE if result can be trusted, FALSE otherwise
+ */
+int dis_crypt_decrypt_sectors(dis_crypt_t crypt, size_t nb_sectors, off_t sector_address, uint8_t* input, uint8_t* output)
+{
+	size_t loop = 0;
+
+	// Check parameters
+	if(!crypt || !input || !output)
+		return FALSE;
+
+	if(crypt->decrypt_sectors_fn)
+	{
+		crypt->decrypt_sectors_fn(
+			&crypt->ctx,
+			crypt->sector_size,
+			nb_sectors,
+			input,
+			sector_address,
+			output
+		);
+		return TRUE;
+	}
+
+	for(loop = 0; loop < nb_sectors; loop++)
+		crypt->decrypt_fn(
+			&crypt->ctx,
+			crypt->sector_size,
+			input + crypt->sector_size * loop,
+			sector_address + crypt->sector_size * (off_t) loop,
+			output + crypt->sector_size * loop
+		);
+
+	return TRUE;
+}
+
+
 /**
  * Decrypt a sector which was not encrypted with the diffuser
  *
@@ -426,17 +505,132 @@ void decrypt_cbc_without_diffuser(dis_aes_contexts_t* ctx, uint16_t sector_size,
 		off_t single;
 	} iv;
 
+	if(ctx->evp && dis_evp_cbc_sectors(
+		ctx->evp,
+		FALSE,
+		sector_size,
+		1,
+		(uint64_t) sector_address,
+		sector,
+		buffer) == 1)
+		return;
+
 	memset(iv.multi, 0, 16);
 
 	/* Create the iv */
 	iv.single = sector_address;
 	AES_ECB_ENC(&ctx->FVEK_E_ctx, AES_ENCRYPT, iv.multi, iv.multi);
 
-	/* Actually decrypt data */
+	/* Actually decrypt data, with AES-NI when the CPU has it */
+	if(ctx->aesni && dis_aesni_cbc_decrypt(
+		&ctx->FVEK_ni,
+		sector_size,
+		iv.multi,
+		sector,
+		buffer) == 0)
+		return;
+
 	AES_CBC(&ctx->FVEK_D_ctx, AES_DECRYPT, sector_size, iv.multi, sector, buffer);
 }
 
 
+/**
+ * Decrypt contiguous sectors which were not encrypted with the diffuser. The
+ * ivs of a batch of sectors are computed at once.
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to decrypt
+ * @param sectors The sectors to decrypt
+ * @param sector_address Address of the first sector to decrypt
+ * @param buffer The place where we have to put decrypted data, may be the
+ * sectors
+ */
+void decrypt_cbc_sectors_without_diffuser(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	uint8_t ivs[SECTOR_KEYS_BATCH][16];
+	size_t  loop   = 0;
+	size_t  nb     = 0;
+	size_t  sector = 0;
+	uint8_t* input  = NULL;
+	uint8_t* output = NULL;
+	size_t   done   = 0;
+
+	/* Large batches may be left to the kernel, the rest is done here */
+	if(ctx->afalg)
+	{
+		done = dis_afalg_cbc_sectors(
+			ctx->afalg,
+			FALSE,
+			sector_size,
+			nb_sectors,
+			(uint64_t) sector_address,
+			sectors,
+			buffer
+		);
+		sectors        += sector_size * done;
+		buffer         += sector_size * done;
+		sector_address += sector_size * (off_t) done;
+		nb_sectors     -= done;
+	}
+
+	/* Then OpenSSL, which may leave the sectors it failed on */
+	if(ctx->evp)
+	{
+		done = dis_evp_cbc_sectors(
+			ctx->evp,
+			FALSE,
+			sector_size,
+			nb_sectors,
+			(uint64_t) sector_address,
+			sectors,
+			buffer
+		);
+		sectors        += sector_size * done;
+		buffer         += sector_size * done;
+		sector_address += sector_size * (off_t) done;
+		nb_sectors     -= done;
+	}
+
+	for(loop = 0; loop < nb_sectors; loop += nb)
+	{
+		nb = nb_sectors - loop;
+		if(nb > SECTOR_KEYS_BATCH)
+			nb = SECTOR_KEYS_BATCH;
+
+		dis_crypt_cbc_ivs(
+			ctx,
+			sector_size,
+			nb,
+			sector_address + sector_size * (off_t) loop,
+			ivs
+		);
+
+		for(sector = 0; sector < nb; sector++)
+		{
+			input  = sectors + sector_size * (loop + sector);
+			output = buffer + sector_size * (loop + sector);
+
+			if(ctx->aesni && dis_aesni_cbc_decrypt(
+				&ctx->FVEK_ni,
+				sector_size,
+				ivs[sector],
+				input,
+				output) == 0)
+				continue;
+
+			AES_CBC(&ctx->FVEK_D_ctx, AES_DECRYPT, sector_size, ivs[sector], input, output);
+		}
+	}
+}
+
+
 /**
  * Decrypt a sector which was encrypted with the diffuser enabled
  *
@@ -449,49 +643,239 @@ void decrypt_cbc_without_diffuser(dis_aes_contexts_t* ctx, uint16_t sector_size,
 void decrypt_cbc_with_diffuser(dis_aes_contexts_t* ctx, uint16_t sector_size, uint8_t* sector, off_t sector_address, uint8_t* buffer)
 {
 	/* Parameters are assumed to be correctly checked already */
+	decrypt_cbc_sectors_with_diffuser(ctx, sector_size, 1, sector, sector_address, buffer);
+}
 
-	union {
-		uint8_t multi[16];
-		off_t single;
-	} iv;
-	memset(iv.multi, 0, 16);
 
-	uint8_t sector_key[32] = {0,};
+/**
+ * Decrypt contiguous sectors which were encrypted with the diffuser. The
+ * sector keys of a batch of sectors are computed at once, the batch is
+ * decrypted at once, then each sector goes through the diffusers while it's
+ * still in the cache, without any copy.
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to decrypt
+ * @param sectors The sectors to decrypt
+ * @param sector_address Address of the first sector to decrypt
+ * @param buffer The place where we have to put decrypted data, may be the
+ * sectors
+ */
+void decrypt_cbc_sectors_with_diffuser(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	decrypt_cbc_sectors_with_diffuser_template(
+		ctx,
+		sector_size,
+		nb_sectors,
+		sectors,
+		sector_address,
+		buffer,
+		diffuser_decrypt_sector
+	);
+}
+
 
-	int loop = 0;
+/**
+ * Decrypt a sector which was encrypted with AES-XTS
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param sector The sector to decrypt
+ * @param sector_address Address of the sector to decrypt
+ * @param buffer The place where we have to put decrypted data
+ */
+void decrypt_xts(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	uint8_t* sector,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	decrypt_xts_template(ctx, sector_size, sector, sector_address, buffer);
+}
 
 
-	/* First, create the sector key */
-	iv.single = sector_address;
+/**
+ * Decrypt contiguous sectors which were encrypted with AES-XTS. With AES-NI,
+ * the tweaks of a batch of sectors are encrypted at once.
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to decrypt
+ * @param sectors The sectors to decrypt
+ * @param sector_address Address of the first sector to decrypt
+ * @param buffer The place where we have to put decrypted data, may be the
+ * sectors
+ */
+void decrypt_xts_sectors(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	decrypt_xts_sectors_template(
+		ctx,
+		sector_size,
+		nb_sectors,
+		sectors,
+		sector_address,
+		buffer
+	);
+}
 
-	AES_ECB_ENC(&ctx->TWEAK_E_ctx, AES_ENCRYPT, iv.multi, sector_key);
-	/* For iv unicity reason... */
-	iv.multi[15] = 0x80;
-	AES_ECB_ENC(&ctx->TWEAK_E_ctx, AES_ENCRYPT, iv.multi, &sector_key[16]);
 
+/*
+ * The functions above depending on the sector size, instantiated for sectors
+ * of the given size: the compiler then knows the loops' bounds and turns the
+ * divisions into shifts. Their sector_size parameter is ignored, it's only
+ * there for them to be used in place of the generic ones by dis_crypt_new().
+ */
+#define DECRYPT_SIZED(size) \
+	void decrypt_cbc_with_diffuser_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		uint8_t* sector, \
+		off_t sector_address, \
+		uint8_t* buffer) \
+	{ \
+		decrypt_cbc_sectors_with_diffuser_##size(ctx, sector_size, 1, sector, sector_address, buffer); \
+	} \
+	\
+	void decrypt_cbc_sectors_with_diffuser_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		size_t nb_sectors, \
+		uint8_t* sectors, \
+		off_t sector_address, \
+		uint8_t* buffer) \
+	{ \
+		(void) sector_size; \
+		decrypt_cbc_sectors_with_diffuser_template( \
+			ctx, size, nb_sectors, sectors, sector_address, buffer, \
+			diffuser_decrypt_sector_##size \
+		); \
+	} \
+	\
+	void decrypt_xts_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		uint8_t* sector, \
+		off_t sector_address, \
+		uint8_t* buffer) \
+	{ \
+		(void) sector_size; \
+		decrypt_xts_template(ctx, size, sector, sector_address, buffer); \
+	} \
+	\
+	void decrypt_xts_sectors_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		size_t nb_sectors, \
+		uint8_t* sectors, \
+		off_t sector_address, \
+		uint8_t* buffer) \
+	{ \
+		(void) sector_size; \
+		decrypt_xts_sectors_template(ctx, size, nb_sectors, sectors, sector_address, buffer); \
+	}
 
-	/* Then actually decrypt the buffer */
-	decrypt_cbc_without_diffuser(ctx, sector_size, sector, sector_address, buffer);
+DECRYPT_SIZED(512)
+DECRYPT_SIZED(4096)
 
+#undef DECRYPT_SIZED
 
-	/* Call diffuser B */
-	diffuserB_decrypt(buffer, sector_size, (uint32_t*)buffer);
 
 
-	/* Afterward, call diffuser A */
-	diffuserA_decrypt(buffer, sector_size, (uint32_t*)buffer);
 
+/**
+ * Decrypt contiguous sectors which were encrypted with the diffuser, as
+ * decrypt_cbc_sectors_with_diffuser()
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to decrypt
+ * @param sectors The sectors to decrypt
+ * @param sector_address Address of the first sector to decrypt
+ * @param buffer The place where we have to put decrypted data, may be the
+ * sectors
+ * @param diffuser The diffuser stage for this sector size
+ */
+DIS_CRYPT_TEMPLATE void decrypt_cbc_sectors_with_diffuser_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer,
+	void (*diffuser)(uint8_t*, uint16_t, const uint8_t*))
+{
+	uint8_t sector_keys[SECTOR_KEYS_BATCH][32];
+	size_t  loop   = 0;
+	size_t  nb     = 0;
+	size_t  sector = 0;
+	off_t   address = 0;
 
-	/* And finally, apply the sector key */
-	for(loop = 0; loop < sector_size; ++loop)
-		buffer[loop] ^= sector_key[loop % 32];
+	/*
+	 * The kernel only takes large batches: the whole run is decrypted at once
+	 * then, instead of a few sectors at a time below
+	 */
+	int whole = ctx->afalg && sector_size * nb_sectors >= DIS_AFALG_MIN_SIZE;
+
+	if(whole)
+		decrypt_cbc_sectors_without_diffuser(
+			ctx,
+			sector_size,
+			nb_sectors,
+			sectors,
+			sector_address,
+			buffer
+		);
+
+	for(loop = 0; loop < nb_sectors; loop += nb)
+	{
+		nb = nb_sectors - loop;
+		if(nb > SECTOR_KEYS_BATCH)
+			nb = SECTOR_KEYS_BATCH;
+
+		address = sector_address + sector_size * (off_t) loop;
+
+		/* First, create the sector keys */
+		dis_crypt_sector_keys(ctx, sector_size, nb, address, sector_keys);
+
+		/* Then actually decrypt the sectors */
+		if(!whole)
+			decrypt_cbc_sectors_without_diffuser(
+				ctx,
+				sector_size,
+				nb,
+				sectors + sector_size * loop,
+				address,
+				buffer + sector_size * loop
+			);
+
+		/* Diffuser B, diffuser A, and finally the sector key */
+		for(sector = 0; sector < nb; sector++)
+			diffuser(
+				buffer + sector_size * (loop + sector),
+				sector_size,
+				sector_keys[sector]
+			);
+	}
 
-	memset(sector_key, 0, 32);
+	memset(sector_keys, 0, sizeof(sector_keys));
 }
 
 
 /**
- * Decrypt a sector which was encrypted with AES-XTS
+ * Decrypt a sector which was encrypted with AES-XTS, as decrypt_xts()
  *
  * @param ctx AES's contexts
  * @param sector_size Size of a sector (in bytes)
@@ -499,7 +883,7 @@ void decrypt_cbc_with_diffuser(dis_aes_contexts_t* ctx, uint16_t sector_size, ui
  * @param sector_address Address of the sector to decrypt
  * @param buffer The place where we have to put decrypted data
  */
-void decrypt_xts(
+DIS_CRYPT_TEMPLATE void decrypt_xts_template(
 	dis_aes_contexts_t* ctx,
 	uint16_t sector_size,
 	uint8_t* sector,
@@ -516,6 +900,27 @@ void decrypt_xts(
 	memset(iv.multi, 0, 16);
 	iv.single = sector_address / sector_size;
 
+	if(ctx->evp && dis_evp_xts_sectors(
+		ctx->evp,
+		FALSE,
+		sector_size,
+		1,
+		(uint64_t) iv.single,
+		sector,
+		buffer) == 1)
+		return;
+
+	/* The AES-NI kernel is used when the CPU has it */
+	if(ctx->xts_ni && ctx->xts_ni(
+		&ctx->FVEK_ni,
+		&ctx->TWEAK_ni,
+		FALSE,
+		sector_size,
+		iv.multi,
+		sector,
+		buffer) == 0)
+		return;
+
 	AES_XTS(
 		&ctx->FVEK_D_ctx,
 		&ctx->TWEAK_E_ctx,
@@ -526,3 +931,85 @@ void decrypt_xts(
 		buffer
 	);
 }
+
+
+/**
+ * Decrypt contiguous sectors which were encrypted with AES-XTS, as
+ * decrypt_xts_sectors()
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to decrypt
+ * @param sectors The sectors to decrypt
+ * @param sector_address Address of the first sector to decrypt
+ * @param buffer The place where we have to put decrypted data, may be the
+ * sectors
+ */
+DIS_CRYPT_TEMPLATE void decrypt_xts_sectors_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	size_t loop = 0;
+	size_t done = 0;
+
+	/* Large batches may be left to the kernel, the rest is done here */
+	if(ctx->afalg)
+	{
+		done = dis_afalg_xts_sectors(
+			ctx->afalg,
+			FALSE,
+			sector_size,
+			nb_sectors,
+			(uint64_t) (sector_address / sector_size),
+			sectors,
+			buffer
+		);
+		sectors        += sector_size * done;
+		buffer         += sector_size * done;
+		sector_address += sector_size * (off_t) done;
+		nb_sectors     -= done;
+	}
+
+	/* Then OpenSSL, which may leave the sectors it failed on */
+	if(ctx->evp)
+	{
+		done = dis_evp_xts_sectors(
+			ctx->evp,
+			FALSE,
+			sector_size,
+			nb_sectors,
+			(uint64_t) (sector_address / sector_size),
+			sectors,
+			buffer
+		);
+		sectors        += sector_size * done;
+		buffer         += sector_size * done;
+		sector_address += sector_size * (off_t) done;
+		nb_sectors     -= done;
+	}
+
+	if(ctx->xts_ni && dis_aesni_xts_sectors(
+		&ctx->FVEK_ni,
+		&ctx->TWEAK_ni,
+		ctx->aesni,
+		FALSE,
+		sector_size,
+		nb_sectors,
+		(uint64_t) (sector_address / sector_size),
+		sectors,
+		buffer) == 0)
+		return;
+
+	for(loop = 0; loop < nb_sectors; loop++)
+		decrypt_xts_template(
+			ctx,
+			sector_size,
+			sectors + sector_size * loop,
+			sector_address + sector_size * (off_t) loop,
+			buffer + sector_size * loop
+		);
+}
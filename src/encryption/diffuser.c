@@ -25,21 +25,324 @@
 #include <string.h>
 
 #include "dislocker/encryption/diffuser.h"
+#include "dislocker/encryption/aesni.h"
+
+#ifdef _HAVE_AESNI
+#  include <immintrin.h>
+/* The AVX2 code is built for these instructions whatever the compiler flags */
+#  define AVX2_TARGET __attribute__ ((target ("avx2")))
+#endif /* _HAVE_AESNI */
 
 
 #define ROTATE_LEFT(a,n)  (((a) << (n)) | ((a) >> ((sizeof(a) * 8)-(n))))
 #define ROTATE_RIGHT(a,n) (((a) >> (n)) | ((a) << ((sizeof(a) * 8)-(n))))
 
+/* Number of cycles of each diffuser */
+#define A_CYCLES 5
+#define B_CYCLES 3
+
+/*
+ * The kernels below need sectors of at least 16 elements, by groups of 8 so
+ * that the unrolled loops fall on the right rotations; other sizes are dealt
+ * with by the references
+ */
+#define KERNELS_FIT(int_size) ((int_size) >= 16 && (int_size) % 8 == 0)
+
+/*
+ * The kernels are written once and inlined in each function using them, so
+ * that they're specialized for the sector sizes these functions are
+ * instantiated for, see DIFFUSER_SIZED()
+ */
+#define DIFFUSER_TEMPLATE static inline __attribute__ ((always_inline))
+
+/* The 8 elements whose terms wrap around the sector, by their rank */
+#define FOR_EACH_WRAPPED(op) op(0) op(1) op(2) op(3) op(4) op(5) op(6) op(7)
+#define FOR_EACH_WRAPPED_REVERSE(op) op(7) op(6) op(5) op(4) op(3) op(2) op(1) op(0)
+
+
+/* Rotations, by index modulo 4 */
+static const unsigned int Ra[] = {9, 0, 13, 0};
+static const unsigned int Rb[] = {0, 10, 0, 25};
+
+
+/** Prototype of functions used internally */
+DIFFUSER_TEMPLATE void a_decrypt(uint32_t* d, int int_size);
+DIFFUSER_TEMPLATE void b_decrypt(uint32_t* d, int int_size);
+DIFFUSER_TEMPLATE void a_encrypt(uint32_t* d, int int_size);
+DIFFUSER_TEMPLATE void b_encrypt(uint32_t* d, int int_size);
+DIFFUSER_TEMPLATE void xor_sector_key(
+	const uint8_t* sector,
+	uint16_t sector_size,
+	const uint8_t* sector_key,
+	uint8_t* buffer
+);
+DIFFUSER_TEMPLATE void decrypt_sector(
+	uint8_t* sector,
+	uint16_t sector_size,
+	const uint8_t* sector_key
+);
+DIFFUSER_TEMPLATE void encrypt_sector(
+	const uint8_t* sector,
+	uint16_t sector_size,
+	const uint8_t* sector_key,
+	uint8_t* buffer
+);
+DIFFUSER_TEMPLATE uint32_t rotate_left(uint32_t value, unsigned int bits);
+DIFFUSER_TEMPLATE uint32_t a_term(const uint32_t* d, int int_size, int i);
+DIFFUSER_TEMPLATE uint32_t b_term(const uint32_t* d, int int_size, int i);
+#ifdef _HAVE_AESNI
+static int use_avx2(void);
+AVX2_TARGET static __m256i rotate_left_256(__m256i values, __m256i bits);
+AVX2_TARGET static void diffuserA_encrypt_avx2(uint32_t* d, int int_size);
+AVX2_TARGET static void diffuserB_decrypt_avx2(uint32_t* d, int int_size);
+AVX2_TARGET static void apply_sector_key_avx2(
+	const uint8_t* sector,
+	uint16_t sector_size,
+	const uint8_t* sector_key,
+	uint8_t* buffer
+);
+#endif /* _HAVE_AESNI */
+
+
+
+
+/*
+ * In diffuser A, d[i] is changed with d[i-2] and d[i-5], and in diffuser B
+ * with d[i+2] and d[i+5]. The loops are split where these indices wrap around
+ * the sector, so that only the first (or last) 8 elements need a modulo, and
+ * unrolled by 4 so that the rotations are constants.
+ *
+ * When going through the sector in the direction the indices point to (A's
+ * encryption and B's decryption), elements only depend on values of the
+ * previous cycle and are done 8 at a time with AVX2. In the other direction,
+ * each element needs the one computed 2 steps before and that can't be.
+ */
+
 
 /**
  * Implement diffuser A's decryption algorithm as explained by Niels Ferguson
+ *
+ * @param sector The sector to de-diffuse
+ * @param sector_size The size of the sector (in bytes)
+ * @param buffer The resulted de-diffused data, may be the sector
+ */
+void diffuserA_decrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
+{
+	/* buffer is a pointer on a 4 bytes object */
+	int int_size = sector_size / 4;
+
+	if(!KERNELS_FIT(int_size))
+	{
+		diffuserA_decrypt_reference(sector, sector_size, buffer);
+		return;
+	}
+
+	/* Use buffer for the algorithm */
+	if((uint8_t*)buffer != sector)
+		memcpy(buffer, sector, sector_size);
+
+	a_decrypt(buffer, int_size);
+}
+
+
+
+/**
+ * Implement diffuser B's decryption algorithm as explained by Niels Ferguson
+ *
+ * @param sector The sector to de-diffuse
+ * @param sector_size The size of the sector (in bytes)
+ * @param buffer The resulted de-diffused data, may be the sector
+ */
+void diffuserB_decrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
+{
+	/* buffer is a pointer on a 4 bytes object */
+	int int_size = sector_size / 4;
+
+	if(!KERNELS_FIT(int_size))
+	{
+		diffuserB_decrypt_reference(sector, sector_size, buffer);
+		return;
+	}
+
+	/* Use buffer for the algorithm */
+	if((uint8_t*)buffer != sector)
+		memcpy(buffer, sector, sector_size);
+
+#ifdef _HAVE_AESNI
+	if(use_avx2())
+	{
+		diffuserB_decrypt_avx2(buffer, int_size);
+		return;
+	}
+#endif /* _HAVE_AESNI */
+
+	b_decrypt(buffer, int_size);
+}
+
+
+
+
+/**
+ * Implement diffuser A's encryption algorithm as explained by Niels Ferguson
+ *
+ * @param sector The sector to diffuse
+ * @param sector_size The size of the sector (in bytes)
+ * @param buffer The resulted diffused data, may be the sector
+ */
+void diffuserA_encrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
+{
+	/* buffer is a pointer on a 4 bytes object */
+	int int_size = sector_size / 4;
+
+	if(!KERNELS_FIT(int_size))
+	{
+		diffuserA_encrypt_reference(sector, sector_size, buffer);
+		return;
+	}
+
+	/* Use buffer for the algorithm */
+	if((uint8_t*)buffer != sector)
+		memcpy(buffer, sector, sector_size);
+
+#ifdef _HAVE_AESNI
+	if(use_avx2())
+	{
+		diffuserA_encrypt_avx2(buffer, int_size);
+		return;
+	}
+#endif /* _HAVE_AESNI */
+
+	a_encrypt(buffer, int_size);
+}
+
+
+/**
+ * Implement diffuser B's encryption algorithm as explained by Niels Ferguson
+ *
+ * @param sector The sector to diffuse
+ * @param sector_size The size of the sector (in bytes)
+ * @param buffer The resulted diffused data, may be the sector
+ */
+void diffuserB_encrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
+{
+	/* buffer is a pointer on a 4 bytes object */
+	int int_size = sector_size / 4;
+
+	if(!KERNELS_FIT(int_size))
+	{
+		diffuserB_encrypt_reference(sector, sector_size, buffer);
+		return;
+	}
+
+	/* Use buffer for the algorithm */
+	if((uint8_t*)buffer != sector)
+		memcpy(buffer, sector, sector_size);
+
+	b_encrypt(buffer, int_size);
+}
+
+
+
+
+/**
+ * XOR a sector with the 32 bytes sector key, repeated all along it. This is
+ * done 32 bytes at a time, with AVX2 when the CPU has it.
+ *
+ * @param sector The sector to XOR
+ * @param sector_size The size of the sector (in bytes), a multiple of 32
+ * @param sector_key The 32 bytes sector key
+ * @param buffer The result, may be the sector
+ */
+void diffuser_apply_sector_key(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer)
+{
+#ifdef _HAVE_AESNI
+	if(use_avx2())
+	{
+		apply_sector_key_avx2(sector, sector_size, sector_key, buffer);
+		return;
+	}
+#endif /* _HAVE_AESNI */
+
+	xor_sector_key(sector, sector_size, sector_key, buffer);
+}
+
+
+
+
+/**
+ * Undo the diffuser stage of a sector once it's CBC-decrypted: diffuser B,
+ * diffuser A, then the sector key
+ *
+ * @param sector The sector to de-diffuse, in place
+ * @param sector_size The size of the sector (in bytes)
+ * @param sector_key The sector's 32 bytes key
+ */
+void diffuser_decrypt_sector(uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key)
+{
+	decrypt_sector(sector, sector_size, sector_key);
+}
+
+
+/**
+ * The diffuser stage of a sector, before its CBC encryption: the sector key,
+ * diffuser A, then diffuser B
+ *
+ * @param sector The sector to diffuse
+ * @param sector_size The size of the sector (in bytes)
+ * @param sector_key The sector's 32 bytes key
+ * @param buffer The place where we have to put diffused data, may be the
+ * sector
+ */
+void diffuser_encrypt_sector(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer)
+{
+	encrypt_sector(sector, sector_size, sector_key, buffer);
+}
+
+
+/*
+ * The two functions above, instantiated for sectors of a given size: the
+ * bounds of the loops and the wrapped around indices are then constants. Their
+ * sector_size parameter is ignored, it's only there for them to be used in
+ * place of the generic ones.
+ */
+#define DIFFUSER_SIZED(size) \
+	void diffuser_decrypt_sector_##size( \
+		uint8_t* sector, \
+		uint16_t sector_size, \
+		const uint8_t* sector_key) \
+	{ \
+		(void) sector_size; \
+		decrypt_sector(sector, size, sector_key); \
+	} \
+	\
+	void diffuser_encrypt_sector_##size( \
+		const uint8_t* sector, \
+		uint16_t sector_size, \
+		const uint8_t* sector_key, \
+		uint8_t* buffer) \
+	{ \
+		(void) sector_size; \
+		encrypt_sector(sector, size, sector_key, buffer); \
+	}
+
+DIFFUSER_SIZED(512)
+DIFFUSER_SIZED(4096)
+
+#undef DIFFUSER_SIZED
+
+
+
+/**
+ * Implement diffuser A's decryption algorithm as explained by Niels Ferguson,
+ * one element at a time. This is the reference the other implementations
+ * should give the same results as.
  * @warning sector and buffer should not overlap
  *
  * @param sector The sector to de-diffuse
  * @param sector_size The size of the sector (in bytes)
  * @param buffer The resulted de-diffused data
  */
-void diffuserA_decrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
+void diffuserA_decrypt_reference(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
 {
 	int i = 0;
 	int Acycles = 5;
@@ -69,14 +372,16 @@ void diffuserA_decrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
 
 
 /**
- * Implement diffuser B's decryption algorithm as explained by Niels Ferguson
+ * Implement diffuser B's decryption algorithm as explained by Niels Ferguson,
+ * one element at a time. This is the reference the other implementations
+ * should give the same results as.
  * @warning sector and buffer should not overlap
  *
  * @param sector The sector to de-diffuse
  * @param sector_size The size of the sector (in bytes)
  * @param buffer The resulted de-diffused data
  */
-void diffuserB_decrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
+void diffuserB_decrypt_reference(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
 {
 	int i = 0;
 	int Bcycles = 3;
@@ -108,14 +413,16 @@ void diffuserB_decrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
 
 
 /**
- * Implement diffuser A's encryption algorithm as explained by Niels Ferguson
+ * Implement diffuser A's encryption algorithm as explained by Niels Ferguson,
+ * one element at a time. This is the reference the other implementations
+ * should give the same results as.
  * @warning sector and buffer should not overlap
  *
  * @param sector The sector to diffuse
  * @param sector_size The size of the sector (in bytes)
  * @param buffer The resulted diffused data
  */
-void diffuserA_encrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
+void diffuserA_encrypt_reference(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
 {
 	int i = 0;
 	int Acycles = 5;
@@ -144,14 +451,16 @@ void diffuserA_encrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
 
 
 /**
- * Implement diffuser B's encryption algorithm as explained by Niels Ferguson
+ * Implement diffuser B's encryption algorithm as explained by Niels Ferguson,
+ * one element at a time. This is the reference the other implementations
+ * should give the same results as.
  * @warning sector and buffer should not overlap
  *
  * @param sector The sector to diffuse
  * @param sector_size The size of the sector (in bytes)
  * @param buffer The resulted diffused data
  */
-void diffuserB_encrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
+void diffuserB_encrypt_reference(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
 {
 	int i = 0;
 	int Bcycles = 3;
@@ -179,3 +488,434 @@ void diffuserB_encrypt(uint8_t* sector, uint16_t sector_size, uint32_t* buffer)
 }
 
 
+
+
+/**
+ * Diffuser A's decryption, on a sector the kernels fit
+ *
+ * @param d The sector to de-diffuse, as 4 bytes elements
+ * @param int_size The number of elements, see KERNELS_FIT()
+ */
+DIFFUSER_TEMPLATE void a_decrypt(uint32_t* d, int int_size)
+{
+	int i = 0;
+	int Acycles = A_CYCLES;
+
+#define A_WRAPPED(j) d[j] += a_term(d, int_size, j);
+
+	while(Acycles)
+	{
+		FOR_EACH_WRAPPED(A_WRAPPED)
+
+		for(i = 8; i < int_size; i += 4)
+		{
+			d[i]   += d[i-2] ^ ROTATE_LEFT(d[i-5], 9);
+			d[i+1] += d[i-1] ^ d[i-4];
+			d[i+2] += d[i]   ^ ROTATE_LEFT(d[i-3], 13);
+			d[i+3] += d[i+1] ^ d[i-2];
+		}
+
+		Acycles--;
+	}
+
+#undef A_WRAPPED
+}
+
+
+/**
+ * Diffuser B's decryption, on a sector the kernels fit
+ *
+ * @param d The sector to de-diffuse, as 4 bytes elements
+ * @param int_size The number of elements, see KERNELS_FIT()
+ */
+DIFFUSER_TEMPLATE void b_decrypt(uint32_t* d, int int_size)
+{
+	int i = 0;
+	int Bcycles = B_CYCLES;
+
+#define B_WRAPPED(j) d[int_size-8+j] += b_term(d, int_size, int_size-8+j);
+
+	while(Bcycles)
+	{
+		for(i = 0; i < int_size - 8; i += 4)
+		{
+			d[i]   += d[i+2] ^ d[i+5];
+			d[i+1] += d[i+3] ^ ROTATE_LEFT(d[i+6], 10);
+			d[i+2] += d[i+4] ^ d[i+7];
+			d[i+3] += d[i+5] ^ ROTATE_LEFT(d[i+8], 25);
+		}
+
+		FOR_EACH_WRAPPED(B_WRAPPED)
+
+		Bcycles--;
+	}
+
+#undef B_WRAPPED
+}
+
+
+/**
+ * Diffuser A's encryption, on a sector the kernels fit
+ *
+ * @param d The sector to diffuse, as 4 bytes elements
+ * @param int_size The number of elements, see KERNELS_FIT()
+ */
+DIFFUSER_TEMPLATE void a_encrypt(uint32_t* d, int int_size)
+{
+	int i = 0;
+	int Acycles = A_CYCLES;
+
+#define A_WRAPPED(j) d[j] -= a_term(d, int_size, j);
+
+	while(Acycles)
+	{
+		for(i = int_size - 4; i >= 8; i -= 4)
+		{
+			d[i+3] -= d[i+1] ^ d[i-2];
+			d[i+2] -= d[i]   ^ ROTATE_LEFT(d[i-3], 13);
+			d[i+1] -= d[i-1] ^ d[i-4];
+			d[i]   -= d[i-2] ^ ROTATE_LEFT(d[i-5], 9);
+		}
+
+		FOR_EACH_WRAPPED_REVERSE(A_WRAPPED)
+
+		Acycles--;
+	}
+
+#undef A_WRAPPED
+}
+
+
+/**
+ * Diffuser B's encryption, on a sector the kernels fit
+ *
+ * @param d The sector to diffuse, as 4 bytes elements
+ * @param int_size The number of elements, see KERNELS_FIT()
+ */
+DIFFUSER_TEMPLATE void b_encrypt(uint32_t* d, int int_size)
+{
+	int i = 0;
+	int Bcycles = B_CYCLES;
+
+#define B_WRAPPED(j) d[int_size-8+j] -= b_term(d, int_size, int_size-8+j);
+
+	while(Bcycles)
+	{
+		FOR_EACH_WRAPPED_REVERSE(B_WRAPPED)
+
+		for(i = int_size - 12; i >= 0; i -= 4)
+		{
+			d[i+3] -= d[i+5] ^ ROTATE_LEFT(d[i+8], 25);
+			d[i+2] -= d[i+4] ^ d[i+7];
+			d[i+1] -= d[i+3] ^ ROTATE_LEFT(d[i+6], 10);
+			d[i]   -= d[i+2] ^ d[i+5];
+		}
+
+		Bcycles--;
+	}
+
+#undef B_WRAPPED
+}
+
+
+/**
+ * XOR a sector with the 32 bytes sector key, 32 bytes at a time
+ *
+ * @param sector The sector to XOR
+ * @param sector_size The size of the sector (in bytes), a multiple of 32
+ * @param sector_key The 32 bytes sector key
+ * @param buffer The result, may be the sector
+ */
+DIFFUSER_TEMPLATE void xor_sector_key(
+	const uint8_t* sector,
+	uint16_t sector_size,
+	const uint8_t* sector_key,
+	uint8_t* buffer)
+{
+	uint64_t key[4];
+	uint64_t block[4];
+	int loop = 0;
+	int word = 0;
+
+	memcpy(key, sector_key, sizeof(key));
+
+	for(loop = 0; loop < sector_size; loop += 32)
+	{
+		memcpy(block, sector + loop, sizeof(block));
+		for(word = 0; word < 4; word++)
+			block[word] ^= key[word];
+		memcpy(buffer + loop, block, sizeof(block));
+	}
+
+	memset(key, 0, sizeof(key));
+}
+
+
+/**
+ * Undo the diffuser stage of a sector, as diffuser_decrypt_sector()
+ *
+ * @param sector The sector to de-diffuse, in place
+ * @param sector_size The size of the sector (in bytes)
+ * @param sector_key The sector's 32 bytes key
+ */
+DIFFUSER_TEMPLATE void decrypt_sector(
+	uint8_t* sector,
+	uint16_t sector_size,
+	const uint8_t* sector_key)
+{
+	uint32_t* d = (uint32_t*) sector;
+	int int_size = sector_size / 4;
+
+	if(!KERNELS_FIT(int_size))
+	{
+		diffuserB_decrypt(sector, sector_size, d);
+		diffuserA_decrypt(sector, sector_size, d);
+		diffuser_apply_sector_key(sector, sector_size, sector_key, sector);
+		return;
+	}
+
+#ifdef _HAVE_AESNI
+	if(use_avx2())
+	{
+		diffuserB_decrypt_avx2(d, int_size);
+		a_decrypt(d, int_size);
+		apply_sector_key_avx2(sector, sector_size, sector_key, sector);
+		return;
+	}
+#endif /* _HAVE_AESNI */
+
+	b_decrypt(d, int_size);
+	a_decrypt(d, int_size);
+	xor_sector_key(sector, sector_size, sector_key, sector);
+}
+
+
+/**
+ * The diffuser stage of a sector, as diffuser_encrypt_sector()
+ *
+ * @param sector The sector to diffuse
+ * @param sector_size The size of the sector (in bytes)
+ * @param sector_key The sector's 32 bytes key
+ * @param buffer The place where we have to put diffused data, may be the
+ * sector
+ */
+DIFFUSER_TEMPLATE void encrypt_sector(
+	const uint8_t* sector,
+	uint16_t sector_size,
+	const uint8_t* sector_key,
+	uint8_t* buffer)
+{
+	uint32_t* d = (uint32_t*) buffer;
+	int int_size = sector_size / 4;
+
+	if(!KERNELS_FIT(int_size))
+	{
+		diffuser_apply_sector_key(sector, sector_size, sector_key, buffer);
+		diffuserA_encrypt(buffer, sector_size, d);
+		diffuserB_encrypt(buffer, sector_size, d);
+		return;
+	}
+
+#ifdef _HAVE_AESNI
+	if(use_avx2())
+	{
+		apply_sector_key_avx2(sector, sector_size, sector_key, buffer);
+		diffuserA_encrypt_avx2(d, int_size);
+		b_encrypt(d, int_size);
+		return;
+	}
+#endif /* _HAVE_AESNI */
+
+	xor_sector_key(sector, sector_size, sector_key, buffer);
+	a_encrypt(d, int_size);
+	b_encrypt(d, int_size);
+}
+
+
+/**
+ * Rotate a value, by any number of bits
+ *
+ * @param value The value to rotate
+ * @param bits By how many bits to rotate it, below 32
+ * @return The rotated value
+ */
+DIFFUSER_TEMPLATE uint32_t rotate_left(uint32_t value, unsigned int bits)
+{
+	if(bits == 0)
+		return value;
+
+	return ROTATE_LEFT(value, bits);
+}
+
+
+/**
+ * Diffuser A's term for d[i], wrapping the indices around the sector
+ *
+ * @param d The sector, as 4 bytes elements
+ * @param int_size The number of elements
+ * @param i The element's index
+ * @return d[i-2] xor ROTATE_LEFT(d[i-5], Ra[i mod 4])
+ */
+DIFFUSER_TEMPLATE uint32_t a_term(const uint32_t* d, int int_size, int i)
+{
+	int i2 = i >= 2 ? i - 2 : i - 2 + int_size;
+	int i5 = i >= 5 ? i - 5 : i - 5 + int_size;
+
+	return d[i2] ^ rotate_left(d[i5], Ra[i % 4]);
+}
+
+
+/**
+ * Diffuser B's term for d[i], wrapping the indices around the sector
+ *
+ * @param d The sector, as 4 bytes elements
+ * @param int_size The number of elements
+ * @param i The element's index
+ * @return d[i+2] xor ROTATE_LEFT(d[i+5], Rb[i mod 4])
+ */
+DIFFUSER_TEMPLATE uint32_t b_term(const uint32_t* d, int int_size, int i)
+{
+	int i2 = i + 2 < int_size ? i + 2 : i + 2 - int_size;
+	int i5 = i + 5 < int_size ? i + 5 : i + 5 - int_size;
+
+	return d[i2] ^ rotate_left(d[i5], Rb[i % 4]);
+}
+
+
+#ifdef _HAVE_AESNI
+
+/**
+ * Whether the AVX2 kernels can be used, found out on the first call;
+ * concurrent callers would only store the same value
+ *
+ * @return TRUE if they can, FALSE otherwise
+ */
+static int use_avx2(void)
+{
+	static volatile int avx2 = -1;
+
+	if(avx2 < 0)
+		avx2 = (dis_aesni_features() & DIS_AESNI_AVX2) ? 1 : 0;
+
+	return avx2;
+}
+
+
+/**
+ * Rotate 8 values, each by its own number of bits
+ *
+ * @param values The values to rotate
+ * @param bits By how many bits to rotate each of them, below 32
+ * @return The rotated values
+ */
+AVX2_TARGET
+static __m256i rotate_left_256(__m256i values, __m256i bits)
+{
+	/* Shifting by 32 bits gives 0, so no rotation is fine */
+	return _mm256_or_si256(
+		_mm256_sllv_epi32(values, bits),
+		_mm256_srlv_epi32(values, _mm256_sub_epi32(_mm256_set1_epi32(32), bits))
+	);
+}
+
+
+/**
+ * Diffuser A's encryption on 8 elements at a time, as diffuserA_encrypt()
+ *
+ * @param d The sector to diffuse, as 4 bytes elements
+ * @param int_size The number of elements, see KERNELS_FIT()
+ */
+AVX2_TARGET
+static void diffuserA_encrypt_avx2(uint32_t* d, int int_size)
+{
+	const __m256i bits = _mm256_setr_epi32(9, 0, 13, 0, 9, 0, 13, 0);
+	__m256i term;
+	int i = 0;
+	int Acycles = A_CYCLES;
+
+	while(Acycles)
+	{
+		/* d[i-2] and d[i-5] are loaded before d[i] is stored */
+		for(i = int_size - 8; i >= 8; i -= 8)
+		{
+			term = _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i*) (d + i - 2)),
+				rotate_left_256(_mm256_loadu_si256((const __m256i*) (d + i - 5)), bits)
+			);
+			_mm256_storeu_si256(
+				(__m256i*) (d + i),
+				_mm256_sub_epi32(_mm256_loadu_si256((const __m256i*) (d + i)), term)
+			);
+		}
+
+		for(i = 7; i >= 0; --i)
+			d[i] -= a_term(d, int_size, i);
+
+		Acycles--;
+	}
+}
+
+
+/**
+ * Diffuser B's decryption on 8 elements at a time, as diffuserB_decrypt()
+ *
+ * @param d The sector to de-diffuse, as 4 bytes elements
+ * @param int_size The number of elements, see KERNELS_FIT()
+ */
+AVX2_TARGET
+static void diffuserB_decrypt_avx2(uint32_t* d, int int_size)
+{
+	const __m256i bits = _mm256_setr_epi32(0, 10, 0, 25, 0, 10, 0, 25);
+	__m256i term;
+	int i = 0;
+	int Bcycles = B_CYCLES;
+
+	while(Bcycles)
+	{
+		/* d[i+2] and d[i+5] are loaded before d[i] is stored */
+		for(i = 0; i + 16 <= int_size; i += 8)
+		{
+			term = _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i*) (d + i + 2)),
+				rotate_left_256(_mm256_loadu_si256((const __m256i*) (d + i + 5)), bits)
+			);
+			_mm256_storeu_si256(
+				(__m256i*) (d + i),
+				_mm256_add_epi32(_mm256_loadu_si256((const __m256i*) (d + i)), term)
+			);
+		}
+
+		for(i = int_size - 8; i < int_size; ++i)
+			d[i] += b_term(d, int_size, i);
+
+		Bcycles--;
+	}
+}
+
+/**
+ * XOR a sector with its sector key, as diffuser_apply_sector_key(), the key
+ * being kept in one register
+ *
+ * @param sector The sector to XOR
+ * @param sector_size The size of the sector (in bytes), a multiple of 32
+ * @param sector_key The 32 bytes sector key
+ * @param buffer The result, may be the sector
+ */
+AVX2_TARGET
+static void apply_sector_key_avx2(
+	const uint8_t* sector,
+	uint16_t sector_size,
+	const uint8_t* sector_key,
+	uint8_t* buffer)
+{
+	const __m256i key = _mm256_loadu_si256((const __m256i*) sector_key);
+	int loop = 0;
+
+	for(loop = 0; loop < sector_size; loop += 32)
+		_mm256_storeu_si256(
+			(__m256i*) (buffer + loop),
+			_mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (sector + loop)), key)
+		);
+}
+
+#endif /* _HAVE_AESNI */
@@ -32,6 +32,28 @@
 #include <string.h>
 
 
+/*
+ * Use the version of an enc/decryption function specialized for the sector
+ * size if there's one, the generic one otherwise
+ */
+#define SET_SIZED_FN(crypt, fn, name) \
+	do { \
+		if((crypt)->sector_size == 512) \
+			(crypt)->fn = name##_512; \
+		else if((crypt)->sector_size == 4096) \
+			(crypt)->fn = name##_4096; \
+		else \
+			(crypt)->fn = name; \
+	} while(0)
+
+/* Set the AES-NI round keys along with the other ones, if they're used */
+#define AESNI_SET_KEY(ctx, key_ni, key, size) \
+	do { \
+		if((ctx)->aesni) \
+			dis_aesni_set_key(&(ctx)->key_ni, key, size); \
+	} while(0)
+
+
 /**
  * Create "an object" of type dis_crypt_t
  *
@@ -49,23 +71,107 @@ dis_crypt_t dis_crypt_new(uint16_t sector_size, cipher_t disk_cipher)
 	if(disk_cipher == AES_128_DIFFUSER || disk_cipher == AES_256_DIFFUSER)
 	{
 		crypt->flags |= DIS_ENC_FLAG_USE_DIFFUSER;
-		crypt->encrypt_fn = encrypt_cbc_with_diffuser;
-		crypt->decrypt_fn = decrypt_cbc_with_diffuser;
+		SET_SIZED_FN(crypt, encrypt_fn, encrypt_cbc_with_diffuser);
+		SET_SIZED_FN(crypt, decrypt_fn, decrypt_cbc_with_diffuser);
+		crypt->ctx.aesni  = dis_aesni_features() & DIS_AESNI_AES;
+
+		/* Sectors go through all the stages one after the other, by batches */
+		SET_SIZED_FN(crypt, decrypt_sectors_fn, decrypt_cbc_sectors_with_diffuser);
+		SET_SIZED_FN(crypt, encrypt_sectors_fn, encrypt_cbc_sectors_with_diffuser);
 	}
 	else if(disk_cipher == AES_XTS_128 || disk_cipher == AES_XTS_256)
 	{
-		crypt->encrypt_fn = encrypt_xts;
-		crypt->decrypt_fn = decrypt_xts;
+		SET_SIZED_FN(crypt, encrypt_fn, encrypt_xts);
+		SET_SIZED_FN(crypt, decrypt_fn, decrypt_xts);
+
+		/*
+		 * XTS sectors are enc/decrypted with AES-NI if the CPU has it, and
+		 * with VAES on wider registers for large buffers if it has that too
+		 */
+		crypt->ctx.aesni  = dis_aesni_features();
+		crypt->ctx.xts_ni = dis_aesni_xts_select(crypt->ctx.aesni);
+		SET_SIZED_FN(crypt, decrypt_sectors_fn, decrypt_xts_sectors);
+		SET_SIZED_FN(crypt, encrypt_sectors_fn, encrypt_xts_sectors);
+		if(!crypt->ctx.xts_ni)
+			crypt->ctx.aesni = 0;
+		else if(crypt->ctx.aesni & DIS_AESNI_VAES_AVX512)
+			dis_printf(L_DEBUG, "Using AES-NI and VAES (AVX-512) for XTS\n");
+		else if(crypt->ctx.aesni & DIS_AESNI_VAES_AVX2)
+			dis_printf(L_DEBUG, "Using AES-NI and VAES (AVX2) for XTS\n");
+		else
+			dis_printf(L_DEBUG, "Using AES-NI for XTS\n");
 	}
 	else
 	{
 		crypt->encrypt_fn = encrypt_cbc_without_diffuser;
 		crypt->decrypt_fn = decrypt_cbc_without_diffuser;
+		crypt->ctx.aesni  = dis_aesni_features() & DIS_AESNI_AES;
+		crypt->decrypt_sectors_fn = decrypt_cbc_sectors_without_diffuser;
+		crypt->encrypt_sectors_fn = encrypt_cbc_sectors_without_diffuser;
 	}
 
+	/*
+	 * CBC sectors are decrypted with AES-NI if the CPU has it, and encrypted
+	 * several at once
+	 */
+	if(crypt->ctx.aesni && !crypt->ctx.xts_ni)
+		dis_printf(L_DEBUG, "Using AES-NI for CBC\n");
+
 	return crypt;
 }
 
+/**
+ * Choose the implementation sectors are enc/decrypted with, before the keys
+ * are set. The builtin one is used by default, whenever the chosen one can't
+ * deal with the keys, and for the sectors the kernel leaves to userspace.
+ *
+ * @param crypt The crypt structure
+ * @param backend The implementation to use
+ * @return DIS_RET_SUCCESS if it can be used, an error otherwise
+ */
+int dis_crypt_set_backend(dis_crypt_t crypt, dis_crypt_backend_t backend)
+{
+	if(!crypt)
+		return DIS_RET_ERROR_DISLOCKER_INVAL;
+
+	dis_evp_destroy(crypt->ctx.evp);
+	dis_afalg_destroy(crypt->ctx.afalg);
+	crypt->ctx.evp   = NULL;
+	crypt->ctx.afalg = NULL;
+
+	switch(backend)
+	{
+		case DIS_CRYPT_BACKEND_BUILTIN:
+			return DIS_RET_SUCCESS;
+
+		case DIS_CRYPT_BACKEND_OPENSSL:
+			crypt->ctx.evp = dis_evp_new();
+			if(crypt->ctx.evp)
+			{
+				dis_printf(L_DEBUG, "Using OpenSSL for the sectors\n");
+				return DIS_RET_SUCCESS;
+			}
+			dis_printf(L_WARNING, "Not built with OpenSSL, using the builtin implementation\n");
+			break;
+
+		case DIS_CRYPT_BACKEND_KERNEL:
+			crypt->ctx.afalg = dis_afalg_new();
+			if(crypt->ctx.afalg)
+			{
+				dis_printf(L_DEBUG, "Using the kernel for large batches of sectors\n");
+				return DIS_RET_SUCCESS;
+			}
+			dis_printf(L_WARNING, "Not built with AF_ALG, using the builtin implementation\n");
+			break;
+
+		default:
+			dis_printf(L_WARNING, "Unknown crypto backend: %d\n", backend);
+			break;
+	}
+
+	return DIS_RET_ERROR_CRYPTO_ALGORITHM_UNSUPPORTED;
+}
+
 int dis_crypt_set_fvekey(dis_crypt_t crypt, uint16_t algorithm, uint8_t* fvekey)
 {
 	if(!crypt || !fvekey)
@@ -74,47 +180,190 @@ int dis_crypt_set_fvekey(dis_crypt_t crypt, uint16_t algorithm, uint8_t* fvekey)
 	switch(algorithm)
 	{
 		case AES_128_DIFFUSER:
+			AESNI_SET_KEY(&crypt->ctx, TWEAK_ni, fvekey + 0x20, 128);
 			AES_SETENC_KEY(&crypt->ctx.TWEAK_E_ctx, fvekey + 0x20, 128);
 			AES_SETDEC_KEY(&crypt->ctx.TWEAK_D_ctx, fvekey + 0x20, 128);
 			/* no break on purpose */
 		case AES_128_NO_DIFFUSER:
 			AES_SETENC_KEY(&crypt->ctx.FVEK_E_ctx, fvekey, 128);
 			AES_SETDEC_KEY(&crypt->ctx.FVEK_D_ctx, fvekey, 128);
-			return DIS_RET_SUCCESS;
+			AESNI_SET_KEY(&crypt->ctx, FVEK_ni, fvekey, 128);
+			break;
 
 		case AES_256_DIFFUSER:
+			AESNI_SET_KEY(&crypt->ctx, TWEAK_ni, fvekey + 0x20, 256);
 			AES_SETENC_KEY(&crypt->ctx.TWEAK_E_ctx, fvekey + 0x20, 256);
 			AES_SETDEC_KEY(&crypt->ctx.TWEAK_D_ctx, fvekey + 0x20, 256);
 			/* no break on purpose */
 		case AES_256_NO_DIFFUSER:
 			AES_SETENC_KEY(&crypt->ctx.FVEK_E_ctx, fvekey, 256);
 			AES_SETDEC_KEY(&crypt->ctx.FVEK_D_ctx, fvekey, 256);
-			return DIS_RET_SUCCESS;
+			AESNI_SET_KEY(&crypt->ctx, FVEK_ni, fvekey, 256);
+			break;
 
 		case AES_XTS_128:
 			AES_SETENC_KEY(&crypt->ctx.FVEK_E_ctx, fvekey, 128);
 			AES_SETDEC_KEY(&crypt->ctx.FVEK_D_ctx, fvekey, 128);
 			AES_SETENC_KEY(&crypt->ctx.TWEAK_E_ctx, fvekey + 0x10, 128);
 			AES_SETDEC_KEY(&crypt->ctx.TWEAK_D_ctx, fvekey + 0x10, 128);
-			return DIS_RET_SUCCESS;
+			AESNI_SET_KEY(&crypt->ctx, FVEK_ni, fvekey, 128);
+			AESNI_SET_KEY(&crypt->ctx, TWEAK_ni, fvekey + 0x10, 128);
+			break;
 
 		case AES_XTS_256:
 			AES_SETENC_KEY(&crypt->ctx.FVEK_E_ctx, fvekey, 256);
 			AES_SETDEC_KEY(&crypt->ctx.FVEK_D_ctx, fvekey, 256);
 			AES_SETENC_KEY(&crypt->ctx.TWEAK_E_ctx, fvekey + 0x20, 256);
 			AES_SETDEC_KEY(&crypt->ctx.TWEAK_D_ctx, fvekey + 0x20, 256);
-			return DIS_RET_SUCCESS;
+			AESNI_SET_KEY(&crypt->ctx, FVEK_ni, fvekey, 256);
+			AESNI_SET_KEY(&crypt->ctx, TWEAK_ni, fvekey + 0x20, 256);
+			break;
 
 		default:
 			dis_printf(L_WARNING, "Algo not supported: %#hx\n", algorithm);
-			break;
+			return DIS_RET_ERROR_CRYPTO_ALGORITHM_UNSUPPORTED;
 	}
 
-	return DIS_RET_ERROR_CRYPTO_ALGORITHM_UNSUPPORTED;
+	/* The builtin contexts above are kept, should the backend refuse the keys */
+	if(crypt->ctx.evp && dis_evp_set_key(crypt->ctx.evp, algorithm, fvekey) != 0)
+	{
+		dis_printf(L_WARNING, "OpenSSL can't use these keys, using the builtin implementation\n");
+		dis_evp_destroy(crypt->ctx.evp);
+		crypt->ctx.evp = NULL;
+	}
+
+	if(crypt->ctx.afalg && dis_afalg_set_key(crypt->ctx.afalg, algorithm, fvekey) != 0)
+	{
+		dis_printf(L_WARNING, "The kernel can't use these keys, using the builtin implementation\n");
+		dis_afalg_destroy(crypt->ctx.afalg);
+		crypt->ctx.afalg = NULL;
+	}
+
+	return DIS_RET_SUCCESS;
+}
+
+/**
+ * Give the size of the batches of sectors the implementation in use is at its
+ * best with, when given to dis_crypt_{de,en}crypt_sectors(). Smaller ones are
+ * fine, just slower.
+ *
+ * @param crypt The crypt structure, with its keys set
+ * @return The size, in bytes
+ */
+size_t dis_crypt_batch_size(dis_crypt_t crypt)
+{
+	if(!crypt)
+		return 0;
+
+	/* The kernel only takes large batches */
+	if(crypt->ctx.afalg)
+		return DIS_AFALG_MIN_SIZE;
+
+	/* VAES kernels are only used on batches this large */
+	if(crypt->ctx.xts_ni &&
+	   (crypt->ctx.aesni & (DIS_AESNI_VAES_AVX2 | DIS_AESNI_VAES_AVX512)))
+		return DIS_AESNI_WIDE_MIN_SIZE;
+
+	return crypt->sector_size;
 }
 
 void dis_crypt_destroy(dis_crypt_t crypt)
 {
 	if(crypt)
+	{
+		/* The AES-NI round keys are plain copies of the keys, clean them */
+		memset(&crypt->ctx.FVEK_ni, 0, sizeof(dis_aesni_key_t));
+		memset(&crypt->ctx.TWEAK_ni, 0, sizeof(dis_aesni_key_t));
+		dis_evp_destroy(crypt->ctx.evp);
+		dis_afalg_destroy(crypt->ctx.afalg);
 		dis_free(crypt);
+	}
+}
+
+
+/**
+ * Compute the sector keys of contiguous sectors, used with the diffuser: each
+ * is the encryption of the sector's address and of the same with its last
+ * byte set to 0x80. With AES-NI, all of the blocks are encrypted at once.
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors
+ * @param sector_address Address of the first sector
+ * @param sector_keys Where to put the nb_sectors 32 bytes sector keys
+ */
+void dis_crypt_sector_keys(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	off_t sector_address,
+	uint8_t (*sector_keys)[32])
+{
+	off_t  address = 0;
+	size_t loop    = 0;
+
+	/* Create the ivs, in place */
+	for(loop = 0; loop < nb_sectors; loop++)
+	{
+		address = sector_address + sector_size * (off_t) loop;
+		memset(sector_keys[loop], 0, 32);
+		memcpy(sector_keys[loop], &address, sizeof(off_t));
+		memcpy(&sector_keys[loop][16], &address, sizeof(off_t));
+		/* For iv unicity reason... */
+		sector_keys[loop][31] = 0x80;
+	}
+
+	if(ctx->aesni && dis_aesni_ecb_encrypt(
+		&ctx->TWEAK_ni,
+		2 * nb_sectors,
+		sector_keys[0],
+		sector_keys[0]) == 0)
+		return;
+
+	for(loop = 0; loop < nb_sectors; loop++)
+	{
+		AES_ECB_ENC(&ctx->TWEAK_E_ctx, AES_ENCRYPT, sector_keys[loop], sector_keys[loop]);
+		AES_ECB_ENC(&ctx->TWEAK_E_ctx, AES_ENCRYPT, &sector_keys[loop][16], &sector_keys[loop][16]);
+	}
+}
+
+
+/**
+ * Compute the CBC ivs of contiguous sectors, used without the diffuser as
+ * much as with it: each is the encryption of the sector's address. With
+ * AES-NI, all of the blocks are encrypted at once.
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors
+ * @param sector_address Address of the first sector
+ * @param ivs Where to put the nb_sectors ivs
+ */
+void dis_crypt_cbc_ivs(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	off_t sector_address,
+	uint8_t (*ivs)[16])
+{
+	off_t  address = 0;
+	size_t loop    = 0;
+
+	/* Create the ivs, in place */
+	for(loop = 0; loop < nb_sectors; loop++)
+	{
+		address = sector_address + sector_size * (off_t) loop;
+		memset(ivs[loop], 0, 16);
+		memcpy(ivs[loop], &address, sizeof(off_t));
+	}
+
+	if(ctx->aesni && dis_aesni_ecb_encrypt(
+		&ctx->FVEK_ni,
+		nb_sectors,
+		ivs[0],
+		ivs[0]) == 0)
+		return;
+
+	for(loop = 0; loop < nb_sectors; loop++)
+		AES_ECB_ENC(&ctx->FVEK_E_ctx, AES_ENCRYPT, ivs[loop], ivs[loop]);
 }
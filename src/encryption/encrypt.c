@@ -29,6 +29,42 @@
 
 
 
+/** Prototype of functions used internally */
+DIS_CRYPT_TEMPLATE void encrypt_cbc_sectors_with_diffuser_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer,
+	void (*diffuser)(const uint8_t*, uint16_t, const uint8_t*, uint8_t*)
+);
+DIS_CRYPT_TEMPLATE void encrypt_xts_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	uint8_t* sector,
+	off_t sector_address,
+	uint8_t* buffer
+);
+DIS_CRYPT_TEMPLATE void encrypt_xts_sectors_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+static void encrypt_cbc_chains(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer
+);
+
+
+
 /**
  * Interface to encrypt a sector
  *
@@ -56,6 +92,52 @@ int encrypt_sector(dis_crypt_t crypt, uint8_t* sector, off_t sector_address, uin
 }
 
 
+/**
+ * Interface to encrypt contiguous sectors, all at once with the encryption's
+ * own batch function, one after the other if it hasn't any
+ *
+ * @param crypt Data needed by the encryption to deal with encrypted data
+ * @param nb_sectors The number of sectors to encrypt
+ * @param sector_address The address of the first sector to encrypt
+ * @param input The sectors to encrypt
+ * @param output The place where we have to put encrypted data, may be the
+ * input
+ * @return TRUE if result can be trusted, FALSE otherwise
+ */
+int dis_crypt_encrypt_sectors(dis_crypt_t crypt, size_t nb_sectors, off_t sector_address, uint8_t* input, uint8_t* output)
+{
+	size_t loop = 0;
+
+	// Check parameters
+	if(!crypt || !input || !output)
+		return FALSE;
+
+	if(crypt->encrypt_sectors_fn)
+	{
+		crypt->encrypt_sectors_fn(
+			&crypt->ctx,
+			crypt->sector_size,
+			nb_sectors,
+			input,
+			sector_address,
+			output
+		);
+		return TRUE;
+	}
+
+	for(loop = 0; loop < nb_sectors; loop++)
+		crypt->encrypt_fn(
+			&crypt->ctx,
+			crypt->sector_size,
+			input + crypt->sector_size * loop,
+			sector_address + crypt->sector_size * (off_t) loop,
+			output + crypt->sector_size * loop
+		);
+
+	return TRUE;
+}
+
+
 /**
  * Encrypt a sector whithout the diffuser
  *
@@ -73,6 +155,16 @@ void encrypt_cbc_without_diffuser(dis_aes_contexts_t* ctx, uint16_t sector_size,
 		unsigned char multi[16];
 		off_t single;
 	} iv;
+	if(ctx->evp && dis_evp_cbc_sectors(
+		ctx->evp,
+		TRUE,
+		sector_size,
+		1,
+		(uint64_t) sector_address,
+		sector,
+		buffer) == 1)
+		return;
+
 	memset(iv.multi, 0, 16);
 
 	/* Create the iv */
@@ -96,49 +188,363 @@ void encrypt_cbc_without_diffuser(dis_aes_contexts_t* ctx, uint16_t sector_size,
 void encrypt_cbc_with_diffuser(dis_aes_contexts_t* ctx, uint16_t sector_size, uint8_t* sector, off_t sector_address, uint8_t* buffer)
 {
 	/* Parameters are assumed to be correctly checked already */
+	encrypt_cbc_sectors_with_diffuser(ctx, sector_size, 1, sector, sector_address, buffer);
+}
 
-	union {
-		uint8_t multi[16];
-		off_t single;
-	} iv;
-	memset(iv.multi, 0, 16);
-	uint8_t sector_key[32] = {0,};
 
-	int loop = 0;
+/**
+ * Encrypt contiguous sectors without the diffuser, their CBC chains being
+ * interleaved when AES-NI is available
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to encrypt
+ * @param sectors The sectors to encrypt
+ * @param sector_address Address of the first sector to encrypt
+ * @param buffer The place where we have to put encrypted data
+ */
+void encrypt_cbc_sectors_without_diffuser(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	size_t loop = 0;
+	size_t nb   = 0;
+	size_t done = 0;
+
+	/* Large batches may be left to the kernel, the rest is done here */
+	if(ctx->afalg)
+	{
+		done = dis_afalg_cbc_sectors(
+			ctx->afalg,
+			TRUE,
+			sector_size,
+			nb_sectors,
+			(uint64_t) sector_address,
+			sectors,
+			buffer
+		);
+		sectors        += sector_size * done;
+		buffer         += sector_size * done;
+		sector_address += sector_size * (off_t) done;
+		nb_sectors     -= done;
+	}
+
+	/* Then OpenSSL, which may leave the sectors it failed on */
+	if(ctx->evp)
+	{
+		done = dis_evp_cbc_sectors(
+			ctx->evp,
+			TRUE,
+			sector_size,
+			nb_sectors,
+			(uint64_t) sector_address,
+			sectors,
+			buffer
+		);
+		sectors        += sector_size * done;
+		buffer         += sector_size * done;
+		sector_address += sector_size * (off_t) done;
+		nb_sectors     -= done;
+	}
+
+	for(loop = 0; loop < nb_sectors; loop += nb)
+	{
+		nb = nb_sectors - loop;
+		if(nb > DIS_AESNI_CBC_CHAINS)
+			nb = DIS_AESNI_CBC_CHAINS;
+
+		encrypt_cbc_chains(
+			ctx,
+			sector_size,
+			nb,
+			sectors + sector_size * loop,
+			sector_address + sector_size * (off_t) loop,
+			buffer + sector_size * loop
+		);
+	}
+}
 
 
-	/* First, create the sector key */
-	iv.single = sector_address;
+/**
+ * Encrypt contiguous sectors when the diffuser is enabled. The sector keys of
+ * a batch of sectors are computed at once, each sector is diffused while it's
+ * still in the cache, and the batch's CBC chains are interleaved when AES-NI
+ * is available.
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to encrypt
+ * @param sectors The sectors to encrypt
+ * @param sector_address Address of the first sector to encrypt
+ * @param buffer The place where we have to put encrypted data
+ */
+void encrypt_cbc_sectors_with_diffuser(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	encrypt_cbc_sectors_with_diffuser_template(
+		ctx,
+		sector_size,
+		nb_sectors,
+		sectors,
+		sector_address,
+		buffer,
+		diffuser_encrypt_sector
+	);
+}
+
+
+/**
+ * Encrypt a sector when the diffuser is enabled
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param sector The sector to encrypt
+ * @param sector_address Address of the sector to encrypt
+ * @param buffer The place where we have to put encrypted data
+ */
+void encrypt_xts(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	uint8_t* sector,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	encrypt_xts_template(ctx, sector_size, sector, sector_address, buffer);
+}
 
-	AES_ECB_ENC(&ctx->TWEAK_E_ctx, AES_ENCRYPT, iv.multi, sector_key);
-	/* For iv unicity reason... */
-	iv.multi[15] = 0x80;
-	AES_ECB_ENC(&ctx->TWEAK_E_ctx, AES_ENCRYPT, iv.multi, &sector_key[16]);
 
-	memcpy(buffer, sector, sector_size);
+/**
+ * Encrypt contiguous sectors with AES-XTS. With AES-NI, the tweaks of a batch
+ * of sectors are encrypted at once.
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to encrypt
+ * @param sectors The sectors to encrypt
+ * @param sector_address Address of the first sector to encrypt
+ * @param buffer The place where we have to put encrypted data
+ */
+void encrypt_xts_sectors(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	encrypt_xts_sectors_template(
+		ctx,
+		sector_size,
+		nb_sectors,
+		sectors,
+		sector_address,
+		buffer
+	);
+}
 
-	/* Then apply the sector key */
-	for(loop = 0; loop < sector_size; ++loop)
-		buffer[loop] ^= sector_key[loop % 32];
 
+/*
+ * The functions above depending on the sector size, instantiated for sectors
+ * of the given size: the compiler then knows the loops' bounds and turns the
+ * divisions into shifts. Their sector_size parameter is ignored, it's only
+ * there for them to be used in place of the generic ones by dis_crypt_new().
+ */
+#define ENCRYPT_SIZED(size) \
+	void encrypt_cbc_with_diffuser_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		uint8_t* sector, \
+		off_t sector_address, \
+		uint8_t* buffer) \
+	{ \
+		encrypt_cbc_sectors_with_diffuser_##size(ctx, sector_size, 1, sector, sector_address, buffer); \
+	} \
+	\
+	void encrypt_cbc_sectors_with_diffuser_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		size_t nb_sectors, \
+		uint8_t* sectors, \
+		off_t sector_address, \
+		uint8_t* buffer) \
+	{ \
+		(void) sector_size; \
+		encrypt_cbc_sectors_with_diffuser_template( \
+			ctx, size, nb_sectors, sectors, sector_address, buffer, \
+			diffuser_encrypt_sector_##size \
+		); \
+	} \
+	\
+	void encrypt_xts_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		uint8_t* sector, \
+		off_t sector_address, \
+		uint8_t* buffer) \
+	{ \
+		(void) sector_size; \
+		encrypt_xts_template(ctx, size, sector, sector_address, buffer); \
+	} \
+	\
+	void encrypt_xts_sectors_##size( \
+		dis_aes_contexts_t* ctx, \
+		uint16_t sector_size, \
+		size_t nb_sectors, \
+		uint8_t* sectors, \
+		off_t sector_address, \
+		uint8_t* buffer) \
+	{ \
+		(void) sector_size; \
+		encrypt_xts_sectors_template(ctx, size, nb_sectors, sectors, sector_address, buffer); \
+	}
+
+ENCRYPT_SIZED(512)
+ENCRYPT_SIZED(4096)
+
+#undef ENCRYPT_SIZED
 
-	/* Afterward, call diffuser A */
-	diffuserA_encrypt(buffer, sector_size, (uint32_t*)buffer);
 
 
-	/* Call diffuser B */
-	diffuserB_encrypt(buffer, sector_size, (uint32_t*)buffer);
 
+/**
+ * CBC-encrypt up to DIS_AESNI_CBC_CHAINS contiguous sectors, each with its own
+ * IV, all at once with AES-NI or one after the other otherwise
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to encrypt
+ * @param sectors The sectors to encrypt
+ * @param sector_address Address of the first sector to encrypt
+ * @param buffer The place where we have to put encrypted data
+ */
+static void encrypt_cbc_chains(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	uint8_t ivs[DIS_AESNI_CBC_CHAINS][16];
+	size_t  loop    = 0;
+
+	/* Interleaving only pays off with several chains */
+	if(ctx->aesni && nb_sectors > 1)
+	{
+		dis_crypt_cbc_ivs(ctx, sector_size, nb_sectors, sector_address, ivs);
+
+		if(dis_aesni_cbc_encrypt_chains(
+			&ctx->FVEK_ni,
+			nb_sectors,
+			sector_size,
+			(const uint8_t (*)[16]) ivs,
+			sectors,
+			buffer) == 0)
+			return;
+	}
+
+	for(loop = 0; loop < nb_sectors; loop++)
+		encrypt_cbc_without_diffuser(
+			ctx,
+			sector_size,
+			sectors + sector_size * loop,
+			sector_address + sector_size * (off_t) loop,
+			buffer + sector_size * loop
+		);
+}
 
-	/* And finally, actually encrypt the buffer */
-	encrypt_cbc_without_diffuser(ctx, sector_size, buffer, sector_address, buffer);
 
-	memset(sector_key, 0, 32);
+/**
+ * Encrypt contiguous sectors when the diffuser is enabled, as
+ * encrypt_cbc_sectors_with_diffuser()
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to encrypt
+ * @param sectors The sectors to encrypt
+ * @param sector_address Address of the first sector to encrypt
+ * @param buffer The place where we have to put encrypted data
+ * @param diffuser The diffuser stage for this sector size
+ */
+DIS_CRYPT_TEMPLATE void encrypt_cbc_sectors_with_diffuser_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer,
+	void (*diffuser)(const uint8_t*, uint16_t, const uint8_t*, uint8_t*))
+{
+	uint8_t sector_keys[DIS_AESNI_CBC_CHAINS][32];
+	size_t loop = 0;
+	size_t nb   = 0;
+	size_t sector = 0;
+	off_t  address = 0;
+
+	/*
+	 * The kernel only takes large batches: the whole run is encrypted at once
+	 * then, once it's all been through the diffuser
+	 */
+	int whole = ctx->afalg && sector_size * nb_sectors >= DIS_AFALG_MIN_SIZE;
+
+	/* A few sectors at a time, so that they're still cached for the CBC */
+	for(loop = 0; loop < nb_sectors; loop += nb)
+	{
+		nb = nb_sectors - loop;
+		if(nb > DIS_AESNI_CBC_CHAINS)
+			nb = DIS_AESNI_CBC_CHAINS;
+
+		address = sector_address + sector_size * (off_t) loop;
+
+		/* First, create the sector keys */
+		dis_crypt_sector_keys(ctx, sector_size, nb, address, sector_keys);
+
+		/* The sector key, diffuser A, then diffuser B */
+		for(sector = 0; sector < nb; sector++)
+			diffuser(
+				sectors + sector_size * (loop + sector),
+				sector_size,
+				sector_keys[sector],
+				buffer + sector_size * (loop + sector)
+			);
+
+		/* And finally, actually encrypt them */
+		if(!whole)
+			encrypt_cbc_sectors_without_diffuser(
+				ctx,
+				sector_size,
+				nb,
+				buffer + sector_size * loop,
+				address,
+				buffer + sector_size * loop
+			);
+	}
+
+	if(whole)
+		encrypt_cbc_sectors_without_diffuser(
+			ctx,
+			sector_size,
+			nb_sectors,
+			buffer,
+			sector_address,
+			buffer
+		);
+
+	memset(sector_keys, 0, sizeof(sector_keys));
 }
 
 
 /**
- * Encrypt a sector when the diffuser is enabled
+ * Encrypt a sector with AES-XTS, as encrypt_xts()
  *
  * @param ctx AES's contexts
  * @param sector_size Size of a sector (in bytes)
@@ -146,7 +552,7 @@ void encrypt_cbc_with_diffuser(dis_aes_contexts_t* ctx, uint16_t sector_size, ui
  * @param sector_address Address of the sector to encrypt
  * @param buffer The place where we have to put encrypted data
  */
-void encrypt_xts(
+DIS_CRYPT_TEMPLATE void encrypt_xts_template(
 	dis_aes_contexts_t* ctx,
 	uint16_t sector_size,
 	uint8_t* sector,
@@ -163,6 +569,27 @@ void encrypt_xts(
 	memset(iv.multi, 0, 16);
 	iv.single = sector_address / sector_size;
 
+	if(ctx->evp && dis_evp_xts_sectors(
+		ctx->evp,
+		TRUE,
+		sector_size,
+		1,
+		(uint64_t) iv.single,
+		sector,
+		buffer) == 1)
+		return;
+
+	/* The AES-NI kernel is used when the CPU has it */
+	if(ctx->xts_ni && ctx->xts_ni(
+		&ctx->FVEK_ni,
+		&ctx->TWEAK_ni,
+		TRUE,
+		sector_size,
+		iv.multi,
+		sector,
+		buffer) == 0)
+		return;
+
 	AES_XTS(
 		&ctx->FVEK_E_ctx,
 		&ctx->TWEAK_E_ctx,
@@ -175,4 +602,81 @@ void encrypt_xts(
 }
 
 
-
+/**
+ * Encrypt contiguous sectors with AES-XTS, as encrypt_xts_sectors()
+ *
+ * @param ctx AES's contexts
+ * @param sector_size Size of a sector (in bytes)
+ * @param nb_sectors The number of sectors to encrypt
+ * @param sectors The sectors to encrypt
+ * @param sector_address Address of the first sector to encrypt
+ * @param buffer The place where we have to put encrypted data
+ */
+DIS_CRYPT_TEMPLATE void encrypt_xts_sectors_template(
+	dis_aes_contexts_t* ctx,
+	uint16_t sector_size,
+	size_t nb_sectors,
+	uint8_t* sectors,
+	off_t sector_address,
+	uint8_t* buffer)
+{
+	size_t loop = 0;
+	size_t done = 0;
+
+	/* Large batches may be left to the kernel, the rest is done here */
+	if(ctx->afalg)
+	{
+		done = dis_afalg_xts_sectors(
+			ctx->afalg,
+			TRUE,
+			sector_size,
+			nb_sectors,
+			(uint64_t) (sector_address / sector_size),
+			sectors,
+			buffer
+		);
+		sectors        += sector_size * done;
+		buffer         += sector_size * done;
+		sector_address += sector_size * (off_t) done;
+		nb_sectors     -= done;
+	}
+
+	/* Then OpenSSL, which may leave the sectors it failed on */
+	if(ctx->evp)
+	{
+		done = dis_evp_xts_sectors(
+			ctx->evp,
+			TRUE,
+			sector_size,
+			nb_sectors,
+			(uint64_t) (sector_address / sector_size),
+			sectors,
+			buffer
+		);
+		sectors        += sector_size * done;
+		buffer         += sector_size * done;
+		sector_address += sector_size * (off_t) done;
+		nb_sectors     -= done;
+	}
+
+	if(ctx->xts_ni && dis_aesni_xts_sectors(
+		&ctx->FVEK_ni,
+		&ctx->TWEAK_ni,
+		ctx->aesni,
+		TRUE,
+		sector_size,
+		nb_sectors,
+		(uint64_t) (sector_address / sector_size),
+		sectors,
+		buffer) == 0)
+		return;
+
+	for(loop = 0; loop < nb_sectors; loop++)
+		encrypt_xts_template(
+			ctx,
+			sector_size,
+			sectors + sector_size * loop,
+			sector_address + sector_size * (off_t) loop,
+			buffer + sector_size * loop
+		);
+}
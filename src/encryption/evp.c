@@ -0,0 +1,560 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "dislocker/common.h"
+#include "dislocker/encryption/encommon.h"
+#include "dislocker/encryption/evp.h"
+
+
+#ifdef _HAVE_OPENSSL
+
+#include <openssl/evp.h>
+
+
+/* Number of CBC ivs encrypted at once */
+#define EVP_IVS 8
+
+
+/*
+ * EVP contexts keep the iv they're used with, so each thread works on its own
+ * copies of the contexts set up with the keys
+ */
+typedef struct _evp_contexts {
+	EVP_CIPHER_CTX* encrypt;
+	EVP_CIPHER_CTX* decrypt;
+
+	/* The FVEK in ECB mode, for the CBC ivs, NULL with XTS */
+	EVP_CIPHER_CTX* ivs;
+} evp_contexts_t;
+
+
+/* A thread's copies, kept in the keys' list so that they're all freed */
+typedef struct _evp_thread_contexts {
+	evp_contexts_t ctx;
+
+	dis_evp_keys_t* keys;
+	struct _evp_thread_contexts* prev;
+	struct _evp_thread_contexts* next;
+} evp_thread_contexts_t;
+
+
+/*
+ * The contexts are set up once with the keys, the threads copy them the first
+ * time they use them
+ */
+struct _dis_evp_keys {
+	evp_contexts_t ctx;
+
+	pthread_key_t   thread_key;
+	pthread_mutex_t lock;
+	evp_thread_contexts_t* threads;
+};
+
+
+
+/** Prototype of functions used internally */
+static EVP_CIPHER_CTX* new_context(const EVP_CIPHER* cipher, const uint8_t* key, int encrypt);
+static EVP_CIPHER_CTX* copy_context(const EVP_CIPHER_CTX* ctx);
+static void free_contexts(evp_contexts_t* ctx);
+static evp_contexts_t* thread_contexts(dis_evp_keys_t* keys);
+static void thread_contexts_free(void* params);
+static int sectors_fit(size_t sector_size);
+
+
+
+/**
+ * Create the keys' structure, without any key in it
+ *
+ * @return The keys, to be set with dis_evp_set_key()
+ */
+dis_evp_keys_t* dis_evp_new(void)
+{
+	dis_evp_keys_t* keys = dis_malloc(sizeof(dis_evp_keys_t));
+	memset(keys, 0, sizeof(dis_evp_keys_t));
+
+	if(pthread_key_create(&keys->thread_key, thread_contexts_free) != 0)
+	{
+		dis_free(keys);
+		return NULL;
+	}
+	pthread_mutex_init(&keys->lock, NULL);
+
+	return keys;
+}
+
+
+/**
+ * Set the keys up for the given algorithm, replacing the previous ones
+ *
+ * @param keys The keys' structure
+ * @param algorithm The algorithm, one of the cipher_types data ones
+ * @param fvekey The entire FVEK, the XTS tweak key being right after the
+ * data one
+ * @return 0 on success, -1 if OpenSSL can't be used for this algorithm or
+ * these keys
+ */
+int dis_evp_set_key(dis_evp_keys_t* keys, uint16_t algorithm, const uint8_t* fvekey)
+{
+	const EVP_CIPHER* cipher = NULL;
+	const EVP_CIPHER* ecb    = NULL;
+	evp_thread_contexts_t* thread = NULL;
+
+	if(!keys || !fvekey)
+		return -1;
+
+	/* The threads' copies are made again from the new contexts */
+	pthread_mutex_lock(&keys->lock);
+	for(thread = keys->threads; thread; thread = thread->next)
+		free_contexts(&thread->ctx);
+	pthread_mutex_unlock(&keys->lock);
+
+	free_contexts(&keys->ctx);
+
+	switch(algorithm)
+	{
+		case AES_128_DIFFUSER:
+		case AES_128_NO_DIFFUSER:
+			cipher = EVP_aes_128_cbc();
+			ecb    = EVP_aes_128_ecb();
+			break;
+		case AES_256_DIFFUSER:
+		case AES_256_NO_DIFFUSER:
+			cipher = EVP_aes_256_cbc();
+			ecb    = EVP_aes_256_ecb();
+			break;
+		case AES_XTS_128:
+			cipher = EVP_aes_128_xts();
+			break;
+		case AES_XTS_256:
+			cipher = EVP_aes_256_xts();
+			break;
+		default:
+			return -1;
+	}
+
+	/* OpenSSL may refuse XTS keys whose two halves are the same */
+	keys->ctx.encrypt = new_context(cipher, fvekey, 1);
+	keys->ctx.decrypt = new_context(cipher, fvekey, 0);
+	if(ecb)
+		keys->ctx.ivs = new_context(ecb, fvekey, 1);
+
+	if(!keys->ctx.encrypt || !keys->ctx.decrypt || (ecb && !keys->ctx.ivs))
+	{
+		free_contexts(&keys->ctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * AES-XTS encryption/decryption of contiguous sectors, each sector's tweak
+ * being its index. It stops at the first sector OpenSSL fails on, so that the
+ * caller can deal with the remaining ones with another implementation.
+ *
+ * @param keys The keys, set up for XTS
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param sector_size The size of a sector, a multiple of 16
+ * @param nb_sectors The number of sectors
+ * @param first_index The index of the first sector
+ * @param input The sectors to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return The number of sectors done, from the first one
+ */
+size_t dis_evp_xts_sectors(
+	dis_evp_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_index,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	evp_contexts_t* contexts = NULL;
+	EVP_CIPHER_CTX* ctx = NULL;
+	uint8_t  iv[16];
+	uint64_t index = 0;
+	size_t   loop  = 0;
+	int      len   = 0;
+
+	if(!keys || !keys->ctx.encrypt || keys->ctx.ivs || !sectors_fit(sector_size))
+		return 0;
+
+	contexts = thread_contexts(keys);
+	if(!contexts)
+		return 0;
+
+	ctx = encrypt ? contexts->encrypt : contexts->decrypt;
+
+	for(loop = 0; loop < nb_sectors; loop++)
+	{
+		index = first_index + loop;
+		memset(iv, 0, 16);
+		memcpy(iv, &index, sizeof(index));
+
+		if(EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1) != 1 ||
+		   EVP_CipherUpdate(
+				ctx,
+				output + sector_size * loop,
+				&len,
+				input + sector_size * loop,
+				(int) sector_size) != 1)
+			break;
+	}
+
+	return loop;
+}
+
+
+/**
+ * AES-CBC encryption/decryption of contiguous sectors, each sector's iv being
+ * the encryption of its address. The ivs of EVP_IVS sectors are encrypted at
+ * once. It stops at the first sector OpenSSL fails on, so that the caller can
+ * deal with the remaining ones with another implementation.
+ *
+ * @param keys The keys, set up for CBC
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param sector_size The size of a sector, a multiple of 16
+ * @param nb_sectors The number of sectors
+ * @param first_address The address of the first sector
+ * @param input The sectors to encrypt or decrypt
+ * @param output Where to put the result, may be the input
+ * @return The number of sectors done, from the first one
+ */
+size_t dis_evp_cbc_sectors(
+	dis_evp_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_address,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	evp_contexts_t* contexts = NULL;
+	EVP_CIPHER_CTX* ctx = NULL;
+	uint8_t  ivs[EVP_IVS][16];
+	uint64_t address = 0;
+	size_t   done    = 0;
+	size_t   nb      = 0;
+	size_t   sector  = 0;
+	size_t   offset  = 0;
+	int      len     = 0;
+
+	if(!keys || !keys->ctx.ivs || !sectors_fit(sector_size))
+		return 0;
+
+	contexts = thread_contexts(keys);
+	if(!contexts)
+		return 0;
+
+	ctx = encrypt ? contexts->encrypt : contexts->decrypt;
+
+	while(done < nb_sectors)
+	{
+		nb = nb_sectors - done;
+		if(nb > EVP_IVS)
+			nb = EVP_IVS;
+
+		/* First, create the ivs of these sectors */
+		for(sector = 0; sector < nb; sector++)
+		{
+			address = first_address + sector_size * (done + sector);
+			memset(ivs[sector], 0, 16);
+			memcpy(ivs[sector], &address, sizeof(address));
+		}
+		if(EVP_CipherUpdate(contexts->ivs, ivs[0], &len, ivs[0], (int) (16 * nb)) != 1)
+			goto end;
+
+		/* Then actually enc/decrypt them */
+		for(sector = 0; sector < nb; sector++, done++)
+		{
+			offset = sector_size * done;
+			if(EVP_CipherInit_ex(ctx, NULL, NULL, NULL, ivs[sector], -1) != 1 ||
+			   EVP_CipherUpdate(
+					ctx,
+					output + offset,
+					&len,
+					input + offset,
+					(int) sector_size) != 1)
+				goto end;
+		}
+	}
+
+end:
+	memset(ivs, 0, sizeof(ivs));
+	return done;
+}
+
+
+/**
+ * Free the keys
+ *
+ * @param keys The keys to free, may be NULL
+ */
+void dis_evp_destroy(dis_evp_keys_t* keys)
+{
+	evp_thread_contexts_t* thread = NULL;
+
+	if(!keys)
+		return;
+
+	/* Threads still alive don't free their copies once the key is deleted */
+	pthread_key_delete(keys->thread_key);
+	while(keys->threads)
+	{
+		thread = keys->threads;
+		keys->threads = thread->next;
+		free_contexts(&thread->ctx);
+		dis_free(thread);
+	}
+	pthread_mutex_destroy(&keys->lock);
+
+	free_contexts(&keys->ctx);
+	dis_free(keys);
+}
+
+
+
+
+/**
+ * Create an EVP context for a cipher and a key, without padding
+ *
+ * @param cipher The cipher
+ * @param key The key, of the cipher's key length
+ * @param encrypt 1 to encrypt, 0 to decrypt
+ * @return The context, NULL on error
+ */
+static EVP_CIPHER_CTX* new_context(const EVP_CIPHER* cipher, const uint8_t* key, int encrypt)
+{
+	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+	if(!ctx)
+		return NULL;
+
+	if(EVP_CipherInit_ex(ctx, cipher, NULL, key, NULL, encrypt) != 1 ||
+	   EVP_CIPHER_CTX_set_padding(ctx, 0) != 1)
+	{
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+
+/**
+ * Copy an EVP context, keys included
+ *
+ * @param ctx The context to copy
+ * @return The copy, NULL on error
+ */
+static EVP_CIPHER_CTX* copy_context(const EVP_CIPHER_CTX* ctx)
+{
+	EVP_CIPHER_CTX* copy = EVP_CIPHER_CTX_new();
+
+	if(!copy)
+		return NULL;
+
+	if(EVP_CIPHER_CTX_copy(copy, ctx) != 1)
+	{
+		EVP_CIPHER_CTX_free(copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+
+/**
+ * Free EVP contexts, EVP_CIPHER_CTX_free() cleaning them
+ *
+ * @param ctx The contexts
+ */
+static void free_contexts(evp_contexts_t* ctx)
+{
+	EVP_CIPHER_CTX_free(ctx->encrypt);
+	EVP_CIPHER_CTX_free(ctx->decrypt);
+	EVP_CIPHER_CTX_free(ctx->ivs);
+	ctx->encrypt = NULL;
+	ctx->decrypt = NULL;
+	ctx->ivs     = NULL;
+}
+
+
+/**
+ * Get the calling thread's copies of the keys' contexts, making them the
+ * first time
+ *
+ * @param keys The keys, set up
+ * @return The thread's contexts, NULL on error
+ */
+static evp_contexts_t* thread_contexts(dis_evp_keys_t* keys)
+{
+	evp_thread_contexts_t* thread = pthread_getspecific(keys->thread_key);
+
+	if(!thread)
+	{
+		thread = dis_malloc(sizeof(evp_thread_contexts_t));
+		memset(thread, 0, sizeof(evp_thread_contexts_t));
+		thread->keys = keys;
+
+		pthread_mutex_lock(&keys->lock);
+		thread->next = keys->threads;
+		if(keys->threads)
+			keys->threads->prev = thread;
+		keys->threads = thread;
+		pthread_mutex_unlock(&keys->lock);
+
+		pthread_setspecific(keys->thread_key, thread);
+	}
+
+	if(!thread->ctx.encrypt)
+	{
+		thread->ctx.encrypt = copy_context(keys->ctx.encrypt);
+		thread->ctx.decrypt = copy_context(keys->ctx.decrypt);
+		if(keys->ctx.ivs)
+			thread->ctx.ivs = copy_context(keys->ctx.ivs);
+
+		if(!thread->ctx.encrypt || !thread->ctx.decrypt ||
+		   (keys->ctx.ivs && !thread->ctx.ivs))
+		{
+			free_contexts(&thread->ctx);
+			return NULL;
+		}
+	}
+
+	return &thread->ctx;
+}
+
+
+/**
+ * Free a thread's copies of the contexts, called when the thread ends
+ *
+ * @param params The thread's contexts
+ */
+static void thread_contexts_free(void* params)
+{
+	evp_thread_contexts_t* thread = (evp_thread_contexts_t*) params;
+	dis_evp_keys_t* keys = NULL;
+
+	if(!thread)
+		return;
+
+	keys = thread->keys;
+
+	pthread_mutex_lock(&keys->lock);
+	if(thread->prev)
+		thread->prev->next = thread->next;
+	else
+		keys->threads = thread->next;
+	if(thread->next)
+		thread->next->prev = thread->prev;
+	pthread_mutex_unlock(&keys->lock);
+
+	free_contexts(&thread->ctx);
+	dis_free(thread);
+}
+
+
+/**
+ * Tell whether a sector can be enc/decrypted with a single EVP call
+ *
+ * @param sector_size The size of a sector
+ * @return TRUE if it can, FALSE otherwise
+ */
+static int sectors_fit(size_t sector_size)
+{
+	return sector_size >= 16 && sector_size % 16 == 0 && sector_size <= INT_MAX;
+}
+
+
+#else /* _HAVE_OPENSSL */
+
+
+dis_evp_keys_t* dis_evp_new(void)
+{
+	return NULL;
+}
+
+
+int dis_evp_set_key(dis_evp_keys_t* keys, uint16_t algorithm, const uint8_t* fvekey)
+{
+	(void) keys;
+	(void) algorithm;
+	(void) fvekey;
+	return -1;
+}
+
+
+size_t dis_evp_xts_sectors(
+	dis_evp_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_index,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) keys;
+	(void) encrypt;
+	(void) sector_size;
+	(void) nb_sectors;
+	(void) first_index;
+	(void) input;
+	(void) output;
+	return 0;
+}
+
+
+size_t dis_evp_cbc_sectors(
+	dis_evp_keys_t* keys,
+	int encrypt,
+	size_t sector_size,
+	size_t nb_sectors,
+	uint64_t first_address,
+	const uint8_t* input,
+	uint8_t* output)
+{
+	(void) keys;
+	(void) encrypt;
+	(void) sector_size;
+	(void) nb_sectors;
+	(void) first_address;
+	(void) input;
+	(void) output;
+	return 0;
+}
+
+
+void dis_evp_destroy(dis_evp_keys_t* keys)
+{
+	(void) keys;
+}
+
+
+#endif /* _HAVE_OPENSSL */
@@ -0,0 +1,573 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "dislocker/common.h"
+#include "dislocker/return_values.h"
+#include "dislocker/inouts/inouts.priv.h"
+#include "dislocker/inouts/sectors.h"
+#include "dislocker/inouts/cache.h"
+
+
+/*
+ * Decrypted data is cached by blocks of this size, aligned on it, or by
+ * sectors if they're bigger
+ */
+#define CACHE_BLOCK_SIZE 4096
+
+/* Number of independent parts of the cache, each with its own lock */
+#define CACHE_NB_SHARDS 16
+
+/* Marks an empty entry or the end of a bucket's chain */
+#define CACHE_NONE ((uint32_t) -1)
+
+
+/**
+ * A part of the cache. Blocks are dispatched among shards by their address,
+ * each shard evicting its own blocks with the CLOCK algorithm.
+ */
+typedef struct _dis_cache_shard {
+	pthread_mutex_t lock;
+
+	/* Number of entries and the entries themselves */
+	uint32_t  nb_entries;
+	uint64_t* keys;
+	uint8_t*  referenced;
+	uint32_t* next;
+	uint8_t*  data;
+
+	/* Hash table of the entries, chained through next */
+	uint32_t  nb_buckets;
+	uint32_t* buckets;
+
+	/* CLOCK's hand */
+	uint32_t  hand;
+} __attribute__ ((aligned (64))) dis_cache_shard_t;
+
+
+struct _dis_cache {
+	size_t   block_size;
+
+	/*
+	 * Increased by each invalidation, so that data read from the disk before a
+	 * write isn't cached once the write is done
+	 */
+	uint64_t generation;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations;
+
+	dis_cache_shard_t shards[CACHE_NB_SHARDS];
+};
+
+
+
+/** Prototype of functions used internally */
+static dis_cache_shard_t* get_shard(dis_cache_t cache, uint64_t key);
+static uint32_t get_bucket(dis_cache_shard_t* shard, uint64_t key);
+static uint32_t find_entry(dis_cache_shard_t* shard, uint64_t key);
+static void remove_entry(dis_cache_shard_t* shard, uint32_t entry);
+static int lookup_block(dis_cache_t cache, uint64_t key, uint8_t* output);
+static void insert_block(
+	dis_cache_t cache,
+	uint64_t key,
+	uint8_t* input,
+	uint64_t generation
+);
+static int fetch_sectors(
+	dis_iodata_t* io_data,
+	uint16_t sector_size,
+	off_t start,
+	off_t end,
+	uint8_t* output
+);
+
+
+
+
+/**
+ * Create a cache of decrypted sectors
+ *
+ * @param budget The memory the cached data may use, in bytes
+ * @param sector_size The volume's sector size
+ * @return The cache, or NULL if the budget is too small or the memory couldn't
+ * be allocated
+ */
+dis_cache_t dis_cache_new(size_t budget, uint16_t sector_size)
+{
+	dis_cache_t cache      = NULL;
+	size_t      block_size = CACHE_BLOCK_SIZE;
+	size_t      nb_entries = 0;
+	size_t      loop       = 0;
+	size_t      entry      = 0;
+
+	if(sector_size == 0)
+		return NULL;
+
+	if(sector_size >= CACHE_BLOCK_SIZE || CACHE_BLOCK_SIZE % sector_size != 0)
+		block_size = sector_size;
+
+	nb_entries = budget / block_size / CACHE_NB_SHARDS;
+	if(nb_entries == 0)
+		return NULL;
+	if(nb_entries > UINT32_MAX / 2)
+		nb_entries = UINT32_MAX / 2;
+
+	cache = dis_malloc(sizeof(struct _dis_cache));
+	memset(cache, 0, sizeof(struct _dis_cache));
+	cache->block_size = block_size;
+
+	for(loop = 0; loop < CACHE_NB_SHARDS; loop++)
+	{
+		dis_cache_shard_t* shard = &cache->shards[loop];
+
+		shard->nb_entries = (uint32_t) nb_entries;
+		shard->nb_buckets = (uint32_t) nb_entries * 2;
+		shard->keys       = malloc(nb_entries * sizeof(uint64_t));
+		shard->referenced = calloc(nb_entries, sizeof(uint8_t));
+		shard->next       = malloc(nb_entries * sizeof(uint32_t));
+		shard->data       = malloc(nb_entries * block_size);
+		shard->buckets    = malloc(nb_entries * 2 * sizeof(uint32_t));
+
+		if(!shard->keys || !shard->referenced || !shard->next ||
+		   !shard->data || !shard->buckets ||
+		   pthread_mutex_init(&shard->lock, NULL) != 0)
+		{
+			dis_printf(
+				L_WARNING,
+				"Cannot allocate %#" F_SIZE_T " bytes for the sectors cache\n",
+				budget
+			);
+			free(shard->keys);
+			free(shard->referenced);
+			free(shard->next);
+			free(shard->data);
+			free(shard->buckets);
+			shard->data = NULL;
+			dis_cache_destroy(cache);
+			return NULL;
+		}
+
+		for(entry = 0; entry < nb_entries; entry++)
+		{
+			shard->keys[entry] = UINT64_MAX;
+			shard->next[entry] = CACHE_NONE;
+		}
+		for(entry = 0; entry < nb_entries * 2; entry++)
+			shard->buckets[entry] = CACHE_NONE;
+	}
+
+	dis_printf(
+		L_DEBUG,
+		"Sectors cache of %#" F_SIZE_T " blocks of %#" F_SIZE_T " bytes\n",
+		nb_entries * CACHE_NB_SHARDS,
+		block_size
+	);
+
+	return cache;
+}
+
+
+/**
+ * Read and decrypt one or more sectors, taking those already decrypted from
+ * the cache and caching the others
+ * This has the same interface as read_decrypt_sectors().
+ * @warning The sector_start has to be correctly aligned
+ *
+ * @param io_data The data structure containing volume's information
+ * @param nb_read_sector The number of sectors to read
+ * @param sector_size The size of one sector
+ * @param sector_start The offset of the first sector to read
+ * @param output The output buffer where to put decrypted data
+ * @return TRUE if result can be trusted, FALSE otherwise
+ */
+int dis_cache_read_sectors(
+	dis_iodata_t* io_data,
+	size_t nb_read_sector,
+	uint16_t sector_size,
+	off_t sector_start,
+	uint8_t* output)
+{
+	// Check parameters
+	if(!io_data || !output)
+		return FALSE;
+
+	dis_cache_t cache = io_data->cache;
+	off_t       end   = sector_start + (off_t) (nb_read_sector * sector_size);
+
+	/*
+	 * Requests going past the volume's end are rare and don't have all their
+	 * sectors readable, don't bother with them
+	 */
+	if(!cache || (uint64_t) end > io_data->volume_size)
+		return read_decrypt_sectors(
+			io_data,
+			nb_read_sector,
+			sector_size,
+			sector_start,
+			output
+		);
+
+	off_t block_size = (off_t) cache->block_size;
+	off_t pos        = sector_start;
+	off_t miss_start = -1;
+
+	/*
+	 * Only blocks entirely covered by the request are looked up, consecutive
+	 * missing parts are read and decrypted at once
+	 */
+	while(pos < end)
+	{
+		if(pos % block_size == 0 && pos + block_size <= end &&
+		   lookup_block(cache, (uint64_t) (pos / block_size),
+		                output + (pos - sector_start)))
+		{
+			if(miss_start >= 0)
+			{
+				if(!fetch_sectors(io_data, sector_size, miss_start, pos,
+				                  output + (miss_start - sector_start)))
+					return FALSE;
+				miss_start = -1;
+			}
+
+			pos += block_size;
+			continue;
+		}
+
+		if(miss_start < 0)
+			miss_start = pos;
+
+		pos = (pos / block_size + 1) * block_size;
+		if(pos > end)
+			pos = end;
+	}
+
+	if(miss_start >= 0)
+		return fetch_sectors(io_data, sector_size, miss_start, end,
+		                     output + (miss_start - sector_start));
+
+	return TRUE;
+}
+
+
+/**
+ * Drop the cached blocks of a region which has just been written
+ * @warning Has to be called once the write is done
+ *
+ * @param cache The cache
+ * @param offset The offset of the region, as given to dislock()
+ * @param size The size of the region
+ */
+void dis_cache_invalidate(dis_cache_t cache, off_t offset, size_t size)
+{
+	if(!cache || size == 0)
+		return;
+
+	uint64_t key   = (uint64_t) offset / cache->block_size;
+	uint64_t last  = ((uint64_t) offset + size - 1) / cache->block_size;
+	uint32_t entry = 0;
+	dis_cache_shard_t* shard = NULL;
+
+	/* Has to be done before, see insert_block() */
+	__atomic_add_fetch(&cache->generation, 1, __ATOMIC_SEQ_CST);
+
+	for( ; key <= last; key++)
+	{
+		shard = get_shard(cache, key);
+
+		pthread_mutex_lock(&shard->lock);
+		entry = find_entry(shard, key);
+		if(entry != CACHE_NONE)
+		{
+			remove_entry(shard, entry);
+			__atomic_add_fetch(&cache->invalidations, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+
+/**
+ * Get the cache's counters
+ *
+ * @param cache The cache
+ * @param stats Where to put the counters
+ */
+void dis_cache_stats(dis_cache_t cache, dis_cache_stats_t* stats)
+{
+	if(!stats)
+		return;
+
+	memset(stats, 0, sizeof(dis_cache_stats_t));
+
+	if(!cache)
+		return;
+
+	stats->hits          = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+	stats->misses        = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+	stats->invalidations =
+		__atomic_load_n(&cache->invalidations, __ATOMIC_RELAXED);
+	stats->nb_blocks     =
+		(size_t) cache->shards[0].nb_entries * CACHE_NB_SHARDS;
+	stats->block_size    = cache->block_size;
+}
+
+
+/**
+ * Free a cache, wiping the decrypted data it holds
+ *
+ * @param cache The cache to free
+ */
+void dis_cache_destroy(dis_cache_t cache)
+{
+	size_t loop = 0;
+
+	if(!cache)
+		return;
+
+	for(loop = 0; loop < CACHE_NB_SHARDS; loop++)
+	{
+		dis_cache_shard_t* shard = &cache->shards[loop];
+
+		if(!shard->data)
+			continue;
+
+		memset(shard->data, 0, (size_t) shard->nb_entries * cache->block_size);
+		free(shard->data);
+		free(shard->keys);
+		free(shard->referenced);
+		free(shard->next);
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+
+	dis_free(cache);
+}
+
+
+
+
+/**
+ * Get the shard a block belongs to
+ */
+static dis_cache_shard_t* get_shard(dis_cache_t cache, uint64_t key)
+{
+	uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+	return &cache->shards[hash >> 60];
+}
+
+
+/**
+ * Get the bucket of a shard's hash table a block belongs to
+ */
+static uint32_t get_bucket(dis_cache_shard_t* shard, uint64_t key)
+{
+	uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+	return (uint32_t) ((hash & 0x0fffffffffffffffULL) % shard->nb_buckets);
+}
+
+
+/**
+ * Find a block in a shard
+ * @warning The shard's lock has to be held
+ *
+ * @return The entry holding the block, or CACHE_NONE if it's not cached
+ */
+static uint32_t find_entry(dis_cache_shard_t* shard, uint64_t key)
+{
+	uint32_t entry = shard->buckets[get_bucket(shard, key)];
+
+	while(entry != CACHE_NONE && shard->keys[entry] != key)
+		entry = shard->next[entry];
+
+	return entry;
+}
+
+
+/**
+ * Empty an entry of a shard
+ * @warning The shard's lock has to be held
+ */
+static void remove_entry(dis_cache_shard_t* shard, uint32_t entry)
+{
+	uint32_t* link = &shard->buckets[get_bucket(shard, shard->keys[entry])];
+
+	while(*link != entry)
+		link = &shard->next[*link];
+
+	*link = shard->next[entry];
+
+	shard->keys[entry]       = UINT64_MAX;
+	shard->next[entry]       = CACHE_NONE;
+	shard->referenced[entry] = FALSE;
+}
+
+
+/**
+ * Copy a block out of the cache, if it's there
+ *
+ * @param cache The cache
+ * @param key The block's number
+ * @param output Where to copy the block
+ * @return TRUE if the block was cached, FALSE otherwise
+ */
+static int lookup_block(dis_cache_t cache, uint64_t key, uint8_t* output)
+{
+	dis_cache_shard_t* shard = get_shard(cache, key);
+	uint32_t entry = CACHE_NONE;
+
+	pthread_mutex_lock(&shard->lock);
+
+	entry = find_entry(shard, key);
+	if(entry != CACHE_NONE)
+	{
+		shard->referenced[entry] = TRUE;
+		memcpy(
+			output,
+			shard->data + (size_t) entry * cache->block_size,
+			cache->block_size
+		);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if(entry == CACHE_NONE)
+		return FALSE;
+
+	__atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+
+/**
+ * Put a block into the cache, evicting the first entry not referenced since the
+ * hand last went by
+ *
+ * @param cache The cache
+ * @param key The block's number
+ * @param input The decrypted block
+ * @param generation The cache's generation before the block was read, if it
+ * changed since, a write may have happened meanwhile and the block isn't cached
+ */
+static void insert_block(
+	dis_cache_t cache,
+	uint64_t key,
+	uint8_t* input,
+	uint64_t generation)
+{
+	dis_cache_shard_t* shard = get_shard(cache, key);
+	uint32_t entry  = CACHE_NONE;
+	uint32_t bucket = 0;
+
+	pthread_mutex_lock(&shard->lock);
+
+	if(__atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST) != generation)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	entry = find_entry(shard, key);
+	if(entry == CACHE_NONE)
+	{
+		while(shard->referenced[shard->hand])
+		{
+			shard->referenced[shard->hand] = FALSE;
+			shard->hand = (shard->hand + 1) % shard->nb_entries;
+		}
+
+		entry = shard->hand;
+		shard->hand = (shard->hand + 1) % shard->nb_entries;
+
+		if(shard->keys[entry] != UINT64_MAX)
+			remove_entry(shard, entry);
+
+		bucket = get_bucket(shard, key);
+		shard->keys[entry]    = key;
+		shard->next[entry]    = shard->buckets[bucket];
+		shard->buckets[bucket] = entry;
+	}
+
+	memcpy(
+		shard->data + (size_t) entry * cache->block_size,
+		input,
+		cache->block_size
+	);
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+
+/**
+ * Read and decrypt sectors missing from the cache, then cache the blocks they
+ * entirely cover
+ *
+ * @param io_data The data structure containing volume's information
+ * @param sector_size The size of one sector
+ * @param start The offset of the first sector to read
+ * @param end The offset following the last sector to read
+ * @param output The output buffer where to put decrypted data
+ * @return TRUE if result can be trusted, FALSE otherwise
+ */
+static int fetch_sectors(
+	dis_iodata_t* io_data,
+	uint16_t sector_size,
+	off_t start,
+	off_t end,
+	uint8_t* output)
+{
+	dis_cache_t cache      = io_data->cache;
+	off_t       block_size = (off_t) cache->block_size;
+	off_t       pos        = 0;
+	uint64_t    generation =
+		__atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST);
+
+	__atomic_add_fetch(
+		&cache->misses,
+		(uint64_t) ((end - 1) / block_size - start / block_size + 1),
+		__ATOMIC_RELAXED
+	);
+
+	if(!read_decrypt_sectors(
+		io_data,
+		(size_t) (end - start) / sector_size,
+		sector_size,
+		start,
+		output
+	))
+		return FALSE;
+
+	pos = (start + block_size - 1) / block_size * block_size;
+	for( ; pos + block_size <= end; pos += block_size)
+		insert_block(
+			cache,
+			(uint64_t) (pos / block_size),
+			output + (pos - start),
+			generation
+		);
+
+	return TRUE;
+}
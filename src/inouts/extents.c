@@ -0,0 +1,442 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dislocker/common.h"
+#include "dislocker/return_values.h"
+#include "dislocker/dislocker.priv.h"
+#include "dislocker/metadata/metadata.priv.h"
+#include "dislocker/inouts/inouts.priv.h"
+#include "dislocker/inouts/extents.h"
+
+
+/*
+ * At most: the volume's beginning, both ends of each metadata region, the end
+ * of the W$ 7 backuped sectors or of the Vista first sectors and the end of the
+ * encrypted part of the volume
+ */
+#define DIS_EXTENTS_MAX_BOUNDS (2 + 2 * 5 + 2 + 1)
+
+
+struct _dis_extents {
+	uint16_t      sector_size;
+
+	size_t        nb_extents;
+	dis_extent_t* extents;
+};
+
+
+
+/** Prototype of functions used internally */
+static dis_extent_class_e sector_class(
+	dis_metadata_t dis_meta,
+	uint16_t sector_size,
+	uint64_t offset,
+	dis_extents_mode_e mode
+);
+static int compare_bounds(const void* a, const void* b);
+
+
+
+
+/**
+ * Split the volume into runs of sectors to be dealt with the same way, so that
+ * enc/decryption doesn't have to figure out what to do with each sector
+ *
+ * @param dis_meta The volume's metadata
+ * @param sector_size The volume's sector size
+ * @param mode Whether the map is to be used for reading or writing
+ * @return The map of the volume, or NULL on error
+ */
+dis_extents_t dis_extents_new(
+	dis_metadata_t dis_meta,
+	uint16_t sector_size,
+	dis_extents_mode_e mode)
+{
+	// Check parameters
+	if(!dis_meta || sector_size == 0)
+		return NULL;
+
+	dis_extents_t extents = NULL;
+	uint64_t bounds[DIS_EXTENTS_MAX_BOUNDS];
+	size_t   nb_bounds = 0;
+	size_t   loop      = 0;
+
+	version_t version  = dis_metadata_information_version(dis_meta);
+	uint64_t  enc_size = dis_metadata_encrypted_volume_size(dis_meta);
+	uint64_t  backup   = dis_metadata_ntfs_sectors_address(dis_meta);
+	uint64_t  addr     = 0;
+	uint64_t  size     = 0;
+	dis_extent_class_e type;
+
+	/*
+	 * Gather every offset where the way to deal with sectors may change, the
+	 * class of a sector being constant between two of them
+	 */
+	bounds[nb_bounds++] = 0;
+
+	if(mode == DIS_EXTENTS_READ)
+	{
+		/*
+		 * A sector is zeroed out as soon as it overlaps a metadata region, see
+		 * dis_metadata_is_overwritten()
+		 */
+		for(loop = 0; loop < dis_meta->nb_virt_region && loop < 5; loop++)
+		{
+			addr = dis_meta->virt_region[loop].addr;
+			size = dis_meta->virt_region[loop].size;
+			if(size == 0)
+				continue;
+
+			bounds[nb_bounds++] = addr - addr % sector_size;
+			bounds[nb_bounds++] = (addr + size + sector_size - 1)
+			                      / sector_size * sector_size;
+		}
+	}
+
+	if(version == V_SEVEN)
+	{
+		if(mode == DIS_EXTENTS_READ)
+			bounds[nb_bounds++] = (uint64_t) sector_size *
+			                  dis_metadata_backup_sectors_count(dis_meta);
+
+		bounds[nb_bounds++] = (enc_size + sector_size - 1)
+		                      / sector_size * sector_size;
+	}
+	else if(version == V_VISTA)
+	{
+		bounds[nb_bounds++] = sector_size;
+		bounds[nb_bounds++] = (uint64_t) sector_size * 16;
+	}
+
+	qsort(bounds, nb_bounds, sizeof(uint64_t), compare_bounds);
+
+
+	extents = dis_malloc(sizeof(struct _dis_extents));
+	memset(extents, 0, sizeof(struct _dis_extents));
+	extents->sector_size = sector_size;
+	extents->extents     = dis_malloc(nb_bounds * sizeof(dis_extent_t));
+
+	for(loop = 0; loop < nb_bounds; loop++)
+	{
+		/* Duplicated offsets make empty runs */
+		if(loop + 1 < nb_bounds && bounds[loop] == bounds[loop + 1])
+			continue;
+
+		type = sector_class(dis_meta, sector_size, bounds[loop], mode);
+
+		/* Merge with the previous run if there's no change after all */
+		if(extents->nb_extents > 0 &&
+		   extents->extents[extents->nb_extents - 1].type == type)
+		{
+			extents->extents[extents->nb_extents - 1].end =
+				loop + 1 < nb_bounds ? bounds[loop + 1] : UINT64_MAX;
+			continue;
+		}
+
+		extents->extents[extents->nb_extents].start = bounds[loop];
+		extents->extents[extents->nb_extents].end   =
+			loop + 1 < nb_bounds ? bounds[loop + 1] : UINT64_MAX;
+		extents->extents[extents->nb_extents].type  = type;
+		extents->extents[extents->nb_extents].physical =
+			type == DIS_EXTENT_BACKUP ? bounds[loop] + backup : bounds[loop];
+		extents->nb_extents++;
+	}
+
+	return extents;
+}
+
+
+/**
+ * Get the map used to read the volume, built in prepare_crypt()
+ *
+ * @param dis_ctx The dislocker context
+ * @return The map, or NULL if the volume isn't prepared yet
+ */
+dis_extents_t dis_extents_get(dis_context_t dis_ctx)
+{
+	if(!dis_ctx)
+		return NULL;
+
+	return dis_ctx->io_data.extents;
+}
+
+
+/**
+ * Get the number of extents in a map
+ *
+ * @param extents The map
+ * @return The number of extents
+ */
+size_t dis_extents_count(dis_extents_t extents)
+{
+	if(!extents)
+		return 0;
+
+	return extents->nb_extents;
+}
+
+
+/**
+ * Get an extent of a map by its index
+ *
+ * @param extents The map
+ * @param index The index of the extent, from 0 to dis_extents_count() - 1
+ * @return The extent, or NULL if out of bounds
+ */
+const dis_extent_t* dis_extents_at(dis_extents_t extents, size_t index)
+{
+	if(!extents || index >= extents->nb_extents)
+		return NULL;
+
+	return &extents->extents[index];
+}
+
+
+/**
+ * Find the extent an offset belongs to
+ *
+ * @param extents The map
+ * @param offset The offset on the volume, in bytes
+ * @return The extent containing the offset, or NULL if the map is invalid
+ */
+const dis_extent_t* dis_extents_lookup(dis_extents_t extents, uint64_t offset)
+{
+	if(!extents || extents->nb_extents == 0)
+		return NULL;
+
+	size_t low  = 0;
+	size_t high = extents->nb_extents - 1;
+	size_t mid  = 0;
+
+	/* Last extent whose start is before or at the offset */
+	while(low < high)
+	{
+		mid = low + (high - low + 1) / 2;
+		if(extents->extents[mid].start <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	return &extents->extents[low];
+}
+
+
+/**
+ * Find out where the sectors of a region are stored, as parts stored
+ * contiguously. Only the W$ 7 first sectors, redirected to their backup, are
+ * stored elsewhere than where the volume shows them.
+ *
+ * @param extents The map used to read the volume
+ * @param offset The offset of the region, aligned on the sector size
+ * @param size The size of the region, a multiple of the sector size
+ * @param segments Where to put the parts of the region
+ * @param nb_segments The number of parts segments can hold
+ * @return The number of parts of the region, 0 on error or if there are more
+ * than nb_segments
+ */
+size_t dis_extents_translate(
+	dis_extents_t extents,
+	uint64_t offset,
+	size_t size,
+	dis_segment_t* segments,
+	size_t nb_segments)
+{
+	const dis_extent_t* extent = NULL;
+	dis_segment_t* last = NULL;
+	uint64_t end      = offset + size;
+	uint64_t run_end  = 0;
+	uint64_t physical = 0;
+	size_t   count    = 0;
+
+	if(!extents || !segments || size == 0)
+		return 0;
+
+	while(offset < end)
+	{
+		extent = dis_extents_lookup(extents, offset);
+		if(!extent)
+			return 0;
+
+		run_end  = extent->end < end ? extent->end : end;
+		physical = extent->physical + (offset - extent->start);
+
+		/* Runs stored one after the other are one part */
+		last = count > 0 ? &segments[count - 1] : NULL;
+		if(last && last->offset + last->size == offset &&
+		   last->physical + last->size == physical)
+			last->size += (size_t) (run_end - offset);
+		else
+		{
+			if(count == nb_segments)
+				return 0;
+
+			segments[count].offset   = offset;
+			segments[count].physical = physical;
+			segments[count].size     = (size_t) (run_end - offset);
+			count++;
+		}
+
+		offset = run_end;
+	}
+
+	return count;
+}
+
+
+/**
+ * Get a printable name for an extent class
+ *
+ * @param type The class
+ * @return A constant string
+ */
+const char* dis_extent_class_str(dis_extent_class_e type)
+{
+	switch(type)
+	{
+		case DIS_EXTENT_ZERO:
+			return "zeroed out";
+		case DIS_EXTENT_BACKUP:
+			return "backup redirected";
+		case DIS_EXTENT_PLAIN:
+			return "plaintext";
+		case DIS_EXTENT_VISTA_VBR:
+			return "Vista VBR fixup";
+		case DIS_EXTENT_ENCRYPTED:
+			return "encrypted";
+		default:
+			return "unknown";
+	}
+}
+
+
+/**
+ * Print a map of the volume
+ *
+ * @param level The level at which to print
+ * @param extents The map to print
+ */
+void dis_extents_print(DIS_LOGS level, dis_extents_t extents)
+{
+	size_t loop = 0;
+
+	if(!extents)
+		return;
+
+	dis_printf(level, "=====================[ Extents map ]======================\n");
+	for(loop = 0; loop < extents->nb_extents; loop++)
+	{
+		if(extents->extents[loop].end == UINT64_MAX)
+			dis_printf(
+				level,
+				"  [%#" PRIx64 " - end of volume): %s\n",
+				extents->extents[loop].start,
+				dis_extent_class_str(extents->extents[loop].type)
+			);
+		else
+			dis_printf(
+				level,
+				"  [%#" PRIx64 " - %#" PRIx64 "): %s\n",
+				extents->extents[loop].start,
+				extents->extents[loop].end,
+				dis_extent_class_str(extents->extents[loop].type)
+			);
+	}
+	dis_printf(level, "==========================================================\n");
+}
+
+
+/**
+ * Free a map
+ *
+ * @param extents The map to free
+ */
+void dis_extents_destroy(dis_extents_t extents)
+{
+	if(!extents)
+		return;
+
+	dis_free(extents->extents);
+	dis_free(extents);
+}
+
+
+
+
+/**
+ * Find out how to deal with a sector, the way thread_decrypt() and
+ * thread_encrypt() used to for each sector
+ *
+ * @param dis_meta The volume's metadata
+ * @param sector_size The volume's sector size
+ * @param offset The offset of the sector, aligned on the sector size
+ * @param mode Whether the sector is to be read or written
+ * @return The class of the sector
+ */
+static dis_extent_class_e sector_class(
+	dis_metadata_t dis_meta,
+	uint16_t sector_size,
+	uint64_t offset,
+	dis_extents_mode_e mode)
+{
+	version_t version = dis_metadata_information_version(dis_meta);
+	uint64_t  sector  = offset / sector_size;
+
+	if(mode == DIS_EXTENTS_READ)
+	{
+		if(dis_metadata_is_overwritten(dis_meta, (off_t) offset, sector_size)
+		                         == DIS_RET_ERROR_METADATA_FILE_OVERWRITE)
+			return DIS_EXTENT_ZERO;
+
+		if(version == V_SEVEN &&
+		   sector < dis_metadata_backup_sectors_count(dis_meta))
+			return DIS_EXTENT_BACKUP;
+	}
+
+	if(version == V_SEVEN &&
+	   offset >= dis_metadata_encrypted_volume_size(dis_meta))
+		return DIS_EXTENT_PLAIN;
+
+	if(version == V_VISTA && sector < 16)
+		return sector < 1 ? DIS_EXTENT_VISTA_VBR : DIS_EXTENT_PLAIN;
+
+	return DIS_EXTENT_ENCRYPTED;
+}
+
+
+/**
+ * Compare two offsets, for qsort()
+ */
+static int compare_bounds(const void* a, const void* b)
+{
+	uint64_t first  = *(const uint64_t*) a;
+	uint64_t second = *(const uint64_t*) b;
+
+	if(first < second)
+		return -1;
+
+	return first > second;
+}
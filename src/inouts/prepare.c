@@ -21,8 +21,12 @@
  * USA.
  */
 
+#define _GNU_SOURCE 1
+
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include "dislocker/inouts/prepare.h"
 #include "dislocker/inouts/sectors.h"
@@ -30,6 +34,20 @@
 
 #include "dislocker/dislocker.priv.h"
 #include "dislocker/return_values.h"
+#include "dislocker/config.priv.h"
+
+
+/*
+ * On Darwin and FreeBSD, files are opened using 64 bits offsets/variables
+ * and O_LARGEFILE isn't defined
+ */
+#if defined(__DARWIN) || defined(__FREEBSD)
+#  define O_LARGEFILE 0
+#endif /* __DARWIN || __FREEBSD */
+
+
+/** Prototype of functions used internally */
+static void open_volume_direct(dis_context_t dis_ctx);
 
 
 /**
@@ -107,11 +125,66 @@ int prepare_crypt(dis_context_t dis_ctx)
 	io_data->part_off       = dis_ctx->cfg.offset;
 	io_data->sector_size    = dis_inouts_sector_size(dis_ctx);
 	io_data->decrypt_region = read_decrypt_sectors;
-	io_data->encrypt_region = encrypt_write_sectors;
+	io_data->encrypt_region = encrypt_write_segments;
 	io_data->encrypted_volume_size = dis_metadata_encrypted_volume_size(io_data->metadata);
 	io_data->backup_sectors_addr   = dis_metadata_ntfs_sectors_address(io_data->metadata);
 	io_data->nb_backup_sectors     = dis_metadata_backup_sectors_count(io_data->metadata);
 
+	/*
+	 * Classify the volume's sectors once and for all, so that reads and writes
+	 * can deal with whole runs of sectors. This has to be done before anything
+	 * is read, including the volume's size below.
+	 */
+	dis_extents_destroy(io_data->extents);
+	dis_extents_destroy(io_data->write_extents);
+	io_data->extents       = dis_extents_new(
+		io_data->metadata,
+		io_data->sector_size,
+		DIS_EXTENTS_READ
+	);
+	io_data->write_extents = dis_extents_new(
+		io_data->metadata,
+		io_data->sector_size,
+		DIS_EXTENTS_WRITE
+	);
+	if(!io_data->extents || !io_data->write_extents)
+	{
+		dis_printf(L_ERROR, "Can't map the volume's sectors\n");
+		return DIS_RET_ERROR_DISLOCKER_INVAL;
+	}
+
+	dis_extents_print(L_DEBUG, io_data->extents);
+
+	init_backup_sectors_cache(io_data);
+
+	/*
+	 * Start the threads used for enc/decryption once and for all, they're
+	 * stopped in dis_destroy()
+	 */
+	io_data->nb_threads = dis_ctx->cfg.nb_threads;
+	if(io_data->nb_threads == 0)
+		io_data->nb_threads = dis_workers_default_count();
+	if(io_data->nb_threads > DIS_WORKERS_MAX)
+		io_data->nb_threads = DIS_WORKERS_MAX;
+
+	if(!io_data->workers && io_data->nb_threads > 1)
+		io_data->workers = dis_workers_new(io_data->nb_threads);
+	if(!io_data->workers)
+		io_data->nb_threads = 1;
+
+	dis_printf(
+		L_INFO,
+		"Using %u thread(s) for enc/decryption\n",
+		io_data->nb_threads
+	);
+
+	if(dis_ctx->cfg.flags & DIS_FLAG_DIRECT_IO && !io_data->volume_direct)
+		open_volume_direct(dis_ctx);
+
+	/* Falls back to pread() if io_uring can't be used */
+	if(!io_data->uring)
+		io_data->uring = dis_uring_new(io_data->volume_fd, DIS_URING_DEPTH);
+
 	/*
 	 * We need to grab the volume's size from the first sector, so we can
 	 * announce it on a getattr call
@@ -130,6 +203,41 @@ int prepare_crypt(dis_context_t dis_ctx)
 	);
 
 
+	/*
+	 * Put the cache of decrypted sectors in front of the reads, now that the
+	 * volume's size is known
+	 */
+	if(!io_data->cache && dis_ctx->cfg.cache_size > 0)
+	{
+		io_data->cache = dis_cache_new(
+			(size_t) dis_ctx->cfg.cache_size * 1024 * 1024,
+			io_data->sector_size
+		);
+		if(io_data->cache)
+			io_data->decrypt_region = dis_cache_read_sectors;
+	}
+
+	dis_printf(
+		L_INFO,
+		"Using %u MiB to cache decrypted sectors\n",
+		io_data->cache ? dis_ctx->cfg.cache_size : 0
+	);
+
+	/* Data can only be read ahead into the cache */
+	if(!io_data->readahead && io_data->cache && dis_ctx->cfg.readahead > 0)
+		io_data->readahead = dis_readahead_new(
+			io_data,
+			dis_ctx->cfg.readahead
+		);
+
+	if(io_data->readahead)
+		dis_printf(
+			L_DEBUG,
+			"Reading up to %u request(s) ahead of sequential readers\n",
+			dis_ctx->cfg.readahead
+		);
+
+
 	/*
 	 * Don't initialize the mftmirror_backup field for it's the same as the
 	 * backup_sectors_addr one.
@@ -138,3 +246,71 @@ int prepare_crypt(dis_context_t dis_ctx)
 	return DIS_RET_SUCCESS;
 }
 
+
+
+
+/**
+ * Open the volume again, for direct I/O, and use it for sectors' reads and
+ * writes. The first descriptor is kept for the metadata. If direct I/O can't
+ * be used, nothing is changed.
+ *
+ * @param dis_ctx The dislocker context
+ */
+static void open_volume_direct(dis_context_t dis_ctx)
+{
+	dis_iodata_t* io_data = &dis_ctx->io_data;
+	int      flags  = O_LARGEFILE;
+	int      fd     = -1;
+	uint8_t* buffer = NULL;
+	ssize_t  read_size = 0;
+
+	if(io_data->part_off % io_data->sector_size != 0)
+	{
+		dis_printf(
+			L_WARNING,
+			"The volume's offset isn't aligned on sectors, not using direct I/O\n"
+		);
+		return;
+	}
+
+	if(dis_ctx->cfg.flags & DIS_FLAG_READ_ONLY)
+		flags |= O_RDONLY;
+	else
+		flags |= O_RDWR;
+
+#if defined(O_DIRECT)
+	fd = dis_open(dis_ctx->cfg.volume_path, flags | O_DIRECT);
+#elif defined(F_NOCACHE)
+	fd = dis_open(dis_ctx->cfg.volume_path, flags);
+	if(fd >= 0 && fcntl(fd, F_NOCACHE, 1) < 0)
+	{
+		dis_close(fd);
+		fd = -1;
+	}
+#endif
+	if(fd < 0)
+	{
+		dis_printf(L_WARNING, "Cannot open the volume for direct I/O\n");
+		return;
+	}
+
+	/* Some filesystems refuse direct I/O only when reading */
+	buffer = dis_buffer_get(io_data->sector_size);
+	if(buffer)
+	{
+		read_size = pread(fd, buffer, io_data->sector_size, io_data->part_off);
+		dis_buffer_put(buffer);
+	}
+
+	if(read_size != io_data->sector_size)
+	{
+		dis_printf(L_WARNING, "Direct I/O unsupported on this volume, not using it\n");
+		dis_close(fd);
+		return;
+	}
+
+	io_data->volume_fd     = fd;
+	io_data->volume_direct = TRUE;
+
+	dis_printf(L_INFO, "Accessing the volume with direct I/O (fd #%d)\n", fd);
+}
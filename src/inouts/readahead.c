@@ -0,0 +1,369 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "dislocker/common.h"
+#include "dislocker/return_values.h"
+#include "dislocker/inouts/inouts.priv.h"
+#include "dislocker/inouts/cache.h"
+#include "dislocker/inouts/readahead.h"
+
+
+/* Number of sequential readers followed at the same time */
+#define READAHEAD_NB_STREAMS 4
+
+/* Maximum number of chunks waiting to be prefetched */
+#define READAHEAD_QUEUE_SIZE 16
+
+/* Chunks are the size of the reader's requests, up to this */
+#define READAHEAD_MAX_CHUNK (1024 * 1024)
+
+
+/**
+ * A sequential reader, as seen through the requests it does
+ */
+typedef struct _dis_readahead_stream {
+	/* Where the next request is expected to start */
+	off_t    next;
+	/* Where the data already requested to the background thread ends */
+	off_t    ahead;
+	/* Number of consecutive requests done right after the previous one */
+	unsigned int streak;
+	/* Used to replace the least recently used stream */
+	uint64_t last_used;
+} dis_readahead_stream_t;
+
+
+/**
+ * A part of the volume to read and decrypt into the cache
+ */
+typedef struct _dis_readahead_chunk {
+	off_t  start;
+	size_t size;
+} dis_readahead_chunk_t;
+
+
+struct _dis_readahead {
+	dis_iodata_t*   io_data;
+
+	/* Data is read by blocks of the cache, aligned on them */
+	size_t          block_size;
+	/* Maximum number of bytes read ahead of a reader */
+	size_t          max_window;
+	unsigned int    nb_chunks;
+
+	pthread_mutex_t lock;
+	/* Signaled when a chunk is queued or when stopping */
+	pthread_cond_t  cond;
+	pthread_t       thread;
+	int             stop;
+
+	dis_readahead_stream_t streams[READAHEAD_NB_STREAMS];
+	uint64_t        clock;
+
+	/* Circular queue of chunks to prefetch */
+	dis_readahead_chunk_t queue[READAHEAD_QUEUE_SIZE];
+	unsigned int    head;
+	unsigned int    count;
+
+	uint64_t        nb_prefetched;
+	uint64_t        nb_dropped;
+};
+
+
+
+/** Prototype of functions used internally */
+static dis_readahead_stream_t* get_stream(dis_readahead_t readahead, off_t offset);
+static void* readahead_loop(void* params);
+
+
+
+
+/**
+ * Start the thread prefetching data for sequential readers. The data is put
+ * into the decrypted sectors cache, which is therefore required.
+ *
+ * @param io_data The data used to read and decrypt sectors, with a cache
+ * @param nb_chunks The number of requests to read ahead of a sequential reader
+ * @return The newly created readahead, or NULL if there's nothing to read
+ * ahead or if it couldn't be started
+ */
+dis_readahead_t dis_readahead_new(dis_iodata_t* io_data, unsigned int nb_chunks)
+{
+	dis_readahead_t   readahead = NULL;
+	dis_cache_stats_t stats;
+
+	if(!io_data || !io_data->cache || nb_chunks == 0)
+		return NULL;
+
+	readahead = dis_malloc(sizeof(struct _dis_readahead));
+	memset(readahead, 0, sizeof(struct _dis_readahead));
+
+	dis_cache_stats(io_data->cache, &stats);
+
+	readahead->io_data    = io_data;
+	readahead->block_size = stats.block_size;
+	readahead->nb_chunks  = nb_chunks;
+
+	/*
+	 * Don't read ahead more than a quarter of the cache, or prefetched data
+	 * would be evicted before being used
+	 */
+	readahead->max_window = stats.nb_blocks * stats.block_size / 4;
+	if(readahead->max_window < readahead->block_size)
+	{
+		dis_free(readahead);
+		return NULL;
+	}
+
+	if(pthread_mutex_init(&readahead->lock, NULL) != 0)
+	{
+		dis_printf(L_ERROR, "Cannot initialize the readahead's mutex\n");
+		dis_free(readahead);
+		return NULL;
+	}
+	pthread_cond_init(&readahead->cond, NULL);
+
+	if(pthread_create(&readahead->thread, NULL, readahead_loop, readahead) != 0)
+	{
+		dis_printf(L_WARNING, "Cannot start the readahead thread\n");
+		pthread_cond_destroy(&readahead->cond);
+		pthread_mutex_destroy(&readahead->lock);
+		dis_free(readahead);
+		return NULL;
+	}
+
+	return readahead;
+}
+
+
+/**
+ * Tell the readahead about a read request, before it's processed. If it
+ * continues a sequential stream, the data following it is queued to be
+ * prefetched, so that it's in the cache when the next requests come.
+ *
+ * @param readahead The readahead to notify, may be NULL
+ * @param offset The offset of the request, in bytes
+ * @param size The size of the request, in bytes
+ */
+void dis_readahead_notify(dis_readahead_t readahead, off_t offset, size_t size)
+{
+	if(!readahead || size == 0)
+		return;
+
+	dis_readahead_stream_t* stream = NULL;
+	off_t  block_size = (off_t) readahead->block_size;
+	off_t  volume_end = (off_t) readahead->io_data->volume_size;
+	off_t  target     = 0;
+	size_t chunk      = 0;
+	size_t window     = 0;
+	int    queued     = FALSE;
+
+	pthread_mutex_lock(&readahead->lock);
+
+	stream = get_stream(readahead, offset);
+	stream->next      = offset + (off_t) size;
+	stream->last_used = ++readahead->clock;
+
+	/* Wait for the second request in a row before reading ahead */
+	if(stream->streak == 0 || stream->next >= volume_end)
+	{
+		pthread_mutex_unlock(&readahead->lock);
+		return;
+	}
+
+	chunk = (size + readahead->block_size - 1) / readahead->block_size *
+	        readahead->block_size;
+	if(chunk > READAHEAD_MAX_CHUNK)
+		chunk = READAHEAD_MAX_CHUNK;
+
+	window = readahead->nb_chunks * chunk;
+	if(window > readahead->max_window)
+		window = readahead->max_window;
+
+	if(stream->ahead < stream->next)
+		stream->ahead = stream->next / block_size * block_size;
+
+	/* Only refill the window once the reader consumed half of it */
+	if(stream->ahead - stream->next >= (off_t) window / 2)
+	{
+		pthread_mutex_unlock(&readahead->lock);
+		return;
+	}
+
+	target = stream->next + (off_t) window;
+	if(target > volume_end)
+		target = volume_end;
+
+	while(stream->ahead < target)
+	{
+		dis_readahead_chunk_t* slot = NULL;
+
+		if(readahead->count == READAHEAD_QUEUE_SIZE)
+		{
+			readahead->nb_dropped++;
+			break;
+		}
+
+		slot = &readahead->queue[
+			(readahead->head + readahead->count) % READAHEAD_QUEUE_SIZE
+		];
+		slot->start = stream->ahead;
+		slot->size  = chunk;
+		if(slot->start + (off_t) slot->size > target)
+			slot->size = (size_t) (target - slot->start);
+
+		readahead->count++;
+		stream->ahead += (off_t) slot->size;
+		queued = TRUE;
+	}
+
+	if(queued)
+		pthread_cond_signal(&readahead->cond);
+
+	pthread_mutex_unlock(&readahead->lock);
+}
+
+
+/**
+ * Stop the readahead's thread, dropping what's still queued, and free it
+ *
+ * @param readahead The readahead to destroy
+ */
+void dis_readahead_destroy(dis_readahead_t readahead)
+{
+	if(!readahead)
+		return;
+
+	pthread_mutex_lock(&readahead->lock);
+	readahead->stop = TRUE;
+	pthread_cond_signal(&readahead->cond);
+	pthread_mutex_unlock(&readahead->lock);
+
+	pthread_join(readahead->thread, NULL);
+
+	dis_printf(
+		L_DEBUG,
+		"Readahead: %" PRIu64 " chunk(s) prefetched, %" PRIu64 " dropped\n",
+		readahead->nb_prefetched,
+		readahead->nb_dropped
+	);
+
+	pthread_cond_destroy(&readahead->cond);
+	pthread_mutex_destroy(&readahead->lock);
+
+	dis_free(readahead);
+}
+
+
+
+
+/**
+ * Find the stream a request continues, or replace the least recently used one
+ * with a new stream starting at this request
+ * @warning The readahead's lock has to be held
+ *
+ * @param readahead The readahead the streams belong to
+ * @param offset The offset of the request
+ * @return The stream the request belongs to
+ */
+static dis_readahead_stream_t* get_stream(dis_readahead_t readahead, off_t offset)
+{
+	dis_readahead_stream_t* oldest = &readahead->streams[0];
+	unsigned int loop = 0;
+
+	for(loop = 0; loop < READAHEAD_NB_STREAMS; ++loop)
+	{
+		dis_readahead_stream_t* stream = &readahead->streams[loop];
+
+		if(stream->last_used && stream->next == offset)
+		{
+			stream->streak++;
+			return stream;
+		}
+
+		if(stream->last_used < oldest->last_used)
+			oldest = stream;
+	}
+
+	oldest->ahead  = 0;
+	oldest->streak = 0;
+
+	return oldest;
+}
+
+
+/**
+ * Main loop of the readahead's thread: read and decrypt queued chunks into the
+ * cache until the readahead is stopped
+ *
+ * @param params The readahead
+ */
+static void* readahead_loop(void* params)
+{
+	dis_readahead_t readahead = (dis_readahead_t) params;
+	dis_iodata_t*   io_data   = readahead->io_data;
+	dis_readahead_chunk_t chunk;
+
+	pthread_mutex_lock(&readahead->lock);
+
+	for(;;)
+	{
+		while(!readahead->stop && readahead->count == 0)
+			pthread_cond_wait(&readahead->cond, &readahead->lock);
+
+		if(readahead->stop)
+			break;
+
+		chunk = readahead->queue[readahead->head];
+		readahead->head = (readahead->head + 1) % READAHEAD_QUEUE_SIZE;
+		readahead->count--;
+
+		pthread_mutex_unlock(&readahead->lock);
+
+		/* Reading through the cache is enough to have the chunk kept there */
+		uint8_t* buffer = dis_buffer_get(chunk.size);
+		int ok = dis_cache_read_sectors(
+			io_data,
+			chunk.size / io_data->sector_size,
+			io_data->sector_size,
+			chunk.start,
+			buffer
+		);
+		dis_buffer_put(buffer);
+
+		pthread_mutex_lock(&readahead->lock);
+
+		if(ok)
+			readahead->nb_prefetched++;
+		else
+			readahead->nb_dropped++;
+	}
+
+	pthread_mutex_unlock(&readahead->lock);
+
+	return NULL;
+}
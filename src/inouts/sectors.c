@@ -32,45 +32,115 @@
 #include "dislocker/encryption/encrypt.h"
 #include "dislocker/metadata/metadata.h"
 #include "dislocker/inouts/inouts.priv.h"
+#include "dislocker/inouts/sectors.h"
+#include "dislocker/inouts/workers.h"
 
 
 /*
- * Number of thread you want to run for enc/decryption
- * NOTE: FUSE uses its own threads so the FUSE's functions can be called in
- * parallel. Use the environment variable FUSE_MAX_WORKERS to change the
- * FUSE's threads number.
+ * Amount of data a thread takes at once from a sectors range, so that threads
+ * stealing from each other still work on contiguous sectors. It's more if the
+ * crypt backend is better with larger batches, see dis_crypt_batch_size().
  */
-#define NB_THREAD 2
-// Have a look at sysconf(_SC_NPROCESSORS_ONLN)
-// Note: 512*NB_THREAD shouldn't be more than 2^16 (due to used types)
+#define SECTORS_BATCH_SIZE 4096
 
+/*
+ * Above this size, the NTFS sectors backuped on W$ 7 volumes aren't kept
+ * decrypted in memory
+ */
+#define BACKUP_CACHE_MAX_SIZE (1024 * 1024)
+
+/*
+ * With io_uring, requests are split into reads of at least this size, or of
+ * the crypt backend's batch size if it's larger, up to this number, which are
+ * in flight together
+ */
+#define URING_CHUNK_SIZE (32 * 1024)
+#define URING_MAX_CHUNKS 16
+
+/* Whether a buffer can be used for direct I/O on the volume */
+#define DIRECT_IO_ALIGNED(io_data, buffer) \
+	(!(io_data)->volume_direct || \
+	 (uintptr_t) (buffer) % (io_data)->sector_size == 0)
 
-/* Struct we pass to a thread for buffer enc/decryption */
+
+/*
+ * Struct we pass to a thread for buffer enc/decryption
+ * Each thread is given its own contiguous range of sectors, [next, end), which
+ * other threads may take batches from once done with theirs. It is aligned on
+ * a cache line so that threads don't contend over each other's cursor.
+ */
 typedef struct _thread_arg
 {
-	size_t   nb_loop;
-	uint16_t nb_threads;
-	unsigned int thread_begin;
+	/* Index of the next sector to process in the range, shared */
+	size_t   next;
+	/* Index following the range's last sector */
+	size_t   end;
+	/* Number of sectors taken at once */
+	size_t   batch;
+
+	/* All the ranges of the region, to steal from */
+	size_t   nb_threads;
+	struct _thread_arg* ranges;
 
 	uint16_t sector_size;
 	off_t    sector_start;
+	/*
+	 * Where the sectors are stored, NULL if it's contiguously from
+	 * sector_start
+	 */
+	const dis_segment_t* segments;
+	size_t   nb_segments;
 
 	uint8_t* input;
 	uint8_t* output;
 
 	dis_iodata_t* io_data;
-} thread_arg_t;
+} __attribute__ ((aligned (64))) thread_arg_t;
 
 
 
 /** Prototype of functions used internally */
+static void run_threads(
+	dis_iodata_t* io_data,
+	dis_workers_fn_t fn,
+	size_t nb_loop,
+	uint16_t sector_size,
+	off_t sector_start,
+	const dis_segment_t* segments,
+	size_t nb_segments,
+	uint8_t* input,
+	uint8_t* output
+);
+static int claim_sectors(thread_arg_t* args, size_t* begin, size_t* end);
+static off_t sector_location(thread_arg_t* args, size_t index, size_t* nb_next);
+static int read_decrypt_sectors_uring(
+	dis_iodata_t* io_data,
+	size_t nb_read_sector,
+	uint16_t sector_size,
+	off_t sector_start,
+	uint8_t* output
+);
 static void* thread_decrypt(void* args);
 static void* thread_encrypt(void* args);
-static void fix_read_sector_seven(
+static void invalidate_backup_sectors_cache(
+	dis_iodata_t* io_data,
+	off_t offset,
+	size_t size
+);
+static int read_backup_sectors(
+	dis_iodata_t* io_data,
+	off_t physical,
+	size_t nb_sectors,
+	uint8_t* input,
+	uint8_t* output
+);
+static void fix_read_sectors_seven(
 	dis_iodata_t* io_data,
 	off_t sector_address,
-	uint8_t *input,
-	uint8_t *output
+	off_t physical,
+	size_t nb_sectors,
+	uint8_t* input,
+	uint8_t* output
 );
 static void fix_read_sector_vista(
 	dis_iodata_t* io_data,
@@ -88,6 +158,8 @@ static void fix_write_sector_vista(
 
 /**
  * Read and decrypt one or more sectors
+ * Sectors are read straight into the output buffer and decrypted in place.
+ * Big requests are read through io_uring when it's available.
  * @warning The sector_start has to be correctly aligned
  *
  * @param io_data The data structure containing volume's information
@@ -112,18 +184,48 @@ int read_decrypt_sectors(
 
 	size_t   nb_loop = 0;
 	size_t   size    = nb_read_sector * sector_size;
-	uint8_t* input   = malloc(size);
 	off_t    off     = sector_start + io_data->part_off;
 
-	memset(input , 0, size);
-	memset(output, 0, size);
+	/*
+	 * With direct I/O, unaligned buffers are read into one of the thread's
+	 * aligned buffers first
+	 */
+	if(!DIRECT_IO_ALIGNED(io_data, output))
+	{
+		uint8_t* bounce = dis_buffer_get(size);
+		int      ret    = FALSE;
+
+		if(!bounce)
+			return FALSE;
+
+		ret = read_decrypt_sectors(
+			io_data,
+			nb_read_sector,
+			sector_size,
+			sector_start,
+			bounce
+		);
+		if(ret)
+			memcpy(output, bounce, size);
+
+		dis_buffer_put(bounce);
+		return ret;
+	}
+
+	if(io_data->uring && size >= 2 * URING_CHUNK_SIZE)
+		return read_decrypt_sectors_uring(
+			io_data,
+			nb_read_sector,
+			sector_size,
+			sector_start,
+			output
+		);
 
 	/* Read the sectors we need */
-	ssize_t read_size = pread(io_data->volume_fd, input, size, off);
+	ssize_t read_size = pread(io_data->volume_fd, output, size, off);
 
 	if(read_size <= 0)
 	{
-		free(input);
 		dis_printf(
 			L_ERROR,
 			"Unable to read %#" F_SIZE_T " bytes from %#" F_OFF_T "\n",
@@ -140,58 +242,21 @@ int read_decrypt_sectors(
 	 */
 	nb_loop = (size_t) read_size / sector_size;
 
-
-	/* Run threads if compiled with */
-#if NB_THREAD > 0
-	{
-		/* Threads preparations */
-		pthread_t thread[NB_THREAD];
-		thread_arg_t args[NB_THREAD];
-		unsigned int loop = 0;
-
-		for(loop = 0; loop < NB_THREAD; ++loop)
-		{
-			args[loop].nb_loop       = nb_loop;
-			args[loop].nb_threads    = NB_THREAD;
-			args[loop].thread_begin  = loop;
-			args[loop].sector_size   = sector_size;
-			args[loop].sector_start  = sector_start;
-			args[loop].input         = input;
-			args[loop].output        = output;
-
-			args[loop].io_data       = io_data;
-
-			pthread_create(
-				&thread[loop],
-				NULL,
-				thread_decrypt,
-				(void*) &args[loop]
-			);
-		}
-
-		/* Wait for threads to end */
-		for(loop = 0; loop < NB_THREAD; ++loop)
-			pthread_join(thread[loop], NULL);
-	}
-#else
-	{
-		thread_arg_t arg;
-		arg.nb_loop       = nb_loop;
-		arg.nb_threads    = 1;
-		arg.thread_begin  = 0;
-		arg.sector_size   = sector_size;
-		arg.sector_start  = sector_start;
-		arg.input         = input;
-		arg.output        = output;
-
-		arg.io_data       = io_data;
-
-		thread_decrypt(&arg);
-	}
-#endif
-
-
-	free(input);
+	/* What couldn't be read is returned zeroed out */
+	memset(output + nb_loop * sector_size, 0, size - nb_loop * sector_size);
+
+	/* Let the workers do the job */
+	run_threads(
+		io_data,
+		thread_decrypt,
+		nb_loop,
+		sector_size,
+		sector_start,
+		NULL,
+		0,
+		output,
+		output
+	);
 
 	return TRUE;
 }
@@ -216,79 +281,451 @@ int encrypt_write_sectors(
 	off_t sector_start,
 	uint8_t* input)
 {
-	// Check parameter
-	if(!io_data || !input)
+	dis_segment_t segment;
+
+	segment.offset   = (uint64_t) sector_start;
+	segment.physical = (uint64_t) sector_start;
+	segment.size     = nb_write_sector * sector_size;
+
+	return encrypt_write_segments(io_data, &segment, 1, sector_size, input);
+}
+
+
+/**
+ * Encrypt sectors stored in several places on the volume, all at once, and
+ * write them. When there are several places, they're written together through
+ * io_uring if it's available.
+ *
+ * @param io_data The data structure containing volume's information
+ * @param segments Where the sectors are stored, see dis_extents_translate()
+ * @param nb_segments The number of segments, up to DIS_SEGMENTS_MAX
+ * @param sector_size The size of one sector
+ * @param input The sectors of all the segments, one after the other
+ * @return TRUE if result can be trusted, FALSE otherwise
+ */
+int encrypt_write_segments(
+	dis_iodata_t* io_data,
+	const dis_segment_t* segments,
+	size_t nb_segments,
+	uint16_t sector_size,
+	uint8_t* input)
+{
+	// Check parameters
+	if(!io_data || !segments || !input)
 		return FALSE;
 
-	uint8_t* output = malloc(nb_write_sector * sector_size);
+	if(nb_segments == 0 || nb_segments > DIS_SEGMENTS_MAX)
+		return FALSE;
+
+	dis_uring_io_t ios[DIS_SEGMENTS_MAX];
+	size_t   size      = 0;
+	size_t   submitted = 0;
+	size_t   loop      = 0;
+	ssize_t  write_size;
+	int      ret       = TRUE;
+
+	for(loop = 0; loop < nb_segments; ++loop)
+		size += segments[loop].size;
 
-	memset(output , 0, nb_write_sector * sector_size);
+	/* Every sector of the buffer is written by the threads */
+	uint8_t* output = dis_buffer_get(size);
+
+	if(!output)
+		return FALSE;
+
+	/* Let the workers do the job, for all the segments at once */
+	run_threads(
+		io_data,
+		thread_encrypt,
+		size / sector_size,
+		sector_size,
+		(off_t) segments[0].physical,
+		nb_segments > 1 ? segments : NULL,
+		nb_segments,
+		input,
+		output
+	);
 
-	/* Run threads if compiled with */
-#if NB_THREAD > 0
+	memset(ios, 0, sizeof(ios));
+	for(loop = 0, size = 0; loop < nb_segments; ++loop)
 	{
-		/* Threads preparations */
-		pthread_t thread[NB_THREAD];
-		thread_arg_t args[NB_THREAD];
-		unsigned int loop = 0;
+		ios[loop].buffer = output + size;
+		ios[loop].size   = segments[loop].size;
+		ios[loop].offset = (off_t) segments[loop].physical + io_data->part_off;
+		ios[loop].write  = TRUE;
+		size += segments[loop].size;
+	}
+
+	/* What couldn't be submitted is written with pwrite() below */
+	if(nb_segments > 1)
+		submitted = dis_uring_submit(io_data->uring, ios, nb_segments);
+
+	/* Write the sectors we want */
+	for(loop = 0; loop < nb_segments; ++loop)
+	{
+		if(loop < submitted)
+		{
+			dis_uring_wait(io_data->uring, &ios[loop]);
+			write_size = ios[loop].result;
+		}
+		else
+			write_size = pwrite(
+				io_data->volume_fd,
+				ios[loop].buffer,
+				ios[loop].size,
+				ios[loop].offset
+			);
 
-		for(loop = 0; loop < NB_THREAD; ++loop)
+		if(write_size <= 0)
 		{
-			args[loop].nb_loop       = nb_write_sector;
-			args[loop].nb_threads    = NB_THREAD;
-			args[loop].thread_begin  = loop;
-			args[loop].sector_size   = sector_size;
-			args[loop].sector_start  = sector_start;
-			args[loop].input         = input;
-			args[loop].output        = output;
-
-			args[loop].io_data       = io_data;
-
-			pthread_create(
-				&thread[loop],
-				NULL,
-				thread_encrypt,
-				(void*) &args[loop]
+			dis_printf(
+				L_ERROR,
+				"Unable to write %#" F_SIZE_T " bytes to %#" F_OFF_T "\n",
+				ios[loop].size,
+				ios[loop].offset
 			);
+			ret = FALSE;
 		}
+	}
 
-		/* Wait for threads to end */
-		for(loop = 0; loop < NB_THREAD; ++loop)
-			pthread_join(thread[loop], NULL);
+	dis_buffer_put(output);
+
+	/* The W$ 7 backuped sectors may just have been written to */
+	for(loop = 0; loop < nb_segments; ++loop)
+		invalidate_backup_sectors_cache(
+			io_data,
+			(off_t) segments[loop].physical,
+			segments[loop].size
+		);
+
+	return ret;
+}
+
+
+/**
+ * Split a sectors region into one contiguous range per thread, run them
+ * through the io_data's workers and wait for them to end.
+ * A thread done with its own range steals batches of sectors from the range
+ * which has the most remaining, so a thread which got expensive sectors (W$ 7
+ * backup sectors redirection, diffuser) doesn't hold everyone up.
+ *
+ * @param io_data The data structure containing volume's information
+ * @param fn The function each thread runs, thread_decrypt() or thread_encrypt()
+ * @param nb_loop The number of sectors in the region
+ * @param sector_size The size of one sector
+ * @param sector_start The offset of the region's first sector
+ * @param segments Where the region's sectors are stored, NULL if they're
+ * stored contiguously from sector_start
+ * @param nb_segments The number of segments
+ * @param input The buffer to enc/decrypt
+ * @param output The buffer where to put enc/decrypted data, may be the input
+ * one
+ */
+static void run_threads(
+	dis_iodata_t* io_data,
+	dis_workers_fn_t fn,
+	size_t nb_loop,
+	uint16_t sector_size,
+	off_t sector_start,
+	const dis_segment_t* segments,
+	size_t nb_segments,
+	uint8_t* input,
+	uint8_t* output)
+{
+	thread_arg_t  single;
+	thread_arg_t* args       = &single;
+	size_t        nb_threads = io_data->nb_threads;
+	size_t        batch      = dis_crypt_batch_size(io_data->crypt);
+	size_t        loop       = 0;
+
+	if(batch < SECTORS_BATCH_SIZE)
+		batch = SECTORS_BATCH_SIZE;
+	batch /= sector_size;
+	if(batch == 0)
+		batch = 1;
+
+	/* No need for more threads than batches of sectors */
+	if(nb_threads > (nb_loop + batch - 1) / batch)
+		nb_threads = (nb_loop + batch - 1) / batch;
+	if(nb_threads == 0)
+		nb_threads = 1;
+
+	/*
+	 * There may be up to DIS_WORKERS_MAX threads, their parameters are taken
+	 * from the buffers this thread keeps rather than from its stack. Without
+	 * memory for them, the region is done by a single thread.
+	 */
+	if(nb_threads > 1)
+	{
+		args = dis_buffer_get(nb_threads * sizeof(thread_arg_t));
+		if(!args)
+		{
+			args       = &single;
+			nb_threads = 1;
+		}
 	}
-#else
+
+	for(loop = 0; loop < nb_threads; ++loop)
 	{
-		thread_arg_t arg;
-		arg.nb_loop       = nb_write_sector;
-		arg.nb_threads    = 1;
-		arg.thread_begin  = 0;
-		arg.sector_size   = sector_size;
-		arg.sector_start  = sector_start;
-		arg.input         = input;
-		arg.output        = output;
-
-		arg.io_data       = io_data;
-
-		thread_encrypt(&arg);
+		args[loop].next          = nb_loop * loop / nb_threads;
+		args[loop].end           = nb_loop * (loop + 1) / nb_threads;
+		args[loop].batch         = batch;
+		args[loop].nb_threads    = nb_threads;
+		args[loop].ranges        = args;
+		args[loop].sector_size   = sector_size;
+		args[loop].sector_start  = sector_start;
+		args[loop].segments      = segments;
+		args[loop].nb_segments   = nb_segments;
+		args[loop].input         = input;
+		args[loop].output        = output;
+
+		args[loop].io_data       = io_data;
 	}
-#endif
 
-	/* Write the sectors we want */
-	ssize_t write_size = pwrite(
-		io_data->volume_fd,
-		output,
-		nb_write_sector * sector_size,
-		sector_start + io_data->part_off
+	dis_workers_run(
+		io_data->workers,
+		fn,
+		args,
+		sizeof(thread_arg_t),
+		nb_threads
 	);
 
-	free(output);
-	if(write_size <= 0)
+	if(args != &single)
+		dis_buffer_put(args);
+}
+
+
+/**
+ * Read and decrypt sectors the way read_decrypt_sectors() does, with the
+ * request split into reads all in flight at once. Each part is decrypted as
+ * soon as it's read, in the order the reads complete, while the others are
+ * still being read.
+ *
+ * @param io_data The data structure containing volume's information
+ * @param nb_read_sector The number of sectors to read
+ * @param sector_size The size of one sector
+ * @param sector_start The offset of the first sector to read
+ * @param output The output buffer where to put decrypted data
+ * @return TRUE if result can be trusted, FALSE otherwise
+ */
+static int read_decrypt_sectors_uring(
+	dis_iodata_t* io_data,
+	size_t nb_read_sector,
+	uint16_t sector_size,
+	off_t sector_start,
+	uint8_t* output)
+{
+	dis_uring_io_t  ios[URING_MAX_CHUNKS];
+	dis_uring_io_t* pending[URING_MAX_CHUNKS];
+	size_t size        = nb_read_sector * sector_size;
+	off_t  off         = sector_start + io_data->part_off;
+	size_t nb_chunks   = 0;
+	size_t chunk_size  = dis_crypt_batch_size(io_data->crypt);
+	size_t submitted   = 0;
+	size_t nb_pending  = 0;
+	size_t first_short = URING_MAX_CHUNKS;
+	size_t index       = 0;
+	size_t loop        = 0;
+
+	/* Each read is decrypted at once, it has to be a whole batch */
+	if(chunk_size < URING_CHUNK_SIZE)
+		chunk_size = URING_CHUNK_SIZE;
+
+	nb_chunks = size / chunk_size;
+	if(nb_chunks > URING_MAX_CHUNKS)
+		nb_chunks = URING_MAX_CHUNKS;
+	if(nb_chunks == 0)
+		nb_chunks = 1;
+
+	chunk_size = (nb_read_sector + nb_chunks - 1) / nb_chunks * sector_size;
+	nb_chunks  = (size + chunk_size - 1) / chunk_size;
+
+	memset(ios, 0, sizeof(ios));
+	for(loop = 0; loop < nb_chunks; ++loop)
+	{
+		ios[loop].buffer = output + loop * chunk_size;
+		ios[loop].offset = off + (off_t) (loop * chunk_size);
+		ios[loop].size   = chunk_size;
+		if((loop + 1) * chunk_size > size)
+			ios[loop].size = size - loop * chunk_size;
+	}
+
+	/* What couldn't be submitted is read with pread() below */
+	submitted = dis_uring_submit(io_data->uring, ios, nb_chunks);
+	for(nb_pending = 0; nb_pending < submitted; ++nb_pending)
+		pending[nb_pending] = &ios[nb_pending];
+
+	for(loop = 0; loop < nb_chunks; ++loop)
+	{
+		dis_uring_io_t* io = NULL;
+		ssize_t read_size  = 0;
+		size_t  nb_loop    = 0;
+
+		/* Every submitted read has to complete before returning */
+		if(nb_pending > 0)
+		{
+			index = dis_uring_wait_any(io_data->uring, pending, nb_pending);
+			io    = pending[index];
+			pending[index] = pending[--nb_pending];
+			read_size = io->result;
+		}
+		else
+		{
+			io = &ios[loop];
+			read_size = pread(io_data->volume_fd, io->buffer, io->size, io->offset);
+		}
+
+		if(read_size < 0)
+			read_size = 0;
+
+		/* Short reads are completed, as they don't necessarily mean EOF */
+		while(read_size > 0 && (size_t) read_size < io->size)
+		{
+			ssize_t more = pread(
+				io_data->volume_fd,
+				io->buffer + read_size,
+				io->size - (size_t) read_size,
+				io->offset + read_size
+			);
+			if(more <= 0)
+				break;
+			read_size += more;
+		}
+
+		io->result = read_size;
+		index      = (size_t) (io - ios);
+
+		if((size_t) read_size < io->size && index < first_short)
+			first_short = index;
+
+		nb_loop = (size_t) read_size / sector_size;
+
+		/* What couldn't be read is returned zeroed out */
+		memset(
+			io->buffer + nb_loop * sector_size,
+			0,
+			io->size - nb_loop * sector_size
+		);
+
+		run_threads(
+			io_data,
+			thread_decrypt,
+			nb_loop,
+			sector_size,
+			sector_start + (off_t) (index * chunk_size),
+			NULL,
+			0,
+			io->buffer,
+			io->buffer
+		);
+	}
+
+	if(ios[0].result <= 0)
+	{
+		dis_printf(
+			L_ERROR,
+			"Unable to read %#" F_SIZE_T " bytes from %#" F_OFF_T "\n",
+			size,
+			off
+		);
 		return FALSE;
+	}
+
+	/* Nothing is used past the end of what's readable, as with pread() */
+	for(loop = first_short + 1; loop < nb_chunks; ++loop)
+		memset(ios[loop].buffer, 0, ios[loop].size);
 
 	return TRUE;
 }
 
 
+/**
+ * Take a batch of contiguous sectors to process, from the thread's own range
+ * first, then from the range of another thread which has the most remaining
+ *
+ * @param args The thread's parameters, whose range is looked at first
+ * @param begin The index of the first sector of the batch taken
+ * @param end The index following the last sector of the batch taken
+ * @return TRUE if a batch has been taken, FALSE if every range is done
+ */
+static int claim_sectors(thread_arg_t* args, size_t* begin, size_t* end)
+{
+	thread_arg_t* range  = args;
+	size_t        loop   = 0;
+	size_t        remain = 0;
+	size_t        next   = 0;
+	size_t        most   = 0;
+
+	for(;;)
+	{
+		next = __atomic_fetch_add(&range->next, range->batch, __ATOMIC_RELAXED);
+		if(next < range->end)
+		{
+			*begin = next;
+			*end   = next + range->batch;
+			if(*end > range->end)
+				*end = range->end;
+			return TRUE;
+		}
+
+		/* Our range is done, look for the busiest one */
+		range = NULL;
+		most  = 0;
+		for(loop = 0; loop < args->nb_threads; ++loop)
+		{
+			next   = __atomic_load_n(&args->ranges[loop].next, __ATOMIC_RELAXED);
+			remain = args->ranges[loop].end > next ?
+			         args->ranges[loop].end - next : 0;
+			if(remain > most)
+			{
+				most  = remain;
+				range = &args->ranges[loop];
+			}
+		}
+
+		if(!range)
+			return FALSE;
+	}
+}
+
+
+/**
+ * Find out where a sector of the region a thread works on is stored
+ *
+ * @param args The thread's parameters
+ * @param index The index of the sector in the region
+ * @param nb_next The number of sectors stored contiguously from this one, in
+ * the region
+ * @return The offset of the sector, -1 if it's past the region's end
+ */
+static off_t sector_location(thread_arg_t* args, size_t index, size_t* nb_next)
+{
+	size_t loop  = 0;
+	size_t count = 0;
+
+	if(!args->segments)
+	{
+		*nb_next = SIZE_MAX;
+		return args->sector_start + args->sector_size * (off_t) index;
+	}
+
+	for(loop = 0; loop < args->nb_segments; ++loop)
+	{
+		count = args->segments[loop].size / args->sector_size;
+		if(index < count)
+		{
+			*nb_next = count - index;
+			return (off_t) args->segments[loop].physical +
+			       args->sector_size * (off_t) index;
+		}
+		index -= count;
+	}
+
+	*nb_next = 0;
+	return -1;
+}
+
+
 /**
  * Decrypt a sector region according to one or more thread
  *
@@ -302,111 +739,115 @@ static void* thread_decrypt(void* params)
 	thread_arg_t* args    = (thread_arg_t*) params;
 	dis_iodata_t* io_data = args->io_data;
 
-	off_t    loop         = args->thread_begin;
-	uint16_t step_unit    = args->nb_threads;
+	size_t   begin        = 0;
+	size_t   end          = 0;
+	size_t   loop         = 0;
+	size_t   run          = 0;
+	size_t   sector       = 0;
 
-	int      hover        = 0;
-	uint16_t version      = dis_metadata_information_version(io_data->metadata);
 	uint16_t sector_size  = args->sector_size;
-	uint16_t step_size    = (uint16_t) (sector_size * step_unit);
+	const dis_extent_t* extent = NULL;
 
-	off_t    offset       = args->sector_start + sector_size * loop;
-	uint8_t* loop_input   = args->input + sector_size * loop;
-	uint8_t* loop_output  = args->output + sector_size * loop;
+	off_t    offset       = 0;
+	uint8_t* loop_input   = NULL;
+	uint8_t* loop_output  = NULL;
 
 
-	for( ; loop < (off_t)args->nb_loop;
-	       loop        += step_unit,
-	       offset      += step_size,
-	       loop_input  += step_size,
-	       loop_output += step_size)
+	while(claim_sectors(args, &begin, &end))
 	{
-		/*
-		 * For BitLocker-encrypted volume with W$ 7/8:
-		 *   - Don't decrypt the firsts sectors whatever might be the case, they
-		 *   are saved elsewhere anyway.
-		 * For these encrypted with W$ Vista:
-		 *   - Change the first sector.
-		 * For both of them:
-		 *   - Zero out the metadata area returned to the user (not the one on
-		 *   the disk, obviously).
-		 *   - Don't decrypt sectors if we're outside the encrypted-volume's
-		 *   size (but still in the volume's size obv). This is needed when the
-		 *   encryption was paused during BitLocker's turn on.
-		 */
-
-		off_t sector_offset = args->sector_start / sector_size + loop;
-
-		/* Check for zero out areas */
-		hover = dis_metadata_is_overwritten(
-			io_data->metadata,
-			offset,
-			sector_size);
-		if(hover == DIS_RET_ERROR_METADATA_FILE_OVERWRITE)
-		{
-			memset(loop_output, 0, sector_size);
-			continue;
-		}
-
-
-		/* Check for sectors fixing and non-encrypted sectors */
-		if(version == V_SEVEN &&
-		   (uint64_t)sector_offset < io_data->nb_backup_sectors)
-		{
-			/*
-			 * The firsts sectors are encrypted in a different place on a
-			 * Windows 7 volume
-			 */
-			fix_read_sector_seven(
-				io_data,
-				offset,
-				loop_input,
-				loop_output
-			);
-		}
-		else if(version == V_SEVEN &&
-		       (uint64_t)offset >= io_data->encrypted_volume_size)
-		{
-			/* Do not decrypt when there's nothing to */
-			dis_printf(L_DEBUG,
-				"  > Copying sector from 0x%" F_OFF_T
-				" (%" F_SIZE_T " bytes)\n",
-				offset, sector_size
-			);
-			memcpy(loop_output, loop_input, sector_size);
-		}
-		else if(version == V_VISTA && sector_offset < 16)
+		for(loop = begin; loop < end; loop += run)
 		{
 			/*
-			 * The firsts sectors are not really encrypted on a Vista volume
+			 * Deal with the whole run of sectors which are in the same extent, see
+			 * dis_extents_new() for how the volume is split:
+			 * For BitLocker-encrypted volume with W$ 7/8:
+			 *   - Don't decrypt the firsts sectors whatever might be the case, they
+			 *   are saved elsewhere anyway.
+			 * For these encrypted with W$ Vista:
+			 *   - Change the first sector.
+			 * For both of them:
+			 *   - Zero out the metadata area returned to the user (not the one on
+			 *   the disk, obviously).
+			 *   - Don't decrypt sectors if we're outside the encrypted-volume's
+			 *   size (but still in the volume's size obv). This is needed when the
+			 *   encryption was paused during BitLocker's turn on.
 			 */
-			if(sector_offset < 1)
-				fix_read_sector_vista(
-					io_data,
-					loop_input,
-					loop_output
-				);
-			else
+			offset      = args->sector_start + sector_size * (off_t) loop;
+			loop_input  = args->input + sector_size * loop;
+			loop_output = args->output + sector_size * loop;
+
+			extent = dis_extents_lookup(io_data->extents, (uint64_t) offset);
+			if(!extent)
 			{
-				dis_printf(L_DEBUG,
-					"  > Copying sector from 0x%" F_OFF_T
-					" (%" F_SIZE_T " bytes)\n",
-					offset, sector_size
-				);
-				memcpy(loop_output, loop_input, sector_size);
+				dis_printf(L_CRITICAL, "No extent for sector %#" F_OFF_T "\n",
+				           offset);
+				return args->output;
+			}
+
+			run = end - loop;
+			if((extent->end - (uint64_t) offset) / sector_size < run)
+				run = (size_t) ((extent->end - (uint64_t) offset) / sector_size);
+
+			switch(extent->type)
+			{
+				case DIS_EXTENT_ZERO:
+					memset(loop_output, 0, run * sector_size);
+					break;
+
+				case DIS_EXTENT_BACKUP:
+					/*
+					 * The firsts sectors are encrypted in a different place on a
+					 * Windows 7 volume
+					 */
+					fix_read_sectors_seven(
+						io_data,
+						offset,
+						(off_t) (extent->physical +
+						         ((uint64_t) offset - extent->start)),
+						run,
+						loop_input,
+						loop_output
+					);
+					break;
+
+				case DIS_EXTENT_PLAIN:
+					/* Do not decrypt when there's nothing to */
+					dis_printf(L_DEBUG,
+						"  > Copying sectors from 0x%" F_OFF_T
+						" (%" F_SIZE_T " bytes)\n",
+						offset, run * sector_size
+					);
+					if(loop_output != loop_input)
+						memcpy(loop_output, loop_input, run * sector_size);
+					break;
+
+				case DIS_EXTENT_VISTA_VBR:
+					/*
+					 * The first sector is not really encrypted on a Vista volume
+					 */
+					for(sector = 0; sector < run; sector++)
+						fix_read_sector_vista(
+							io_data,
+							loop_input + sector_size * sector,
+							loop_output + sector_size * sector
+						);
+					break;
+
+				default:
+					/* Decrypt the whole run at once */
+					if(!dis_crypt_decrypt_sectors(
+						io_data->crypt,
+						run,
+						offset,
+						loop_input,
+						loop_output
+					))
+						dis_printf(L_CRITICAL, "Decryption of sectors %#"
+						           F_OFF_T " to %#" F_OFF_T " failed!\n",
+						           offset,
+						           offset + sector_size * (off_t) (run - 1));
+					break;
 			}
-		}
-		else
-		{
-			/* Decrypt the sector */
-			if(!decrypt_sector(
-				io_data->crypt,
-				loop_input,
-				offset,
-				loop_output
-			))
-				dis_printf(L_CRITICAL, "Decryption of sector %#" F_OFF_T
-				                    " failed!\n", offset);
 		}
 	}
 
@@ -427,66 +868,84 @@ static void* thread_encrypt(void* params)
 	thread_arg_t* args    = (thread_arg_t*)params;
 	dis_iodata_t* io_data = args->io_data;
 
-	off_t    loop        = args->thread_begin;
-	uint16_t step_unit   = args->nb_threads;
+	size_t   begin       = 0;
+	size_t   end         = 0;
+	size_t   loop        = 0;
+	size_t   run         = 0;
+	size_t   sector      = 0;
 
-	uint16_t version     = dis_metadata_information_version(io_data->metadata);
 	uint16_t sector_size = args->sector_size;
-	uint16_t step_size   = (uint16_t) (sector_size * step_unit);
+	const dis_extent_t* extent = NULL;
 
-	uint8_t* loop_input  = args->input + sector_size * loop;
-	uint8_t* loop_output = args->output + sector_size * loop;
-	off_t    offset      = args->sector_start + sector_size * loop;
+	uint8_t* loop_input  = NULL;
+	uint8_t* loop_output = NULL;
+	off_t    offset      = 0;
 
 
-	for( ; loop < (off_t)args->nb_loop;
-	       loop        += step_unit,
-	       offset      += step_size,
-	       loop_input  += step_size,
-	       loop_output += step_size)
+	while(claim_sectors(args, &begin, &end))
 	{
-		/*
-		 * Just encrypt this sector
-		 * Exception: don't encrypt it if the sector wasn't (as in the
-		 * "BitLocker's-volume-encryption-was-paused case decribed in the
-		 * decryption function above")
-		 */
-
-		off_t sector_offset = args->sector_start / sector_size + loop;
-
-		/*
-		 * NOTE: Seven specificities are dealt with earlier in the process
-		 * see dislocker.c:enlock()
-		 */
-		if(version == V_VISTA && sector_offset < 16)
+		for(loop = begin; loop < end; loop += run)
 		{
 			/*
-			 * The firsts sectors are not really encrypted on a Vista volume
+			 * Just encrypt these sectors
+			 * Exception: don't encrypt them if they weren't (as in the
+			 * "BitLocker's-volume-encryption-was-paused case decribed in the
+			 * decryption function above")
+			 *
+			 * NOTE: Seven specificities are dealt with earlier in the process,
+			 * sectors being encrypted where they're stored, see
+			 * dis_extents_translate()
 			 */
-			if(sector_offset < 1)
-				fix_write_sector_vista(
-					io_data,
-					loop_input,
-					loop_output
-				);
-			else
-				memcpy(loop_output, loop_input, sector_size);
-		}
-		else if(version == V_SEVEN &&
-		       (uint64_t)offset >= io_data->encrypted_volume_size)
-		{
-			memcpy(loop_output, loop_input, sector_size);
-		}
-		else
-		{
-			if(!encrypt_sector(
-				io_data->crypt,
-				loop_input,
-				offset,
-				loop_output
-			))
-				dis_printf(L_CRITICAL, "Encryption of sector %#" F_OFF_T
-				                    " failed!\n", offset);
+			offset      = sector_location(args, loop, &run);
+			loop_input  = args->input + sector_size * loop;
+			loop_output = args->output + sector_size * loop;
+
+			extent = dis_extents_lookup(io_data->write_extents, (uint64_t) offset);
+			if(offset < 0 || !extent)
+			{
+				dis_printf(L_CRITICAL, "No extent for sector %#" F_OFF_T "\n",
+				           offset);
+				return args->input;
+			}
+
+			if(end - loop < run)
+				run = end - loop;
+			if((extent->end - (uint64_t) offset) / sector_size < run)
+				run = (size_t) ((extent->end - (uint64_t) offset) / sector_size);
+
+			switch(extent->type)
+			{
+				case DIS_EXTENT_VISTA_VBR:
+					/*
+					 * The first sector is not really encrypted on a Vista volume
+					 */
+					for(sector = 0; sector < run; sector++)
+						fix_write_sector_vista(
+							io_data,
+							loop_input + sector_size * sector,
+							loop_output + sector_size * sector
+						);
+					break;
+
+				case DIS_EXTENT_PLAIN:
+					memcpy(loop_output, loop_input, run * sector_size);
+					break;
+
+				default:
+					/* The whole run at once, CBC sectors' chains are interleaved */
+					if(!dis_crypt_encrypt_sectors(
+						io_data->crypt,
+						run,
+						offset,
+						loop_input,
+						loop_output
+					))
+						dis_printf(L_CRITICAL, "Encryption of sectors %#"
+						           F_OFF_T " to %#" F_OFF_T " failed!\n",
+						           offset,
+						           offset + sector_size * (off_t) (run - 1));
+					break;
+			}
 		}
 	}
 
@@ -499,70 +958,248 @@ static void* thread_encrypt(void* params)
 
 
 /**
- * "Fix" the firsts sectors of a BitLocker volume encrypted with W$ Seven for
- * read operation
+ * Prepare the cache of the decrypted NTFS sectors backuped, for W$ 7 volumes
+ *
+ * @param io_data The data structure containing volume's information
+ */
+void init_backup_sectors_cache(dis_iodata_t* io_data)
+{
+	size_t size = 0;
+
+	if(!io_data || io_data->backup_cache)
+		return;
+
+	if(dis_metadata_information_version(io_data->metadata) != V_SEVEN)
+		return;
+
+	size = (size_t) io_data->nb_backup_sectors * io_data->sector_size;
+	if(size == 0 || size > BACKUP_CACHE_MAX_SIZE)
+		return;
+
+	if(pthread_mutex_init(&io_data->backup_lock, NULL) != 0)
+	{
+		dis_printf(L_WARNING, "Cannot initialize the backup sectors' mutex\n");
+		return;
+	}
+
+	io_data->backup_cache  = dis_malloc(size);
+	io_data->backup_cached = FALSE;
+}
+
+
+/**
+ * Free the cache of the decrypted NTFS sectors backuped
+ *
+ * @param io_data The data structure containing volume's information
+ */
+void destroy_backup_sectors_cache(dis_iodata_t* io_data)
+{
+	if(!io_data || !io_data->backup_cache)
+		return;
+
+	memclean(
+		io_data->backup_cache,
+		(size_t) io_data->nb_backup_sectors * io_data->sector_size
+	);
+	io_data->backup_cache  = NULL;
+	io_data->backup_cached = FALSE;
+
+	pthread_mutex_destroy(&io_data->backup_lock);
+}
+
+
+/**
+ * Mark the cache of the decrypted NTFS sectors backuped as stale if a write
+ * touched the backup
+ * @warning Has to be called once the write is done
+ *
+ * @param io_data The data structure containing volume's information
+ * @param offset The offset of the write
+ * @param size The size of the write
+ */
+static void invalidate_backup_sectors_cache(
+	dis_iodata_t* io_data,
+	off_t offset,
+	size_t size)
+{
+	uint64_t backup_size = 0;
+
+	if(!io_data->backup_cache)
+		return;
+
+	backup_size = (uint64_t) io_data->nb_backup_sectors * io_data->sector_size;
+
+	if((uint64_t) offset >= io_data->backup_sectors_addr + backup_size ||
+	   (uint64_t) offset + size <= io_data->backup_sectors_addr)
+		return;
+
+	pthread_mutex_lock(&io_data->backup_lock);
+	io_data->backup_cached = FALSE;
+	pthread_mutex_unlock(&io_data->backup_lock);
+}
+
+
+/**
+ * Read and decrypt NTFS sectors backuped, with a single read
  *
  * @param io_data Data needed by the decryption to deal with encrypted data
- * @param sector_address Address of the sector to decrypt
- * @param output The buffer where to put fixed data
+ * @param physical Address where the first sector is backuped, see
+ * dis_extents_translate()
+ * @param nb_sectors Number of sectors to read
+ * @param input The buffer where to read the backuped sectors
+ * @param output The buffer where to put decrypted data, may be the input one
+ * @return TRUE if result can be trusted, FALSE otherwise
  */
-static void fix_read_sector_seven(
+static int read_backup_sectors(
 	dis_iodata_t* io_data,
-	off_t sector_address,
+	off_t physical,
+	size_t nb_sectors,
 	uint8_t* input,
 	uint8_t* output)
 {
-	// Check parameter
-	if(!output)
-		return;
-
-	ssize_t read_size;
+	uint16_t sector_size = io_data->sector_size;
+	size_t   size        = nb_sectors * sector_size;
+	size_t   encrypted   = 0;
+	uint8_t* bounce      = NULL;
+	ssize_t  read_size;
 
 	/*
 	 * NTFS's boot sectors are saved into the field "boot_sectors_backup" into
-	 * metadata's header: the information structure. This field should have been
-	 * reported into the "backup_sectors_addr" field of the dis_iodata_t
-	 * structure.
+	 * metadata's header: the information structure. This field has been
+	 * reported into the extents used to read the volume, which gives the
+	 * physical address here.
 	 * So we can use them here to give a good NTFS partition's beginning.
 	 */
-	off_t from = sector_address;
-	off_t to   = from + (off_t)io_data->backup_sectors_addr;
+	off_t to   = physical;
+	off_t from = to - (off_t)io_data->backup_sectors_addr;
 
-	dis_printf(L_DEBUG, "  Fixing sector (7): from %#" F_OFF_T " to %#" F_OFF_T
-	                 "\n", from, to);
+	dis_printf(L_DEBUG, "  Fixing sectors (7): from %#" F_OFF_T " to %#" F_OFF_T
+	                 " (%#" F_SIZE_T " bytes)\n", from, to, size);
 
-	to += io_data->part_off;
+	/* With direct I/O, the sectors may have to be read into an aligned buffer */
+	if(!DIRECT_IO_ALIGNED(io_data, input))
+	{
+		bounce = dis_buffer_get(size);
+		if(!bounce)
+			return FALSE;
+		input = bounce;
+	}
 
-	/* Read the real sector we need, at the offset we need it */
-	read_size = pread(io_data->volume_fd, input, io_data->sector_size, to);
+	/* Read the real sectors we need, at the offset we need them */
+	read_size = pread(io_data->volume_fd, input, size, to + io_data->part_off);
 
-	if(read_size <= 0)
+	if(read_size < 0 || (size_t) read_size != size)
 	{
 		dis_printf(
 			L_ERROR,
 			"Unable to read %#" F_SIZE_T " bytes from %#" F_OFF_T "\n",
-			io_data->sector_size,
-			to
+			size,
+			to + io_data->part_off
 		);
-		return;
+		dis_buffer_put(bounce);
+		return FALSE;
 	}
 
-	to -= io_data->part_off;
-
-	/* If the sector wasn't yet encrypted, don't decrypt it */
-	if((uint64_t)to >= io_data->encrypted_volume_size)
+	/* Only the sectors before the end of the encrypted part are decrypted */
+	if((uint64_t) to < io_data->encrypted_volume_size)
 	{
-		memcpy(output, input, io_data->sector_size);
+		encrypted = (size_t) (
+			(io_data->encrypted_volume_size - (uint64_t) to + sector_size - 1)
+			/ sector_size
+		);
+		if(encrypted > nb_sectors)
+			encrypted = nb_sectors;
 	}
-	else
+
+	if(encrypted &&
+	   !dis_crypt_decrypt_sectors(io_data->crypt, encrypted, to, input, output))
 	{
-		decrypt_sector(
-			io_data->crypt,
-			input,
-			to,
-			output
+		dis_printf(
+			L_ERROR,
+			"Unable to decrypt %#" F_SIZE_T " backup sectors from %#" F_OFF_T "\n",
+			encrypted,
+			to
 		);
+		dis_buffer_put(bounce);
+		return FALSE;
 	}
+
+	/* The ones after it weren't yet encrypted */
+	if(output != input)
+		memcpy(
+			output + encrypted * sector_size,
+			input + encrypted * sector_size,
+			(nb_sectors - encrypted) * sector_size
+		);
+
+	dis_buffer_put(bounce);
+
+	return TRUE;
+}
+
+
+/**
+ * "Fix" the firsts sectors of a BitLocker volume encrypted with W$ Seven for
+ * read operation
+ * The first time, the whole backup is read and decrypted into the cache, so
+ * next reads are just copies from there.
+ *
+ * @param io_data Data needed by the decryption to deal with encrypted data
+ * @param sector_address Address of the first sector to fix
+ * @param physical Address where this first sector is backuped
+ * @param nb_sectors Number of sectors to fix
+ * @param input A buffer of nb_sectors sectors usable as scratch
+ * @param output The buffer where to put fixed data, may be the input one
+ */
+static void fix_read_sectors_seven(
+	dis_iodata_t* io_data,
+	off_t sector_address,
+	off_t physical,
+	size_t nb_sectors,
+	uint8_t* input,
+	uint8_t* output)
+{
+	// Check parameter
+	if(!input || !output)
+		return;
+
+	size_t   size   = nb_sectors * io_data->sector_size;
+	uint8_t* backup = NULL;
+
+	if(io_data->backup_cache)
+	{
+		pthread_mutex_lock(&io_data->backup_lock);
+
+		if(!io_data->backup_cached)
+		{
+			backup = dis_buffer_get(
+				(size_t) io_data->nb_backup_sectors * io_data->sector_size
+			);
+			if(backup)
+			{
+				io_data->backup_cached = read_backup_sectors(
+					io_data,
+					(off_t) io_data->backup_sectors_addr,
+					io_data->nb_backup_sectors,
+					backup,
+					io_data->backup_cache
+				);
+				dis_buffer_put(backup);
+			}
+		}
+
+		if(io_data->backup_cached)
+		{
+			memcpy(output, io_data->backup_cache + sector_address, size);
+			pthread_mutex_unlock(&io_data->backup_lock);
+			return;
+		}
+
+		pthread_mutex_unlock(&io_data->backup_lock);
+	}
+
+	if(!read_backup_sectors(io_data, physical, nb_sectors, input, output))
+		memset(output, 0, size);
 }
 
 
@@ -584,7 +1221,8 @@ static void fix_read_sector_vista(dis_iodata_t* io_data,
 	/*
 	 * Only two fields need to be changed: the NTFS signature and the MFT mirror
 	 */
-	memcpy(output, input, io_data->sector_size);
+	if(output != input)
+		memcpy(output, input, io_data->sector_size);
 
 	dis_metadata_vista_vbr_fve2ntfs(io_data->metadata, output);
 }
@@ -0,0 +1,543 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dislocker/common.h"
+#include "dislocker/return_values.h"
+#include "dislocker/inouts/uring.h"
+
+
+#ifdef _HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+/**
+ * The rings shared with the kernel, requests are submitted and completions
+ * reaped with the lock held. Only one thread at a time waits in the kernel for
+ * completions, the others wait for it to reap theirs.
+ */
+struct _dis_uring {
+	int             ring_fd;
+
+	/* Submission queue */
+	void*           sq_ring;
+	size_t          sq_ring_size;
+	unsigned int*   sq_head;
+	unsigned int*   sq_tail;
+	unsigned int*   sq_mask;
+	unsigned int*   sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned int    sq_entries;
+
+	/* Completion queue, may share its mapping with the submission queue */
+	void*           cq_ring;
+	size_t          cq_ring_size;
+	unsigned int*   cq_head;
+	unsigned int*   cq_tail;
+	unsigned int*   cq_mask;
+	struct io_uring_cqe* cqes;
+
+	pthread_mutex_t lock;
+	/* Signaled when completions are reaped or when room is made */
+	pthread_cond_t  cond;
+	/* Number of requests submitted and not reaped yet */
+	unsigned int    inflight;
+	/* Whether a thread is waiting in the kernel for completions */
+	int             waiting;
+};
+
+
+
+/** Prototype of functions used internally */
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params* p);
+static int sys_io_uring_enter(
+	int fd,
+	unsigned int to_submit,
+	unsigned int min_complete,
+	unsigned int flags
+);
+static int sys_io_uring_register(
+	int fd,
+	unsigned int opcode,
+	const void* arg,
+	unsigned int nr_args
+);
+static void reap_completions(dis_uring_t uring);
+static void wait_completions(dis_uring_t uring);
+
+
+
+
+/**
+ * Set an io_uring instance up to read from and write to a file, registered as
+ * a fixed file so that it's not looked up for each request. A read is done to
+ * check the kernel supports what's needed.
+ *
+ * @param fd The file descriptor of the volume
+ * @param depth The number of requests which can be in flight
+ * @return The newly created instance, or NULL if io_uring can't be used
+ */
+dis_uring_t dis_uring_new(int fd, unsigned int depth)
+{
+	struct io_uring_params params;
+	dis_uring_t uring = NULL;
+	dis_uring_io_t io;
+
+	if(fd < 0 || depth == 0)
+		return NULL;
+
+	uring = dis_malloc(sizeof(struct _dis_uring));
+	memset(uring, 0, sizeof(struct _dis_uring));
+	memset(&params, 0, sizeof(params));
+
+	uring->ring_fd = sys_io_uring_setup(depth, &params);
+	if(uring->ring_fd < 0)
+	{
+		dis_printf(
+			L_DEBUG,
+			"io_uring unavailable (%s), using pread()\n",
+			strerror(errno)
+		);
+		dis_free(uring);
+		return NULL;
+	}
+
+	uring->sq_entries   = params.sq_entries;
+	uring->sq_ring_size = params.sq_off.array +
+	                      params.sq_entries * sizeof(unsigned int);
+	uring->cq_ring_size = params.cq_off.cqes +
+	                      params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(uring->cq_ring_size > uring->sq_ring_size)
+			uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = 0;
+	}
+
+	uring->sq_ring = mmap(
+		NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING
+	);
+	if(uring->sq_ring == MAP_FAILED)
+	{
+		uring->sq_ring = NULL;
+		goto error;
+	}
+
+	if(uring->cq_ring_size)
+	{
+		uring->cq_ring = mmap(
+			NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING
+		);
+		if(uring->cq_ring == MAP_FAILED)
+		{
+			uring->cq_ring = NULL;
+			goto error;
+		}
+	}
+	else
+		uring->cq_ring = uring->sq_ring;
+
+	uring->sqes = mmap(
+		NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		uring->ring_fd, IORING_OFF_SQES
+	);
+	if(uring->sqes == MAP_FAILED)
+	{
+		uring->sqes = NULL;
+		goto error;
+	}
+
+	uring->sq_head  = (unsigned int*) ((uint8_t*) uring->sq_ring + params.sq_off.head);
+	uring->sq_tail  = (unsigned int*) ((uint8_t*) uring->sq_ring + params.sq_off.tail);
+	uring->sq_mask  = (unsigned int*) ((uint8_t*) uring->sq_ring + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int*) ((uint8_t*) uring->sq_ring + params.sq_off.array);
+	uring->cq_head  = (unsigned int*) ((uint8_t*) uring->cq_ring + params.cq_off.head);
+	uring->cq_tail  = (unsigned int*) ((uint8_t*) uring->cq_ring + params.cq_off.tail);
+	uring->cq_mask  = (unsigned int*) ((uint8_t*) uring->cq_ring + params.cq_off.ring_mask);
+	uring->cqes     = (struct io_uring_cqe*) ((uint8_t*) uring->cq_ring + params.cq_off.cqes);
+
+	if(sys_io_uring_register(uring->ring_fd, IORING_REGISTER_FILES, &fd, 1) < 0)
+		goto error;
+
+	pthread_mutex_init(&uring->lock, NULL);
+	pthread_cond_init(&uring->cond, NULL);
+
+	/*
+	 * Make sure reads are supported before relying on them, with a buffer
+	 * suitable for direct I/O
+	 */
+	memset(&io, 0, sizeof(io));
+	io.size   = DIS_BUFFER_ALIGN;
+	io.buffer = dis_buffer_get(io.size);
+	if(!io.buffer || dis_uring_submit(uring, &io, 1) != 1)
+	{
+		dis_buffer_put(io.buffer);
+		dis_uring_destroy(uring);
+		return NULL;
+	}
+	dis_uring_wait(uring, &io);
+	dis_buffer_put(io.buffer);
+	if(io.result < 0)
+	{
+		dis_printf(
+			L_DEBUG,
+			"io_uring read failed (%s), using pread()\n",
+			strerror((int) -io.result)
+		);
+		dis_uring_destroy(uring);
+		return NULL;
+	}
+
+	dis_printf(L_DEBUG, "Using io_uring with %u entries\n", uring->sq_entries);
+
+	return uring;
+
+error:
+	dis_printf(L_DEBUG, "Cannot set io_uring up (%s), using pread()\n", strerror(errno));
+
+	if(uring->sqes)
+		munmap(uring->sqes, uring->sq_entries * sizeof(struct io_uring_sqe));
+	if(uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	if(uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	close(uring->ring_fd);
+	dis_free(uring);
+
+	return NULL;
+}
+
+
+/**
+ * Queue reads or writes, which are then all in flight at once. When the ring
+ * is full, this waits for room to be made by completions.
+ *
+ * @param uring The io_uring instance to use
+ * @param ios The reads or writes to do
+ * @param nb_ios The number of requests
+ * @return The number of requests submitted, which have to be waited for with
+ * dis_uring_wait(). The others, if any, are to be done by the caller.
+ */
+size_t dis_uring_submit(dis_uring_t uring, dis_uring_io_t* ios, size_t nb_ios)
+{
+	size_t submitted = 0;
+
+	if(!uring || !ios)
+		return 0;
+
+	pthread_mutex_lock(&uring->lock);
+
+	while(submitted < nb_ios)
+	{
+		unsigned int tail   = *uring->sq_tail;
+		unsigned int nb_new = 0;
+		unsigned int left   = 0;
+		int ret = 0;
+
+		/* The completion queue is twice as big, so it can't overflow */
+		while(submitted + nb_new < nb_ios && uring->inflight < uring->sq_entries)
+		{
+			dis_uring_io_t*      io  = &ios[submitted + nb_new];
+			unsigned int         idx = tail & *uring->sq_mask;
+			struct io_uring_sqe* sqe = &uring->sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode    = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->flags     = IOSQE_FIXED_FILE;
+			sqe->fd        = 0;
+			sqe->addr      = (uint64_t) (uintptr_t) io->buffer;
+			sqe->len       = (uint32_t) io->size;
+			sqe->off       = (uint64_t) io->offset;
+			sqe->user_data = (uint64_t) (uintptr_t) io;
+
+			io->done   = FALSE;
+			io->result = 0;
+
+			uring->sq_array[idx] = idx;
+			tail++;
+			nb_new++;
+			uring->inflight++;
+		}
+
+		if(nb_new == 0)
+		{
+			/* The ring is full, wait for room */
+			wait_completions(uring);
+			continue;
+		}
+
+		__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		do
+			ret = sys_io_uring_enter(uring->ring_fd, nb_new, 0, 0);
+		while(ret < 0 && errno == EINTR);
+
+		/* Take back what the kernel didn't consume, if anything */
+		left = tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+		if(ret < 0 || left > 0)
+		{
+			__atomic_store_n(uring->sq_tail, tail - left, __ATOMIC_RELEASE);
+			uring->inflight -= left;
+			submitted += nb_new - left;
+			break;
+		}
+
+		submitted += nb_new;
+	}
+
+	pthread_mutex_unlock(&uring->lock);
+
+	return submitted;
+}
+
+
+/**
+ * Wait for a submitted request to be completed
+ *
+ * @param uring The io_uring instance the request was submitted to
+ * @param io The request to wait for
+ */
+void dis_uring_wait(dis_uring_t uring, dis_uring_io_t* io)
+{
+	if(!uring || !io)
+		return;
+
+	pthread_mutex_lock(&uring->lock);
+
+	while(!__atomic_load_n(&io->done, __ATOMIC_ACQUIRE))
+		wait_completions(uring);
+
+	pthread_mutex_unlock(&uring->lock);
+}
+
+
+/**
+ * Wait for any of several submitted requests to be completed, so that they
+ * can be dealt with in the order they complete
+ *
+ * @param uring The io_uring instance the requests were submitted to
+ * @param ios The requests to wait for
+ * @param nb_ios The number of requests
+ * @return The index, in ios, of a completed request
+ */
+size_t dis_uring_wait_any(dis_uring_t uring, dis_uring_io_t** ios, size_t nb_ios)
+{
+	size_t loop = 0;
+
+	if(!uring || !ios || nb_ios == 0)
+		return 0;
+
+	pthread_mutex_lock(&uring->lock);
+
+	for(;;)
+	{
+		for(loop = 0; loop < nb_ios; ++loop)
+			if(__atomic_load_n(&ios[loop]->done, __ATOMIC_ACQUIRE))
+				break;
+
+		if(loop < nb_ios)
+			break;
+
+		wait_completions(uring);
+	}
+
+	pthread_mutex_unlock(&uring->lock);
+
+	return loop;
+}
+
+
+/**
+ * Release an io_uring instance, which mustn't have requests in flight
+ *
+ * @param uring The io_uring instance to destroy
+ */
+void dis_uring_destroy(dis_uring_t uring)
+{
+	if(!uring)
+		return;
+
+	pthread_cond_destroy(&uring->cond);
+	pthread_mutex_destroy(&uring->lock);
+
+	munmap(uring->sqes, uring->sq_entries * sizeof(struct io_uring_sqe));
+	if(uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	munmap(uring->sq_ring, uring->sq_ring_size);
+	close(uring->ring_fd);
+
+	dis_free(uring);
+}
+
+
+
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_io_uring_enter(
+	int fd,
+	unsigned int to_submit,
+	unsigned int min_complete,
+	unsigned int flags)
+{
+	return (int) syscall(
+		__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0
+	);
+}
+
+
+static int sys_io_uring_register(
+	int fd,
+	unsigned int opcode,
+	const void* arg,
+	unsigned int nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/**
+ * Mark the completed requests as done and wake their submitters up
+ * @warning The io_uring's lock has to be held
+ *
+ * @param uring The io_uring instance to reap completions from
+ */
+static void reap_completions(dis_uring_t uring)
+{
+	unsigned int head = *uring->cq_head;
+	unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if(head == tail)
+		return;
+
+	while(head != tail)
+	{
+		struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+		dis_uring_io_t* io = (dis_uring_io_t*) (uintptr_t) cqe->user_data;
+
+		io->result = cqe->res;
+		__atomic_store_n(&io->done, TRUE, __ATOMIC_RELEASE);
+
+		uring->inflight--;
+		head++;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	pthread_cond_broadcast(&uring->cond);
+}
+
+
+/**
+ * Reap what's completed, or wait for at least one completion. Only one thread
+ * waits in the kernel, the others sleep until it reaped something.
+ * @warning The io_uring's lock has to be held
+ *
+ * @param uring The io_uring instance to wait on
+ */
+static void wait_completions(dis_uring_t uring)
+{
+	unsigned int head = *uring->cq_head;
+
+	reap_completions(uring);
+	if(head != *uring->cq_head)
+		return;
+
+	if(uring->waiting)
+	{
+		pthread_cond_wait(&uring->cond, &uring->lock);
+		return;
+	}
+
+	uring->waiting = TRUE;
+	pthread_mutex_unlock(&uring->lock);
+
+	/* Returns as soon as a completion is there, even if it was already */
+	sys_io_uring_enter(uring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+
+	pthread_mutex_lock(&uring->lock);
+	uring->waiting = FALSE;
+
+	reap_completions(uring);
+	pthread_cond_broadcast(&uring->cond);
+}
+
+
+#else /* _HAVE_IO_URING */
+
+
+dis_uring_t dis_uring_new(int fd, unsigned int depth)
+{
+	(void) fd;
+	(void) depth;
+	return NULL;
+}
+
+
+size_t dis_uring_submit(dis_uring_t uring, dis_uring_io_t* ios, size_t nb_ios)
+{
+	(void) uring;
+	(void) ios;
+	(void) nb_ios;
+	return 0;
+}
+
+
+void dis_uring_wait(dis_uring_t uring, dis_uring_io_t* io)
+{
+	(void) uring;
+	(void) io;
+}
+
+
+size_t dis_uring_wait_any(dis_uring_t uring, dis_uring_io_t** ios, size_t nb_ios)
+{
+	(void) uring;
+	(void) ios;
+	(void) nb_ios;
+	return 0;
+}
+
+
+void dis_uring_destroy(dis_uring_t uring)
+{
+	(void) uring;
+}
+
+
+#endif /* _HAVE_IO_URING */
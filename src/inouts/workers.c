@@ -0,0 +1,434 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dislocker/common.h"
+#include "dislocker/return_values.h"
+#include "dislocker/inouts/workers.h"
+
+
+/**
+ * A job is what one request submits: a function to run on each element of an
+ * arguments' array. Elements are handed out one by one to whoever is free,
+ * being a worker or the submitter itself.
+ */
+typedef struct _dis_workers_job
+{
+	dis_workers_fn_t fn;
+
+	uint8_t* args;
+	size_t   arg_size;
+
+	size_t   nb_tasks;
+	/* Index of the next element to give away */
+	size_t   next_task;
+	/* Number of elements fully processed */
+	size_t   nb_done;
+
+	struct _dis_workers_job* next;
+} dis_workers_job_t;
+
+
+struct _dis_workers {
+	pthread_mutex_t    lock;
+	/* Signaled when a job is queued or when the pool is stopping */
+	pthread_cond_t     work_cond;
+	/* Signaled when a job's last element has been processed */
+	pthread_cond_t     done_cond;
+
+	/* Jobs which still have elements to give away */
+	dis_workers_job_t* head;
+	dis_workers_job_t* tail;
+
+	int                stop;
+
+	unsigned int       nb_threads;
+	pthread_t*         threads;
+};
+
+
+
+/** Prototype of functions used internally */
+static unsigned int get_cgroup_cpu_limit();
+static void* worker_loop(void* params);
+static int claim_task(
+	dis_workers_t workers,
+	dis_workers_job_t* job,
+	size_t* task
+);
+static void finish_task(dis_workers_t workers, dis_workers_job_t* job);
+
+
+
+
+/**
+ * Compute the number of threads to use when the user didn't choose it: one per
+ * online CPU, unless the cgroup we're in has a lower CPU quota
+ *
+ * @return The number of threads to use, at least 1
+ */
+unsigned int dis_workers_default_count()
+{
+	long         nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int count   = 1;
+	unsigned int quota   = 0;
+
+	if(nb_cpus > 0)
+		count = (unsigned int) nb_cpus;
+
+	quota = get_cgroup_cpu_limit();
+	if(quota > 0 && quota < count)
+		count = quota;
+
+	if(count > DIS_WORKERS_MAX)
+		count = DIS_WORKERS_MAX;
+
+	dis_printf(
+		L_DEBUG,
+		"%ld online CPU(s), cgroup CPU limit: %u, using %u thread(s)\n",
+		nb_cpus,
+		quota,
+		count
+	);
+
+	return count;
+}
+
+
+/**
+ * Create a pool of threads waiting for enc/decryption jobs
+ *
+ * @param nb_threads The number of threads to start
+ * @return The newly created pool, or NULL if the threads couldn't be started,
+ * in which case jobs are to be run by the caller itself
+ */
+dis_workers_t dis_workers_new(unsigned int nb_threads)
+{
+	dis_workers_t workers = NULL;
+	unsigned int  loop    = 0;
+
+	if(nb_threads == 0)
+		return NULL;
+
+	if(nb_threads > DIS_WORKERS_MAX)
+		nb_threads = DIS_WORKERS_MAX;
+
+	workers = dis_malloc(sizeof(struct _dis_workers));
+	memset(workers, 0, sizeof(struct _dis_workers));
+
+	if(pthread_mutex_init(&workers->lock, NULL) != 0)
+	{
+		dis_printf(L_ERROR, "Cannot initialize the workers' mutex\n");
+		dis_free(workers);
+		return NULL;
+	}
+	pthread_cond_init(&workers->work_cond, NULL);
+	pthread_cond_init(&workers->done_cond, NULL);
+
+	workers->threads = dis_malloc(nb_threads * sizeof(pthread_t));
+
+	for(loop = 0; loop < nb_threads; ++loop)
+	{
+		if(pthread_create(&workers->threads[loop], NULL, worker_loop, workers) != 0)
+		{
+			dis_printf(
+				L_WARNING,
+				"Cannot start worker thread #%u, running with %u thread(s)\n",
+				loop,
+				loop
+			);
+			break;
+		}
+	}
+
+	workers->nb_threads = loop;
+
+	if(workers->nb_threads == 0)
+	{
+		dis_workers_destroy(workers);
+		return NULL;
+	}
+
+	dis_printf(L_DEBUG, "Started %u worker thread(s)\n", workers->nb_threads);
+
+	return workers;
+}
+
+
+/**
+ * Run a function on each element of an array, in parallel, and wait for all of
+ * them to be processed.
+ * The calling thread takes part in the processing, so this works even without
+ * a pool, in which case everything is run sequentially by the caller.
+ *
+ * @param workers The pool of threads to use, may be NULL
+ * @param fn The function to run on each element
+ * @param args The array of elements
+ * @param arg_size The size of one element of the array
+ * @param nb_tasks The number of elements in the array
+ * @return TRUE if result can be trusted, FALSE otherwise
+ */
+int dis_workers_run(
+	dis_workers_t workers,
+	dis_workers_fn_t fn,
+	void* args,
+	size_t arg_size,
+	size_t nb_tasks)
+{
+	// Check parameters
+	if(!fn || !args)
+		return FALSE;
+
+	dis_workers_job_t job;
+	size_t task = 0;
+
+	if(!workers || nb_tasks <= 1)
+	{
+		for(task = 0; task < nb_tasks; ++task)
+			fn((uint8_t*) args + task * arg_size);
+		return TRUE;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.fn       = fn;
+	job.args     = (uint8_t*) args;
+	job.arg_size = arg_size;
+	job.nb_tasks = nb_tasks;
+
+	pthread_mutex_lock(&workers->lock);
+
+	if(workers->tail)
+		workers->tail->next = &job;
+	else
+		workers->head = &job;
+	workers->tail = &job;
+
+	pthread_cond_broadcast(&workers->work_cond);
+
+	/* Don't just wait, take our share of the job */
+	while(claim_task(workers, &job, &task))
+	{
+		pthread_mutex_unlock(&workers->lock);
+
+		fn(job.args + task * arg_size);
+
+		pthread_mutex_lock(&workers->lock);
+		finish_task(workers, &job);
+	}
+
+	/* Then wait for the workers to complete what they took */
+	while(job.nb_done < job.nb_tasks)
+		pthread_cond_wait(&workers->done_cond, &workers->lock);
+
+	pthread_mutex_unlock(&workers->lock);
+
+	return TRUE;
+}
+
+
+/**
+ * Stop the pool's threads, once queued jobs are completed, and free the pool
+ *
+ * @param workers The pool to destroy
+ */
+void dis_workers_destroy(dis_workers_t workers)
+{
+	unsigned int loop = 0;
+
+	if(!workers)
+		return;
+
+	pthread_mutex_lock(&workers->lock);
+	workers->stop = TRUE;
+	pthread_cond_broadcast(&workers->work_cond);
+	pthread_mutex_unlock(&workers->lock);
+
+	for(loop = 0; loop < workers->nb_threads; ++loop)
+		pthread_join(workers->threads[loop], NULL);
+
+	pthread_cond_destroy(&workers->done_cond);
+	pthread_cond_destroy(&workers->work_cond);
+	pthread_mutex_destroy(&workers->lock);
+
+	dis_free(workers->threads);
+	dis_free(workers);
+}
+
+
+
+
+/**
+ * Get the number of CPUs the cgroup we're in is allowed to use, from the CFS
+ * quota and period (cgroup v2 first, then v1)
+ *
+ * @return The number of CPUs, rounded up, or 0 if there's no limit
+ */
+static unsigned int get_cgroup_cpu_limit()
+{
+	FILE*     file   = NULL;
+	char      max[32] = {0,};
+	long long quota  = -1;
+	long long period = 0;
+
+	file = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if(file)
+	{
+		/* Either "max PERIOD" or "QUOTA PERIOD" */
+		if(fscanf(file, "%31s %lld", max, &period) == 2 &&
+		   strcmp(max, "max") != 0)
+			quota = strtoll(max, NULL, 10);
+		fclose(file);
+	}
+	else
+	{
+		file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+		if(file)
+		{
+			if(fscanf(file, "%lld", &quota) != 1)
+				quota = -1;
+			fclose(file);
+		}
+
+		file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+		if(file)
+		{
+			if(fscanf(file, "%lld", &period) != 1)
+				period = 0;
+			fclose(file);
+		}
+	}
+
+	if(quota <= 0 || period <= 0)
+		return 0;
+
+	return (unsigned int) ((quota + period - 1) / period);
+}
+
+
+/**
+ * Take the next element of a job, removing the job from the queue when its
+ * last element is given away
+ * @warning The pool's lock has to be held
+ *
+ * @param workers The pool the job is queued in
+ * @param job The job to take an element from
+ * @param task The index of the element taken
+ * @return TRUE if an element has been taken, FALSE if none was remaining
+ */
+static int claim_task(
+	dis_workers_t workers,
+	dis_workers_job_t* job,
+	size_t* task)
+{
+	dis_workers_job_t* prev = NULL;
+	dis_workers_job_t* curr = NULL;
+
+	if(job->next_task >= job->nb_tasks)
+		return FALSE;
+
+	*task = job->next_task++;
+
+	if(job->next_task < job->nb_tasks)
+		return TRUE;
+
+	/*
+	 * The submitter may be claiming the last element of a job which isn't at
+	 * the head of the queue
+	 */
+	for(curr = workers->head; curr && curr != job; curr = curr->next)
+		prev = curr;
+
+	if(!curr)
+		return TRUE;
+
+	if(prev)
+		prev->next = job->next;
+	else
+		workers->head = job->next;
+
+	if(workers->tail == job)
+		workers->tail = prev;
+
+	job->next = NULL;
+
+	return TRUE;
+}
+
+
+/**
+ * Account for an element processed, waking the submitter up if it was the last
+ * one
+ * @warning The pool's lock has to be held
+ *
+ * @param workers The pool the job was queued in
+ * @param job The job the element belongs to
+ */
+static void finish_task(dis_workers_t workers, dis_workers_job_t* job)
+{
+	job->nb_done++;
+
+	if(job->nb_done == job->nb_tasks)
+		pthread_cond_broadcast(&workers->done_cond);
+}
+
+
+/**
+ * Main loop of a worker: process elements of the queued jobs until the pool is
+ * stopped
+ *
+ * @param params The pool the worker belongs to
+ */
+static void* worker_loop(void* params)
+{
+	dis_workers_t      workers = (dis_workers_t) params;
+	dis_workers_job_t* job     = NULL;
+	size_t             task    = 0;
+
+	pthread_mutex_lock(&workers->lock);
+
+	for(;;)
+	{
+		while(!workers->head && !workers->stop)
+			pthread_cond_wait(&workers->work_cond, &workers->lock);
+
+		if(!workers->head)
+			break;
+
+		job = workers->head;
+		claim_task(workers, job, &task);
+
+		pthread_mutex_unlock(&workers->lock);
+
+		job->fn(job->args + task * job->arg_size);
+
+		pthread_mutex_lock(&workers->lock);
+		finish_task(workers, job);
+	}
+
+	pthread_mutex_unlock(&workers->lock);
+
+	return NULL;
+}
@@ -0,0 +1,584 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "dislocker/common.h"
+#include "dislocker/return_values.h"
+#include "dislocker/inouts/writeback.h"
+
+
+/**
+ * A contiguous range of dirty data, its buffer being bigger than the data for
+ * following writes to be appended in place
+ */
+typedef struct _dis_writeback_range {
+	off_t    start;
+	size_t   size;
+	size_t   max_size;
+	uint8_t* data;
+} dis_writeback_range_t;
+
+
+/**
+ * Dirty ranges are kept sorted and never overlapping nor adjacent. They're
+ * modified with the lock held for writing, readers hold it for reading for the
+ * whole time they read the volume and overlay the dirty data, so that a flush
+ * can't happen in between.
+ */
+struct _dis_writeback {
+	pthread_rwlock_t lock;
+
+	dis_writeback_range_t* ranges;
+	size_t           nb_ranges;
+	size_t           max_ranges;
+
+	/* Number of dirty bytes and the limit over which they're flushed */
+	size_t           dirty;
+	size_t           max_size;
+	/* When the oldest dirty data was written, in milliseconds */
+	uint64_t         dirty_since;
+
+	dis_writeback_fn_t write_fn;
+	void*            write_arg;
+
+	/* Thread flushing data getting too old */
+	pthread_t        thread;
+	pthread_mutex_t  thread_lock;
+	pthread_cond_t   thread_cond;
+	int              stop;
+
+	uint64_t         nb_writes;
+	uint64_t         nb_flushed;
+	uint64_t         bytes_flushed;
+};
+
+
+
+/** Prototype of functions used internally */
+static uint64_t now_ms();
+static void insert_range(
+	dis_writeback_t writeback,
+	const uint8_t* buffer,
+	off_t offset,
+	size_t size
+);
+static void grow_range(
+	dis_writeback_range_t* range,
+	off_t start,
+	size_t size
+);
+static int flush_ranges(dis_writeback_t writeback);
+static void* flusher_loop(void* params);
+
+
+
+
+/**
+ * Create a write-back buffer, flushed when it holds too much data, when data
+ * is too old, or on demand
+ *
+ * @param max_size The number of dirty bytes over which they're flushed
+ * @param write_fn The function used to write the data to the volume
+ * @param write_arg The first argument given to write_fn
+ * @return The newly created buffer, or NULL if it couldn't be started
+ */
+dis_writeback_t dis_writeback_new(
+	size_t max_size,
+	dis_writeback_fn_t write_fn,
+	void* write_arg)
+{
+	dis_writeback_t writeback = NULL;
+
+	if(max_size == 0 || !write_fn)
+		return NULL;
+
+	writeback = dis_malloc(sizeof(struct _dis_writeback));
+	memset(writeback, 0, sizeof(struct _dis_writeback));
+
+	writeback->max_size  = max_size;
+	writeback->write_fn  = write_fn;
+	writeback->write_arg = write_arg;
+
+	if(pthread_rwlock_init(&writeback->lock, NULL) != 0)
+	{
+		dis_printf(L_ERROR, "Cannot initialize the write-back's lock\n");
+		dis_free(writeback);
+		return NULL;
+	}
+	pthread_mutex_init(&writeback->thread_lock, NULL);
+	pthread_cond_init(&writeback->thread_cond, NULL);
+
+	if(pthread_create(&writeback->thread, NULL, flusher_loop, writeback) != 0)
+	{
+		dis_printf(L_WARNING, "Cannot start the write-back's thread\n");
+		pthread_cond_destroy(&writeback->thread_cond);
+		pthread_mutex_destroy(&writeback->thread_lock);
+		pthread_rwlock_destroy(&writeback->lock);
+		dis_free(writeback);
+		return NULL;
+	}
+
+	return writeback;
+}
+
+
+/**
+ * Keep data to be written, flushing everything if there's too much.
+ * Once taken, data which can't be flushed stays dirty and the error is
+ * reported by dis_writeback_flush(). Data is only refused when a failed flush
+ * left too much dirty data, which still can't be flushed.
+ *
+ * @param writeback The write-back buffer
+ * @param buffer The data to write
+ * @param offset Where to write the data on the volume
+ * @param size The size of the data
+ * @return The number of bytes taken, or a negative errno
+ */
+int dis_writeback_write(
+	dis_writeback_t writeback,
+	const uint8_t* buffer,
+	off_t offset,
+	size_t size)
+{
+	int ret = 0;
+
+	if(!writeback || !buffer)
+		return -EINVAL;
+
+	if(size == 0)
+		return 0;
+
+	pthread_rwlock_wrlock(&writeback->lock);
+
+	if(writeback->dirty >= writeback->max_size)
+		ret = flush_ranges(writeback);
+
+	if(ret == 0)
+	{
+		insert_range(writeback, buffer, offset, size);
+
+		if(writeback->dirty >= writeback->max_size &&
+		   flush_ranges(writeback) < 0)
+			dis_printf(
+				L_WARNING,
+				"Cannot flush the write-back buffer, %#" F_SIZE_T " bytes "
+				"are kept\n",
+				writeback->dirty
+			);
+	}
+
+	pthread_rwlock_unlock(&writeback->lock);
+
+	if(ret < 0)
+		return ret;
+
+	return (int) size;
+}
+
+
+/**
+ * Prevent the data from being flushed while the volume is read, before calling
+ * dis_writeback_read_end()
+ *
+ * @param writeback The write-back buffer, may be NULL
+ */
+void dis_writeback_read_begin(dis_writeback_t writeback)
+{
+	if(writeback)
+		pthread_rwlock_rdlock(&writeback->lock);
+}
+
+
+/**
+ * Put the dirty data over what's been read from the volume
+ *
+ * @param writeback The write-back buffer, may be NULL
+ * @param buffer The data read
+ * @param offset Where the data has been read from
+ * @param size The size of the data read
+ */
+void dis_writeback_read_end(
+	dis_writeback_t writeback,
+	uint8_t* buffer,
+	off_t offset,
+	size_t size)
+{
+	if(!writeback)
+		return;
+
+	off_t  end  = offset + (off_t) size;
+	size_t loop = 0;
+
+	for(loop = 0; loop < writeback->nb_ranges; ++loop)
+	{
+		dis_writeback_range_t* range = &writeback->ranges[loop];
+		off_t range_end = range->start + (off_t) range->size;
+		off_t from      = range->start > offset ? range->start : offset;
+		off_t to        = range_end < end ? range_end : end;
+
+		if(range->start >= end)
+			break;
+
+		if(from < to)
+			memcpy(
+				buffer + (from - offset),
+				range->data + (from - range->start),
+				(size_t) (to - from)
+			);
+	}
+
+	pthread_rwlock_unlock(&writeback->lock);
+}
+
+
+/**
+ * Write every dirty data to the volume
+ *
+ * @param writeback The write-back buffer, may be NULL
+ * @return 0 if everything has been written, a negative errno otherwise
+ */
+int dis_writeback_flush(dis_writeback_t writeback)
+{
+	int ret = 0;
+
+	if(!writeback)
+		return 0;
+
+	pthread_rwlock_wrlock(&writeback->lock);
+	ret = flush_ranges(writeback);
+	pthread_rwlock_unlock(&writeback->lock);
+
+	return ret;
+}
+
+
+/**
+ * Stop the write-back's thread, flush what's dirty and free everything
+ *
+ * @param writeback The write-back buffer to destroy
+ */
+void dis_writeback_destroy(dis_writeback_t writeback)
+{
+	size_t loop = 0;
+
+	if(!writeback)
+		return;
+
+	pthread_mutex_lock(&writeback->thread_lock);
+	writeback->stop = TRUE;
+	pthread_cond_signal(&writeback->thread_cond);
+	pthread_mutex_unlock(&writeback->thread_lock);
+
+	pthread_join(writeback->thread, NULL);
+
+	if(dis_writeback_flush(writeback) < 0)
+		dis_printf(
+			L_ERROR,
+			"Cannot write %#" F_SIZE_T " bytes kept in the write-back buffer\n",
+			writeback->dirty
+		);
+
+	dis_printf(
+		L_DEBUG,
+		"Write-back: %" PRIu64 " write(s) merged into %" PRIu64 " flushed "
+		"range(s), %" PRIu64 " bytes\n",
+		writeback->nb_writes,
+		writeback->nb_flushed,
+		writeback->bytes_flushed
+	);
+
+	for(loop = 0; loop < writeback->nb_ranges; ++loop)
+		dis_free(writeback->ranges[loop].data);
+	dis_free(writeback->ranges);
+
+	pthread_cond_destroy(&writeback->thread_cond);
+	pthread_mutex_destroy(&writeback->thread_lock);
+	pthread_rwlock_destroy(&writeback->lock);
+
+	dis_free(writeback);
+}
+
+
+
+
+/**
+ * Get a monotonic time
+ *
+ * @return The time, in milliseconds
+ */
+static uint64_t now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * Add data to the dirty ranges, merging it with the ranges it overlaps or
+ * touches. These are merged into the first of them, which is extended in
+ * place, so that sequential writes don't copy the data they're appended to.
+ * @warning The write-back's lock has to be held for writing
+ *
+ * @param writeback The write-back buffer
+ * @param buffer The data to add
+ * @param offset Where the data goes on the volume
+ * @param size The size of the data
+ */
+static void insert_range(
+	dis_writeback_t writeback,
+	const uint8_t* buffer,
+	off_t offset,
+	size_t size)
+{
+	dis_writeback_range_t* merged = NULL;
+	off_t  start = offset;
+	off_t  end   = offset + (off_t) size;
+	size_t first = 0;
+	size_t last  = 0;
+	size_t loop  = 0;
+
+	/* Ranges before the new one, not even touching it */
+	while(first < writeback->nb_ranges &&
+	      writeback->ranges[first].start + (off_t) writeback->ranges[first].size < offset)
+		first++;
+
+	/* Ranges overlapping or touching the new one are [first, last) */
+	last = first;
+	while(last < writeback->nb_ranges && writeback->ranges[last].start <= end)
+		last++;
+
+	if(writeback->dirty == 0)
+		writeback->dirty_since = now_ms();
+	writeback->nb_writes++;
+
+	if(first == last)
+	{
+		/* A new range, the array of ranges growing by doubling */
+		if(writeback->max_ranges == writeback->nb_ranges)
+		{
+			size_t max_ranges = writeback->max_ranges ? writeback->max_ranges * 2 : 16;
+			dis_writeback_range_t* ranges = dis_malloc(
+				max_ranges * sizeof(dis_writeback_range_t)
+			);
+
+			if(writeback->ranges)
+			{
+				memcpy(
+					ranges,
+					writeback->ranges,
+					writeback->nb_ranges * sizeof(dis_writeback_range_t)
+				);
+				dis_free(writeback->ranges);
+			}
+			writeback->ranges     = ranges;
+			writeback->max_ranges = max_ranges;
+		}
+
+		memmove(
+			&writeback->ranges[first + 1],
+			&writeback->ranges[first],
+			(writeback->nb_ranges - first) * sizeof(dis_writeback_range_t)
+		);
+		writeback->nb_ranges++;
+
+		merged = &writeback->ranges[first];
+		merged->start    = offset;
+		merged->size     = size;
+		merged->max_size = size;
+		merged->data     = dis_malloc(size);
+		memcpy(merged->data, buffer, size);
+
+		writeback->dirty += size;
+		return;
+	}
+
+	merged = &writeback->ranges[first];
+	if(merged->start < start)
+		start = merged->start;
+	if(writeback->ranges[last - 1].start + (off_t) writeback->ranges[last - 1].size > end)
+		end = writeback->ranges[last - 1].start + (off_t) writeback->ranges[last - 1].size;
+
+	writeback->dirty -= merged->size;
+	grow_range(merged, start, (size_t) (end - start));
+
+	/* Old data of the following ranges, then the new one over it */
+	for(loop = first + 1; loop < last; ++loop)
+	{
+		dis_writeback_range_t* range = &writeback->ranges[loop];
+
+		memcpy(merged->data + (range->start - start), range->data, range->size);
+		writeback->dirty -= range->size;
+		dis_free(range->data);
+	}
+	memcpy(merged->data + (offset - start), buffer, size);
+	writeback->dirty += merged->size;
+
+	/* Remove the ranges merged into the first one */
+	if(last - first > 1)
+	{
+		memmove(
+			&writeback->ranges[first + 1],
+			&writeback->ranges[last],
+			(writeback->nb_ranges - last) * sizeof(dis_writeback_range_t)
+		);
+		writeback->nb_ranges -= last - first - 1;
+	}
+}
+
+
+/**
+ * Extend a range to new bounds, keeping its data. Its buffer is reallocated
+ * twice as big as needed when it's too small, so that appending to the range
+ * is done in place most of the time.
+ *
+ * @param range The range to extend
+ * @param start The range's new start, at most its current one
+ * @param size The range's new size, covering its current data
+ */
+static void grow_range(
+	dis_writeback_range_t* range,
+	off_t start,
+	size_t size)
+{
+	size_t   shift = (size_t) (range->start - start);
+	uint8_t* data  = range->data;
+
+	if(size > range->max_size)
+	{
+		range->max_size = size > range->max_size * 2 ? size : range->max_size * 2;
+		data = dis_malloc(range->max_size);
+		memcpy(data + shift, range->data, range->size);
+		dis_free(range->data);
+	}
+	else if(shift)
+		memmove(data + shift, data, range->size);
+
+	range->start = start;
+	range->size  = size;
+	range->data  = data;
+}
+
+
+/**
+ * Write the dirty ranges to the volume, one write per range. Ranges which
+ * couldn't be written are kept dirty.
+ * @warning The write-back's lock has to be held for writing
+ *
+ * @param writeback The write-back buffer
+ * @return 0 if everything has been written, a negative errno otherwise
+ */
+static int flush_ranges(dis_writeback_t writeback)
+{
+	size_t loop = 0;
+	size_t kept = 0;
+	int    ret  = 0;
+
+	for(loop = 0; loop < writeback->nb_ranges; ++loop)
+	{
+		dis_writeback_range_t* range = &writeback->ranges[loop];
+		int written = writeback->write_fn(
+			writeback->write_arg,
+			range->data,
+			range->start,
+			range->size
+		);
+
+		if(written < 0)
+		{
+			ret = written;
+			writeback->ranges[kept++] = *range;
+			continue;
+		}
+
+		writeback->dirty -= range->size;
+		writeback->nb_flushed++;
+		writeback->bytes_flushed += range->size;
+		dis_free(range->data);
+	}
+
+	writeback->nb_ranges = kept;
+	if(kept)
+		writeback->dirty_since = now_ms();
+
+	return ret;
+}
+
+
+/**
+ * Main loop of the write-back's thread: flush the dirty data once it's old
+ * enough, until the write-back is destroyed
+ *
+ * @param params The write-back buffer
+ */
+static void* flusher_loop(void* params)
+{
+	dis_writeback_t writeback = (dis_writeback_t) params;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&writeback->thread_lock);
+
+	while(!writeback->stop)
+	{
+		uint64_t since = 0;
+		size_t   dirty = 0;
+
+		/* Wake up twice per period, sleeping isn't precise anyway */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (DIS_WRITEBACK_MAX_AGE / 2) * 1000000L;
+		deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		pthread_cond_timedwait(
+			&writeback->thread_cond,
+			&writeback->thread_lock,
+			&deadline
+		);
+		if(writeback->stop)
+			break;
+
+		pthread_rwlock_rdlock(&writeback->lock);
+		dirty = writeback->dirty;
+		since = writeback->dirty_since;
+		pthread_rwlock_unlock(&writeback->lock);
+
+		if(dirty && now_ms() - since >= DIS_WRITEBACK_MAX_AGE)
+		{
+			pthread_mutex_unlock(&writeback->thread_lock);
+			if(dis_writeback_flush(writeback) < 0)
+				dis_printf(L_ERROR, "Cannot flush the write-back buffer\n");
+			pthread_mutex_lock(&writeback->thread_lock);
+		}
+	}
+
+	pthread_mutex_unlock(&writeback->thread_lock);
+
+	return NULL;
+}
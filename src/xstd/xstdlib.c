@@ -22,10 +22,45 @@
  */
 
 
+#include <pthread.h>
+
+#include "dislocker/common.h"
 #include "dislocker/xstd/xstdlib.h"
 #include "dislocker/xstd/xstdio.h"
 
 
+/* Number of buffers a thread keeps around */
+#define DIS_BUFFER_SLOTS 4
+
+
+/**
+ * Buffers kept by a thread, reused from one request to the other
+ */
+typedef struct _dis_buffers {
+	struct {
+		void*  buffer;
+		size_t size;
+		int    in_use;
+	} slots[DIS_BUFFER_SLOTS];
+
+	/* Sum of the slots' sizes, capped by DIS_BUFFER_MAX_KEPT */
+	size_t kept;
+} dis_buffers_t;
+
+
+static dis_alloc_stats_t stats = {0,};
+
+static pthread_key_t  buffers_key;
+static pthread_once_t buffers_once = PTHREAD_ONCE_INIT;
+
+
+
+/** Prototype of functions used internally */
+static void buffers_key_init();
+static void buffers_free(void* params);
+
+
+
 
 /**
  * malloc wrapper
@@ -50,6 +85,8 @@ void* dis_malloc(size_t size)
 		exit(2);
 	}
 
+	__atomic_add_fetch(&stats.nb_malloc, 1, __ATOMIC_RELAXED);
+
 	return p;
 }
 
@@ -63,7 +100,182 @@ void dis_free(void *pointer)
 {
 	dis_printf(L_DEBUG, "Freeing pointer at address %p\n", pointer);
 
+	if(pointer)
+		__atomic_add_fetch(&stats.nb_free, 1, __ATOMIC_RELAXED);
+
 	free(pointer);
 }
 
 
+/**
+ * Get a page-aligned buffer from the ones the calling thread keeps, allocating
+ * one if none is big enough. It has to be given back with dis_buffer_put(), by
+ * the same thread.
+ * Unlike dis_malloc(), this doesn't abort when no memory is available.
+ *
+ * @param size The size needed
+ * @return The buffer, uninitialized, or NULL if it couldn't be allocated
+ */
+void* dis_buffer_get(size_t size)
+{
+	dis_buffers_t* buffers = NULL;
+	void*  buffer = NULL;
+	size_t loop   = 0;
+	size_t best   = DIS_BUFFER_SLOTS;
+	size_t spare  = DIS_BUFFER_SLOTS;
+
+	if(size == 0)
+		return NULL;
+
+	pthread_once(&buffers_once, buffers_key_init);
+
+	buffers = pthread_getspecific(buffers_key);
+	if(!buffers)
+	{
+		buffers = calloc(1, sizeof(dis_buffers_t));
+		if(buffers)
+			pthread_setspecific(buffers_key, buffers);
+	}
+
+	if(buffers)
+	{
+		/* Take the smallest free buffer big enough, if any */
+		for(loop = 0; loop < DIS_BUFFER_SLOTS; ++loop)
+		{
+			if(buffers->slots[loop].in_use)
+				continue;
+
+			if(buffers->slots[loop].size >= size &&
+			   (best == DIS_BUFFER_SLOTS ||
+			    buffers->slots[loop].size < buffers->slots[best].size))
+				best = loop;
+			else if(spare == DIS_BUFFER_SLOTS ||
+			        buffers->slots[loop].size < buffers->slots[spare].size)
+				spare = loop;
+		}
+
+		if(best != DIS_BUFFER_SLOTS)
+		{
+			buffers->slots[best].in_use = TRUE;
+			__atomic_add_fetch(&stats.nb_buffer_reused, 1, __ATOMIC_RELAXED);
+			return buffers->slots[best].buffer;
+		}
+	}
+
+	size = (size + DIS_BUFFER_ALIGN - 1) / DIS_BUFFER_ALIGN * DIS_BUFFER_ALIGN;
+	if(posix_memalign(&buffer, DIS_BUFFER_ALIGN, size) != 0)
+		return NULL;
+
+	__atomic_add_fetch(&stats.nb_buffer_allocated, 1, __ATOMIC_RELAXED);
+
+	/* Keep it for next time, in place of a smaller one, if under the cap */
+	if(buffers && spare != DIS_BUFFER_SLOTS &&
+	   buffers->kept - buffers->slots[spare].size + size <= DIS_BUFFER_MAX_KEPT)
+	{
+		buffers->kept -= buffers->slots[spare].size;
+		free(buffers->slots[spare].buffer);
+
+		buffers->slots[spare].buffer = buffer;
+		buffers->slots[spare].size   = size;
+		buffers->slots[spare].in_use = TRUE;
+		buffers->kept += size;
+	}
+
+	return buffer;
+}
+
+
+/**
+ * Give back a buffer obtained with dis_buffer_get()
+ *
+ * @param buffer The buffer
+ */
+void dis_buffer_put(void* buffer)
+{
+	dis_buffers_t* buffers = NULL;
+	size_t loop = 0;
+
+	if(!buffer)
+		return;
+
+	pthread_once(&buffers_once, buffers_key_init);
+
+	buffers = pthread_getspecific(buffers_key);
+	if(buffers)
+	{
+		for(loop = 0; loop < DIS_BUFFER_SLOTS; ++loop)
+		{
+			if(buffers->slots[loop].buffer == buffer)
+			{
+				buffers->slots[loop].in_use = FALSE;
+				return;
+			}
+		}
+	}
+
+	/* Not kept, it was too big */
+	free(buffer);
+}
+
+
+/**
+ * Free the buffers kept by the calling thread. Other threads' buffers are freed
+ * when they end.
+ */
+void dis_buffers_release()
+{
+	pthread_once(&buffers_once, buffers_key_init);
+
+	buffers_free(pthread_getspecific(buffers_key));
+	pthread_setspecific(buffers_key, NULL);
+}
+
+
+/**
+ * Get the allocation counters
+ *
+ * @param dest Where to put the counters
+ */
+void dis_alloc_stats(dis_alloc_stats_t* dest)
+{
+	if(!dest)
+		return;
+
+	dest->nb_malloc = __atomic_load_n(&stats.nb_malloc, __ATOMIC_RELAXED);
+	dest->nb_free   = __atomic_load_n(&stats.nb_free, __ATOMIC_RELAXED);
+	dest->nb_buffer_reused =
+		__atomic_load_n(&stats.nb_buffer_reused, __ATOMIC_RELAXED);
+	dest->nb_buffer_allocated =
+		__atomic_load_n(&stats.nb_buffer_allocated, __ATOMIC_RELAXED);
+}
+
+
+
+
+/**
+ * Create the key to which each thread's buffers are attached
+ */
+static void buffers_key_init()
+{
+	pthread_key_create(&buffers_key, buffers_free);
+}
+
+
+/**
+ * Free the buffers a thread kept, called when the thread ends
+ *
+ * @param params The thread's buffers
+ */
+static void buffers_free(void* params)
+{
+	dis_buffers_t* buffers = (dis_buffers_t*) params;
+	size_t loop = 0;
+
+	if(!buffers)
+		return;
+
+	for(loop = 0; loop < DIS_BUFFER_SLOTS; ++loop)
+		free(buffers->slots[loop].buffer);
+
+	free(buffers);
+}
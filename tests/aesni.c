@@ -0,0 +1,137 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * Check that sectors enc/decrypted with AES-NI, and VAES when the CPU has it,
+ * are the same as without, for each cipher. The wider kernels are only used
+ * from DIS_AESNI_WIDE_MIN_SIZE bytes on, and CBC is encrypted by chains of
+ * DIS_AESNI_CBC_CHAINS sectors, hence batches on both sides of these.
+ */
+
+#include <stdio.h>
+
+#include "dislocker/common.h"
+#include "dislocker/return_values.h"
+#include "dislocker/encryption/encommon.priv.h"
+
+#include "compare.h"
+
+
+static const uint16_t sector_sizes[] = {512, 1024, 4096};
+
+static const size_t batches[] = {
+	512,
+	3 * 512,
+	DIS_AESNI_WIDE_MIN_SIZE - 512,
+	DIS_AESNI_WIDE_MIN_SIZE,
+	DIS_AESNI_WIDE_MIN_SIZE + 512,
+	(DIS_AESNI_CBC_CHAINS + 1) * 4096
+};
+
+
+
+/** Prototype of functions used internally */
+static dis_crypt_t new_software(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey
+);
+static dis_crypt_t new_default(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey
+);
+
+
+
+
+int main(void)
+{
+	compare_test_t test = {
+		"AES-NI",
+		new_software,
+		new_default,
+		sector_sizes,
+		sizeof(sector_sizes) / sizeof(sector_sizes[0]),
+		batches,
+		sizeof(batches) / sizeof(batches[0])
+	};
+
+	if(!(dis_aesni_features() & DIS_AESNI_AES))
+		printf("The CPU has no AES-NI, the software paths are compared\n");
+
+	return compare_run(&test);
+}
+
+
+/**
+ * Set a crypt structure up without AES-NI, whatever the CPU
+ *
+ * @param sector_size The size of a sector
+ * @param algorithm The cipher
+ * @param fvekey The FVEK
+ * @return The crypt structure, NULL if the keys can't be set
+ */
+static dis_crypt_t new_software(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey)
+{
+	dis_crypt_t crypt = dis_crypt_new(sector_size, algorithm);
+
+	crypt->ctx.aesni  = 0;
+	crypt->ctx.xts_ni = NULL;
+
+	if(dis_crypt_set_fvekey(crypt, algorithm, fvekey) != DIS_RET_SUCCESS)
+	{
+		dis_crypt_destroy(crypt);
+		return NULL;
+	}
+
+	return crypt;
+}
+
+
+/**
+ * Set a crypt structure up as dislocker does, with AES-NI if the CPU has it
+ *
+ * @param sector_size The size of a sector
+ * @param algorithm The cipher
+ * @param fvekey The FVEK
+ * @return The crypt structure, NULL if the keys can't be set
+ */
+static dis_crypt_t new_default(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey)
+{
+	dis_crypt_t crypt = dis_crypt_new(sector_size, algorithm);
+
+	if(dis_crypt_set_fvekey(crypt, algorithm, fvekey) != DIS_RET_SUCCESS)
+	{
+		dis_crypt_destroy(crypt);
+		return NULL;
+	}
+
+	return crypt;
+}
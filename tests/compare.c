@@ -0,0 +1,422 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * Comparison of the sectors enc/decrypted by a crypt structure to the ones of
+ * a reference one: one sector at a time, by batches, in place and from
+ * several threads at once
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dislocker/common.h"
+#include "dislocker/encryption/decrypt.h"
+#include "dislocker/encryption/encrypt.h"
+
+#include "compare.h"
+
+
+/* Number of bytes of each check, several times the largest batches */
+#define COMPARE_SIZE (256 * 1024)
+
+/* Number of threads using the same keys at once */
+#define NB_THREADS 4
+
+/* Where the sectors are, in sectors */
+#define FIRST_SECTOR 0x12345
+
+
+/* A batch of sectors one of the threads enc/decrypts */
+typedef struct _thread_arg {
+	dis_crypt_t crypt;
+	int         encrypt;
+	size_t      nb_sectors;
+	off_t       sector_address;
+	uint8_t*    input;
+	uint8_t*    output;
+} thread_arg_t;
+
+
+static const uint16_t algorithms[] = {
+	AES_128_DIFFUSER,
+	AES_256_DIFFUSER,
+	AES_128_NO_DIFFUSER,
+	AES_256_NO_DIFFUSER,
+	AES_XTS_128,
+	AES_XTS_256
+};
+
+
+
+/** Prototype of functions used internally */
+static void fill(uint8_t* data, size_t size, uint32_t seed);
+static int crypt_sectors(
+	dis_crypt_t crypt,
+	int encrypt,
+	size_t nb_sectors,
+	off_t sector_address,
+	uint8_t* input,
+	uint8_t* output
+);
+static void crypt_sector(
+	dis_crypt_t crypt,
+	int encrypt,
+	off_t sector_address,
+	uint8_t* input,
+	uint8_t* output
+);
+static int crypt_batches(
+	dis_crypt_t crypt,
+	int encrypt,
+	uint16_t sector_size,
+	size_t batch,
+	size_t nb_sectors,
+	off_t sector_address,
+	uint8_t* input,
+	uint8_t* output
+);
+static void* thread_crypt(void* params);
+static int check(
+	const compare_test_t* test,
+	uint16_t algorithm,
+	uint16_t sector_size,
+	int encrypt
+);
+
+
+
+
+/**
+ * Run a comparison for each cipher, sector size, and for the encryption and
+ * the decryption
+ *
+ * @param test The comparison
+ * @return EXIT_SUCCESS if the results were all the same, EXIT_FAILURE
+ * otherwise
+ */
+int compare_run(const compare_test_t* test)
+{
+	size_t algo = 0;
+	size_t size = 0;
+	int    ret  = EXIT_SUCCESS;
+
+	for(algo = 0; algo < sizeof(algorithms) / sizeof(algorithms[0]); algo++)
+		for(size = 0; size < test->nb_sector_sizes; size++)
+		{
+			if(!check(test, algorithms[algo], test->sector_sizes[size], FALSE) ||
+			   !check(test, algorithms[algo], test->sector_sizes[size], TRUE))
+				ret = EXIT_FAILURE;
+		}
+
+	return ret;
+}
+
+
+
+
+/**
+ * Fill a buffer with the same pseudo-random bytes for the same seed
+ *
+ * @param data The buffer
+ * @param size The buffer's size
+ * @param seed The seed, not 0
+ */
+static void fill(uint8_t* data, size_t size, uint32_t seed)
+{
+	size_t loop = 0;
+
+	for(loop = 0; loop < size; loop++)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		data[loop] = (uint8_t) seed;
+	}
+}
+
+
+/**
+ * Encrypt or decrypt contiguous sectors at once
+ *
+ * @param crypt The crypt structure
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param nb_sectors The number of sectors
+ * @param sector_address The address of the first sector
+ * @param input The sectors
+ * @param output Where to put the result, may be the input
+ * @return TRUE if it went well, FALSE otherwise
+ */
+static int crypt_sectors(
+	dis_crypt_t crypt,
+	int encrypt,
+	size_t nb_sectors,
+	off_t sector_address,
+	uint8_t* input,
+	uint8_t* output)
+{
+	if(encrypt)
+		return dis_crypt_encrypt_sectors(
+			crypt, nb_sectors, sector_address, input, output
+		);
+
+	return dis_crypt_decrypt_sectors(
+		crypt, nb_sectors, sector_address, input, output
+	);
+}
+
+
+/**
+ * Encrypt or decrypt a single sector
+ *
+ * @param crypt The crypt structure
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param sector_address The address of the sector
+ * @param input The sector
+ * @param output Where to put the result
+ */
+static void crypt_sector(
+	dis_crypt_t crypt,
+	int encrypt,
+	off_t sector_address,
+	uint8_t* input,
+	uint8_t* output)
+{
+	if(encrypt)
+		encrypt_sector(crypt, input, sector_address, output);
+	else
+		decrypt_sector(crypt, input, sector_address, output);
+}
+
+
+/**
+ * Encrypt or decrypt sectors by batches, the last one being smaller
+ *
+ * @param crypt The crypt structure
+ * @param encrypt TRUE to encrypt, FALSE to decrypt
+ * @param sector_size The size of a sector
+ * @param batch The number of sectors of a batch
+ * @param nb_sectors The number of sectors
+ * @param sector_address The address of the first sector
+ * @param input The sectors
+ * @param output Where to put the result, may be the input
+ * @return TRUE if it went well, FALSE otherwise
+ */
+static int crypt_batches(
+	dis_crypt_t crypt,
+	int encrypt,
+	uint16_t sector_size,
+	size_t batch,
+	size_t nb_sectors,
+	off_t sector_address,
+	uint8_t* input,
+	uint8_t* output)
+{
+	size_t done = 0;
+	int    ret  = TRUE;
+
+	for(done = 0; done < nb_sectors; done += batch)
+	{
+		if(batch > nb_sectors - done)
+			batch = nb_sectors - done;
+
+		if(!crypt_sectors(
+				crypt,
+				encrypt,
+				batch,
+				sector_address + (off_t) sector_size * (off_t) done,
+				input + sector_size * done,
+				output + sector_size * done))
+			ret = FALSE;
+	}
+
+	return ret;
+}
+
+
+/**
+ * Encrypt or decrypt a thread's batch of sectors
+ *
+ * @param params The thread's batch
+ * @return NULL if it went well, the batch otherwise
+ */
+static void* thread_crypt(void* params)
+{
+	thread_arg_t* args = (thread_arg_t*) params;
+
+	if(!crypt_sectors(
+			args->crypt,
+			args->encrypt,
+			args->nb_sectors,
+			args->sector_address,
+			args->input,
+			args->output))
+		return args;
+
+	return NULL;
+}
+
+
+/**
+ * Compare a crypt structure to the reference, for a cipher and a sector size
+ *
+ * @param test The comparison
+ * @param algorithm The cipher
+ * @param sector_size The size of a sector
+ * @param encrypt TRUE to check the encryption, FALSE for the decryption
+ * @return TRUE if they gave the same results, FALSE otherwise
+ */
+static int check(
+	const compare_test_t* test,
+	uint16_t algorithm,
+	uint16_t sector_size,
+	int encrypt)
+{
+	pthread_t    threads[NB_THREADS];
+	thread_arg_t args[NB_THREADS];
+	uint8_t      fvekey[64];
+	dis_crypt_t  reference  = NULL;
+	dis_crypt_t  tested     = NULL;
+	size_t       nb_sectors = COMPARE_SIZE / sector_size;
+	size_t       size       = COMPARE_SIZE;
+	off_t        address    = (off_t) sector_size * FIRST_SECTOR;
+	uint8_t*     input      = malloc(size);
+	uint8_t*     ref        = malloc(size);
+	uint8_t*     output     = malloc(size);
+	size_t       loop       = 0;
+	size_t       offset     = 0;
+	void*        failed     = NULL;
+	const char*  what       = NULL;
+	char         batch_what[64];
+	int          ret        = FALSE;
+
+	fill(fvekey, sizeof(fvekey), 0x8badf00d ^ algorithm);
+	fill(input, size, 0xdeadbeef ^ sector_size);
+
+	reference = test->new_reference(sector_size, algorithm, fvekey);
+	tested    = test->new_tested(sector_size, algorithm, fvekey);
+	if(!reference || !tested)
+	{
+		what = "setting the keys up";
+		goto end;
+	}
+
+	/* The reference, one sector at a time */
+	for(loop = 0; loop < nb_sectors; loop++)
+	{
+		offset = (size_t) sector_size * loop;
+		crypt_sector(reference, encrypt, address + (off_t) offset, input + offset, ref + offset);
+	}
+
+	/* One sector at a time */
+	memset(output, 0, size);
+	for(loop = 0; loop < nb_sectors; loop++)
+	{
+		offset = (size_t) sector_size * loop;
+		crypt_sector(tested, encrypt, address + (off_t) offset, input + offset, output + offset);
+	}
+	if(memcmp(ref, output, size) != 0)
+	{
+		what = "single sectors";
+		goto end;
+	}
+
+	/* By batches, then all of the sectors at once */
+	for(loop = 0; loop <= test->nb_batches; loop++)
+	{
+		size_t batch = nb_sectors;
+
+		if(loop < test->nb_batches)
+			batch = (test->batches[loop] + sector_size - 1) / sector_size;
+		if(batch == 0)
+			batch = 1;
+
+		memset(output, 0, size);
+		if(!crypt_batches(tested, encrypt, sector_size, batch, nb_sectors, address, input, output) ||
+		   memcmp(ref, output, size) != 0)
+		{
+			snprintf(batch_what, sizeof(batch_what), "batches of %#zx sectors", batch);
+			what = batch_what;
+			goto end;
+		}
+
+		memcpy(output, input, size);
+		if(!crypt_batches(tested, encrypt, sector_size, batch, nb_sectors, address, output, output) ||
+		   memcmp(ref, output, size) != 0)
+		{
+			snprintf(batch_what, sizeof(batch_what), "batches of %#zx sectors in place", batch);
+			what = batch_what;
+			goto end;
+		}
+	}
+
+	/* Several threads with the same keys */
+	memset(output, 0, size);
+	for(loop = 0; loop < NB_THREADS; loop++)
+	{
+		offset = nb_sectors / NB_THREADS * loop;
+
+		args[loop].crypt          = tested;
+		args[loop].encrypt        = encrypt;
+		args[loop].nb_sectors     = nb_sectors / NB_THREADS;
+		args[loop].sector_address = address + (off_t) (sector_size * offset);
+		args[loop].input          = input + sector_size * offset;
+		args[loop].output         = output + sector_size * offset;
+		pthread_create(&threads[loop], NULL, thread_crypt, &args[loop]);
+	}
+	for(loop = 0; loop < NB_THREADS; loop++)
+	{
+		void* thread_ret = NULL;
+		pthread_join(threads[loop], &thread_ret);
+		if(thread_ret)
+			failed = thread_ret;
+	}
+	if(failed || memcmp(ref, output, size) != 0)
+	{
+		what = "several threads";
+		goto end;
+	}
+
+	ret = TRUE;
+
+end:
+	printf(
+		"%s: %s, %#hx, %hu bytes sectors, %s%s%s\n",
+		ret ? "OK" : "FAILED",
+		test->name,
+		algorithm,
+		sector_size,
+		encrypt ? "encryption" : "decryption",
+		what ? ", " : "",
+		what ? what : ""
+	);
+
+	dis_crypt_destroy(reference);
+	dis_crypt_destroy(tested);
+	free(input);
+	free(ref);
+	free(output);
+	return ret;
+}
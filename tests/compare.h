@@ -0,0 +1,77 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef TESTS_COMPARE_H
+#define TESTS_COMPARE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dislocker/encryption/encommon.h"
+
+
+/* Exit code of a test which can't run here, for ctest to report it skipped */
+#define COMPARE_SKIPPED 77
+
+
+/**
+ * Function creating a crypt structure with its keys set, returning NULL if it
+ * can't be set up the way the test wants it
+ */
+typedef dis_crypt_t (*compare_new_fn_t)(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey
+);
+
+
+/**
+ * Comparison of the sectors enc/decrypted by a crypt structure to the ones of
+ * a reference one, for each cipher and each sector size
+ */
+typedef struct _compare_test {
+	/* What's compared to the reference, for the report */
+	const char*      name;
+
+	compare_new_fn_t new_reference;
+	compare_new_fn_t new_tested;
+
+	const uint16_t*  sector_sizes;
+	size_t           nb_sector_sizes;
+
+	/*
+	 * Sizes of the batches the sectors are enc/decrypted by, in bytes, rounded
+	 * up to whole sectors. All of the sectors at once is always checked too.
+	 */
+	const size_t*    batches;
+	size_t           nb_batches;
+} compare_test_t;
+
+
+
+/*
+ * Prototypes
+ */
+int compare_run(const compare_test_t* test);
+
+
+#endif /* TESTS_COMPARE_H */
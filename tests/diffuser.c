@@ -0,0 +1,362 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * Check the diffusers A and B against their reference implementations, on
+ * fixed vectors: the scalar kernels, the AVX2 ones when the CPU has them, and
+ * the whole diffuser stage of a sector, generic and for 512 and 4096 bytes.
+ *
+ * The diffuser's code is included so that its kernels can be called directly.
+ * Built with TEST_SCALAR, the AVX2 code is left out and the exported functions
+ * use the scalar kernels whatever the CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dislocker/common.h"
+
+#ifdef TEST_SCALAR
+#  undef _HAVE_AESNI
+#endif /* TEST_SCALAR */
+
+#include "encryption/diffuser.c"
+
+
+/* The largest sector checked */
+#define MAX_SECTOR_SIZE 8192
+
+
+/* A diffuser, as exported or as a kernel on the elements */
+typedef void (*diffuser_fn_t)(uint8_t* sector, uint16_t sector_size, uint32_t* buffer);
+typedef void (*kernel_fn_t)(uint32_t* d, int int_size);
+
+/* The diffuser stage of a sector, as exported */
+typedef void (*decrypt_sector_fn_t)(uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key);
+typedef void (*encrypt_sector_fn_t)(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer);
+
+
+/* 512 and 4096 bytes, but also sizes the kernels fit less well or don't fit */
+static const uint16_t sector_sizes[] = {32, 64, 96, 512, 1024, 2048, 4096, 8192};
+
+
+/* Sectors' data, aligned for the kernels to be used on them as elements */
+static uint32_t input_space[MAX_SECTOR_SIZE / 4];
+static uint32_t ref_space[MAX_SECTOR_SIZE / 4];
+static uint32_t output_space[MAX_SECTOR_SIZE / 4];
+
+static uint8_t* const input  = (uint8_t*) input_space;
+static uint8_t* const ref    = (uint8_t*) ref_space;
+static uint8_t* const output = (uint8_t*) output_space;
+
+
+
+/** Prototype of functions used internally */
+static void fill(uint8_t* data, size_t size, uint32_t seed);
+static int report(int ok, const char* what, uint16_t sector_size);
+static int check_diffuser(
+	const char* name,
+	diffuser_fn_t diffuser,
+	diffuser_fn_t reference,
+	uint16_t sector_size
+);
+static int check_kernel(
+	const char* name,
+	kernel_fn_t kernel,
+	diffuser_fn_t reference,
+	uint16_t sector_size
+);
+static void decrypt_sector_reference(uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key);
+static void encrypt_sector_reference(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer);
+static int check_sector(
+	const char* name,
+	decrypt_sector_fn_t decrypt,
+	encrypt_sector_fn_t encrypt,
+	uint16_t sector_size
+);
+static int check_sizes(uint16_t sector_size);
+
+
+
+
+int main(void)
+{
+	size_t size = 0;
+	int    ret  = EXIT_SUCCESS;
+
+#ifdef _HAVE_AESNI
+	if(!use_avx2())
+		printf("The CPU has no AVX2, its kernels are left out\n");
+#else
+	printf("Built without the AVX2 kernels\n");
+#endif /* _HAVE_AESNI */
+
+	for(size = 0; size < sizeof(sector_sizes) / sizeof(sector_sizes[0]); size++)
+	{
+		if(!check_sizes(sector_sizes[size]))
+			ret = EXIT_FAILURE;
+	}
+
+	if(!check_sector("512 bytes sectors", diffuser_decrypt_sector_512, diffuser_encrypt_sector_512, 512) ||
+	   !check_sector("4096 bytes sectors", diffuser_decrypt_sector_4096, diffuser_encrypt_sector_4096, 4096))
+		ret = EXIT_FAILURE;
+
+	return ret;
+}
+
+
+/**
+ * Fill a buffer with the same pseudo-random bytes for the same seed
+ *
+ * @param data The buffer
+ * @param size The buffer's size
+ * @param seed The seed, not 0
+ */
+static void fill(uint8_t* data, size_t size, uint32_t seed)
+{
+	size_t loop = 0;
+
+	for(loop = 0; loop < size; loop++)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		data[loop] = (uint8_t) seed;
+	}
+}
+
+
+/**
+ * Print the result of a check
+ *
+ * @param ok Whether the check went well
+ * @param what What was checked
+ * @param sector_size The size of the sectors it was checked on
+ * @return ok
+ */
+static int report(int ok, const char* what, uint16_t sector_size)
+{
+	printf("%s: %s, %hu bytes sectors\n", ok ? "OK" : "FAILED", what, sector_size);
+	return ok;
+}
+
+
+/**
+ * Compare one of the exported diffusers to its reference, out of place and in
+ * place
+ *
+ * @param name The diffuser's name
+ * @param diffuser The diffuser
+ * @param reference Its reference
+ * @param sector_size The size of the sector
+ * @return TRUE if they gave the same results, FALSE otherwise
+ */
+static int check_diffuser(
+	const char* name,
+	diffuser_fn_t diffuser,
+	diffuser_fn_t reference,
+	uint16_t sector_size)
+{
+	int ok = FALSE;
+
+	fill(input, sector_size, 0xdeadbeef ^ sector_size);
+	reference(input, sector_size, ref_space);
+
+	memset(output, 0, sector_size);
+	diffuser(input, sector_size, output_space);
+	ok = memcmp(ref, output, sector_size) == 0;
+
+	memcpy(output, input, sector_size);
+	diffuser(output, sector_size, output_space);
+	ok = ok && memcmp(ref, output, sector_size) == 0;
+
+	return report(ok, name, sector_size);
+}
+
+
+/**
+ * Compare one of the kernels to its diffuser's reference
+ *
+ * @param name The kernel's name
+ * @param kernel The kernel, working in place
+ * @param reference The reference of its diffuser
+ * @param sector_size The size of the sector, see KERNELS_FIT()
+ * @return TRUE if they gave the same results, FALSE otherwise
+ */
+static int check_kernel(
+	const char* name,
+	kernel_fn_t kernel,
+	diffuser_fn_t reference,
+	uint16_t sector_size)
+{
+	fill(input, sector_size, 0xcafebabe ^ sector_size);
+	reference(input, sector_size, ref_space);
+
+	memcpy(output, input, sector_size);
+	kernel(output_space, sector_size / 4);
+
+	return report(memcmp(ref, output, sector_size) == 0, name, sector_size);
+}
+
+
+/**
+ * Undo the diffuser stage of a sector with the references only
+ *
+ * @param sector The sector to de-diffuse, in place
+ * @param sector_size The size of the sector (in bytes)
+ * @param sector_key The sector's 32 bytes key
+ */
+static void decrypt_sector_reference(uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key)
+{
+	uint32_t buffer[MAX_SECTOR_SIZE / 4];
+	uint16_t loop = 0;
+
+	diffuserB_decrypt_reference(sector, sector_size, buffer);
+	diffuserA_decrypt_reference((uint8_t*) buffer, sector_size, (uint32_t*) sector);
+
+	for(loop = 0; loop < sector_size; loop++)
+		sector[loop] ^= sector_key[loop % 32];
+}
+
+
+/**
+ * The diffuser stage of a sector with the references only
+ *
+ * @param sector The sector to diffuse
+ * @param sector_size The size of the sector (in bytes)
+ * @param sector_key The sector's 32 bytes key
+ * @param buffer The diffused sector, not overlapping the sector
+ */
+static void encrypt_sector_reference(const uint8_t* sector, uint16_t sector_size, const uint8_t* sector_key, uint8_t* buffer)
+{
+	uint32_t keyed[MAX_SECTOR_SIZE / 4];
+	uint16_t loop = 0;
+
+	for(loop = 0; loop < sector_size; loop++)
+		((uint8_t*) keyed)[loop] = sector[loop] ^ sector_key[loop % 32];
+
+	diffuserA_encrypt_reference((uint8_t*) keyed, sector_size, (uint32_t*) buffer);
+	diffuserB_encrypt_reference(buffer, sector_size, keyed);
+	memcpy(buffer, keyed, sector_size);
+}
+
+
+/**
+ * Compare the diffuser stage of a sector to the one made of the references,
+ * out of place and in place, and check that it's undone
+ *
+ * @param name The functions' name
+ * @param decrypt Undoes the diffuser stage of a sector
+ * @param encrypt Does the diffuser stage of a sector
+ * @param sector_size The size of the sector
+ * @return TRUE if they gave the same results, FALSE otherwise
+ */
+static int check_sector(
+	const char* name,
+	decrypt_sector_fn_t decrypt,
+	encrypt_sector_fn_t encrypt,
+	uint16_t sector_size)
+{
+	uint8_t sector_key[32];
+	char    what[64];
+	int     ok  = FALSE;
+	int     ret = TRUE;
+
+	fill(sector_key, sizeof(sector_key), 0x8badf00d ^ sector_size);
+
+	/* Undoing it */
+	fill(input, sector_size, 0x0ddba11 ^ sector_size);
+	memcpy(ref, input, sector_size);
+	decrypt_sector_reference(ref, sector_size, sector_key);
+
+	memcpy(output, input, sector_size);
+	decrypt(output, sector_size, sector_key);
+
+	snprintf(what, sizeof(what), "%s, decryption", name);
+	if(!report(memcmp(ref, output, sector_size) == 0, what, sector_size))
+		ret = FALSE;
+
+	/* Doing it, out of place then in place */
+	encrypt_sector_reference(input, sector_size, sector_key, ref);
+
+	memset(output, 0, sector_size);
+	encrypt(input, sector_size, sector_key, output);
+	ok = memcmp(ref, output, sector_size) == 0;
+
+	memcpy(output, input, sector_size);
+	encrypt(output, sector_size, sector_key, output);
+	ok = ok && memcmp(ref, output, sector_size) == 0;
+
+	snprintf(what, sizeof(what), "%s, encryption", name);
+	if(!report(ok, what, sector_size))
+		ret = FALSE;
+
+	/* And back */
+	decrypt(output, sector_size, sector_key);
+
+	snprintf(what, sizeof(what), "%s, round trip", name);
+	if(!report(memcmp(input, output, sector_size) == 0, what, sector_size))
+		ret = FALSE;
+
+	return ret;
+}
+
+
+/**
+ * Run the checks on sectors of a size
+ *
+ * @param sector_size The size of the sectors
+ * @return TRUE if they all went well, FALSE otherwise
+ */
+static int check_sizes(uint16_t sector_size)
+{
+	int ret = TRUE;
+
+	if(!check_diffuser("diffuser A, decryption", diffuserA_decrypt, diffuserA_decrypt_reference, sector_size) ||
+	   !check_diffuser("diffuser B, decryption", diffuserB_decrypt, diffuserB_decrypt_reference, sector_size) ||
+	   !check_diffuser("diffuser A, encryption", diffuserA_encrypt, diffuserA_encrypt_reference, sector_size) ||
+	   !check_diffuser("diffuser B, encryption", diffuserB_encrypt, diffuserB_encrypt_reference, sector_size))
+		ret = FALSE;
+
+	if(KERNELS_FIT(sector_size / 4))
+	{
+		if(!check_kernel("scalar diffuser A, decryption", a_decrypt, diffuserA_decrypt_reference, sector_size) ||
+		   !check_kernel("scalar diffuser B, decryption", b_decrypt, diffuserB_decrypt_reference, sector_size) ||
+		   !check_kernel("scalar diffuser A, encryption", a_encrypt, diffuserA_encrypt_reference, sector_size) ||
+		   !check_kernel("scalar diffuser B, encryption", b_encrypt, diffuserB_encrypt_reference, sector_size))
+			ret = FALSE;
+
+#ifdef _HAVE_AESNI
+		if(use_avx2() && (
+		   !check_kernel("AVX2 diffuser B, decryption", diffuserB_decrypt_avx2, diffuserB_decrypt_reference, sector_size) ||
+		   !check_kernel("AVX2 diffuser A, encryption", diffuserA_encrypt_avx2, diffuserA_encrypt_reference, sector_size)))
+			ret = FALSE;
+#endif /* _HAVE_AESNI */
+	}
+
+	if(!check_sector("sector", diffuser_decrypt_sector, diffuser_encrypt_sector, sector_size))
+		ret = FALSE;
+
+	return ret;
+}
@@ -0,0 +1,124 @@
+/* -*- coding: utf-8 -*- */
+/* -*- mode: c -*- */
+/*
+ * Dislocker -- enables to read/write on BitLocker encrypted partitions under
+ * Linux
+ * Copyright (C) 2012-2013  Romain Coltel, Hervé Schauer Consultants
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * Check that sectors enc/decrypted with OpenSSL's backend are the same as with
+ * the builtin implementation, for each cipher
+ */
+
+#include "dislocker/common.h"
+#include "dislocker/return_values.h"
+#include "dislocker/encryption/encommon.priv.h"
+
+#include "compare.h"
+
+
+static const uint16_t sector_sizes[] = {512, 4096};
+
+/* Single sectors, an odd number of them, and half of a check */
+static const size_t batches[] = {1, 3 * 512, 128 * 1024};
+
+
+
+/** Prototype of functions used internally */
+static dis_crypt_t new_builtin(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey
+);
+static dis_crypt_t new_evp(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey
+);
+
+
+
+
+int main(void)
+{
+	compare_test_t test = {
+		"OpenSSL",
+		new_builtin,
+		new_evp,
+		sector_sizes,
+		sizeof(sector_sizes) / sizeof(sector_sizes[0]),
+		batches,
+		sizeof(batches) / sizeof(batches[0])
+	};
+
+	return compare_run(&test);
+}
+
+
+/**
+ * Set a crypt structure up with the builtin implementation
+ *
+ * @param sector_size The size of a sector
+ * @param algorithm The cipher
+ * @param fvekey The FVEK
+ * @return The crypt structure, NULL if the keys can't be set
+ */
+static dis_crypt_t new_builtin(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey)
+{
+	dis_crypt_t crypt = dis_crypt_new(sector_size, algorithm);
+
+	if(dis_crypt_set_fvekey(crypt, algorithm, fvekey) != DIS_RET_SUCCESS)
+	{
+		dis_crypt_destroy(crypt);
+		return NULL;
+	}
+
+	return crypt;
+}
+
+
+/**
+ * Set a crypt structure up with OpenSSL's backend
+ *
+ * @param sector_size The size of a sector
+ * @param algorithm The cipher
+ * @param fvekey The FVEK
+ * @return The crypt structure, NULL if OpenSSL can't be used
+ */
+static dis_crypt_t new_evp(
+	uint16_t sector_size,
+	uint16_t algorithm,
+	uint8_t* fvekey)
+{
+	dis_crypt_t crypt = dis_crypt_new(sector_size, algorithm);
+
+	/* The builtin implementation is used if OpenSSL refused the keys */
+	if(dis_crypt_set_backend(crypt, DIS_CRYPT_BACKEND_OPENSSL) != DIS_RET_SUCCESS ||
+	   dis_crypt_set_fvekey(crypt, algorithm, fvekey) != DIS_RET_SUCCESS ||
+	   !crypt->ctx.evp)
+	{
+		dis_crypt_destroy(crypt);
+		return NULL;
+	}
+
+	return crypt;
+}